@@ -252,8 +252,6 @@ render (ChamplainRenderer *renderer, ChamplainTile *tile)
   actor = clutter_actor_new ();
   clutter_actor_set_size (actor, size, size);
   clutter_actor_set_content (actor, priv->error_canvas);
-  /* has to be set for proper opacity */
-  clutter_actor_set_offscreen_redirect (actor, CLUTTER_OFFSCREEN_REDIRECT_AUTOMATIC_FOR_OPACITY);
 
   champlain_tile_set_content (tile, actor);
   g_signal_emit_by_name (tile, "render-complete", data, size, error);
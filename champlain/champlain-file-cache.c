@@ -23,13 +23,24 @@
  *
  * #ChamplainFileCache is a cache that stores and retrieves tiles from the
  * file system. Tiles most frequently loaded gain in "popularity". This popularity
- * is taken into account when purging the cache.
+ * decays over time when a tile isn't used and is taken into account when
+ * purging the cache. The total size of the cache is kept up to date in the
+ * database so it doesn't have to be recomputed by a purge.
+ *
+ * All file system and database access is performed by a dedicated I/O
+ * thread which owns the cache's database connection, so the main loop never
+ * blocks on the disk. Tiles are loaded asynchronously and stores, popularity
+ * updates and purges are queued as jobs for this thread. Changes of the tile
+ * database are collected and written in a single transaction. Pending
+ * changes are written when the cache is disposed.
  */
 
 #define DEBUG_FLAG CHAMPLAIN_DEBUG_CACHE
 #include "champlain-debug.h"
 
 #include "champlain-file-cache.h"
+#include "champlain-private.h"
+#include "champlain-tile-table.h"
 
 #include <sqlite3.h>
 #include <errno.h>
@@ -37,12 +48,29 @@
 #include <gio/gio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <glib/gstdio.h>
+#include <math.h>
 
 G_DEFINE_TYPE (ChamplainFileCache, champlain_file_cache, CHAMPLAIN_TYPE_TILE_CACHE);
 
 #define GET_PRIVATE(obj) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((obj), CHAMPLAIN_TYPE_FILE_CACHE, ChamplainFileCachePrivate))
 
+/* number of queued database changes after which they are written
+ * immediately */
+#define WRITE_BATCH_SIZE 100
+/* maximal time in ms database changes stay queued */
+#define WRITE_INTERVAL 500
+/* maximal number of tiles deleted in one purge step */
+#define PURGE_SLICE_SIZE 500
+/* maximal number of remembered rowids; the index is only a shortcut for
+ * popularity updates so it is simply cleared when full */
+#define ROWID_INDEX_SIZE_LIMIT 10000
+/* time in seconds after which the popularity of an unused tile halves */
+#define POPULARITY_HALF_LIFE (7 * 24 * 60 * 60)
+/* version of the database schema, stored as user_version */
+#define SCHEMA_VERSION 3
+
 enum
 {
   PROP_0,
@@ -55,20 +83,109 @@ struct _ChamplainFileCachePrivate
   guint size_limit;
   gchar *cache_dir;
 
+  /* maps tile keys to rowids of the tiles table */
+  ChamplainTileTable *rowids;
+  gchar *source_id_name;
+  guint16 source_id;
+  /* ids of the map sources of the indexed tiles */
+  GHashTable *source_ids;
+
+  /* write-behind queue */
+  GPtrArray *pending_writes;
+  /* file names of the tiles with queued stores, owned by pending_writes */
+  GHashTable *pending_stores;
+  guint write_timeout;
+
+  /* all file and database access happens in the I/O thread, the
+   * connection and statements below are used by this thread only */
+  GThreadPool *io_thread;
   sqlite3 *db;
   sqlite3_stmt *stmt_select;
-  sqlite3_stmt *stmt_update;
+  sqlite3_stmt *stmt_store;
+  sqlite3_stmt *stmt_store_missing;
+  sqlite3_stmt *stmt_touch;
+  sqlite3_stmt *stmt_popularity;
+  sqlite3_stmt *stmt_popularity_rowid;
+  sqlite3_stmt *stmt_size;
+  sqlite3_stmt *stmt_evict;
+  sqlite3_stmt *stmt_evict_expired;
+  sqlite3_stmt *stmt_delete;
 };
 
-static void finalize_sql (ChamplainFileCache *file_cache);
-static void init_cache (ChamplainFileCache *file_cache);
+typedef enum
+{
+  JOB_INIT,
+  JOB_LOAD,
+  JOB_WRITE,
+  JOB_PURGE
+} JobType;
+
+/* Every job starts with its type */
+typedef struct
+{
+  JobType type;
+} Job;
+
+typedef struct
+{
+  Job job;
+  ChamplainFileCache *file_cache;
+  ChamplainTile *tile;
+  guint64 key;
+  gchar *filename;
+  /* results */
+  gchar *contents;
+  gsize length;
+  GTimeVal modified_time;
+  gboolean has_modified_time;
+  gchar *etag;
+  gint64 expires;
+  sqlite3_int64 rowid;
+  gboolean missing;
+} LoadJob;
+
+typedef enum
+{
+  WRITE_STORE,
+  WRITE_STORE_MISSING,
+  WRITE_TOUCH,
+  WRITE_POPULARITY
+} WriteType;
+
+typedef struct
+{
+  WriteType type;
+  gchar *filename;
+  gchar *etag;
+  GBytes *data;
+  gint64 expires;
+  sqlite3_int64 rowid;
+} WriteOp;
+
+typedef struct
+{
+  Job job;
+  GPtrArray *ops;
+} WriteJob;
+
+typedef struct
+{
+  Job job;
+  ChamplainFileCache *file_cache;
+  guint size_limit;
+  gboolean finished;
+} PurgeJob;
+
+static void run_job (Job *job,
+    ChamplainFileCache *file_cache);
+static void push_job (ChamplainFileCache *file_cache,
+    Job *job);
+static void free_write_op (WriteOp *op);
+static void flush_writes (ChamplainFileCache *file_cache);
 static gchar *get_filename (ChamplainFileCache *file_cache,
     ChamplainTile *tile);
 static gboolean tile_is_expired (ChamplainFileCache *file_cache,
     ChamplainTile *tile);
-static void delete_tile (ChamplainFileCache *file_cache,
-    const gchar *filename);
-static gboolean create_cache_dir (const gchar *dir_name);
 
 static void fill_tile (ChamplainMapSource *map_source,
     ChamplainTile *tile);
@@ -81,6 +198,8 @@ static void refresh_tile_time (ChamplainTileCache *tile_cache,
     ChamplainTile *tile);
 static void on_tile_filled (ChamplainTileCache *tile_cache,
     ChamplainTile *tile);
+static void store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
 
 static void
 champlain_file_cache_get_property (GObject *object,
@@ -136,6 +255,17 @@ champlain_file_cache_set_property (GObject *object,
 static void
 champlain_file_cache_dispose (GObject *object)
 {
+  ChamplainFileCache *file_cache = CHAMPLAIN_FILE_CACHE (object);
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+
+  /* write all pending changes and wait until they are written */
+  if (priv->io_thread)
+    {
+      flush_writes (file_cache);
+      g_thread_pool_free (priv->io_thread, FALSE, TRUE);
+      priv->io_thread = NULL;
+    }
+
   G_OBJECT_CLASS (champlain_file_cache_parent_class)->dispose (object);
 }
 
@@ -146,17 +276,26 @@ finalize_sql (ChamplainFileCache *file_cache)
   ChamplainFileCachePrivate *priv = file_cache->priv;
   gint error;
 
-  if (priv->stmt_select)
-    {
-      sqlite3_finalize (priv->stmt_select);
-      priv->stmt_select = NULL;
-    }
-
-  if (priv->stmt_update)
-    {
-      sqlite3_finalize (priv->stmt_update);
-      priv->stmt_update = NULL;
-    }
+  sqlite3_finalize (priv->stmt_select);
+  priv->stmt_select = NULL;
+  sqlite3_finalize (priv->stmt_store);
+  priv->stmt_store = NULL;
+  sqlite3_finalize (priv->stmt_store_missing);
+  priv->stmt_store_missing = NULL;
+  sqlite3_finalize (priv->stmt_touch);
+  priv->stmt_touch = NULL;
+  sqlite3_finalize (priv->stmt_popularity);
+  priv->stmt_popularity = NULL;
+  sqlite3_finalize (priv->stmt_popularity_rowid);
+  priv->stmt_popularity_rowid = NULL;
+  sqlite3_finalize (priv->stmt_size);
+  priv->stmt_size = NULL;
+  sqlite3_finalize (priv->stmt_evict);
+  priv->stmt_evict = NULL;
+  sqlite3_finalize (priv->stmt_evict_expired);
+  priv->stmt_evict_expired = NULL;
+  sqlite3_finalize (priv->stmt_delete);
+  priv->stmt_delete = NULL;
 
   if (priv->db)
     {
@@ -176,6 +315,11 @@ champlain_file_cache_finalize (GObject *object)
 
   finalize_sql (file_cache);
 
+  champlain_tile_table_free (priv->rowids);
+  g_ptr_array_unref (priv->pending_writes);
+  g_hash_table_unref (priv->pending_stores);
+  g_free (priv->source_id_name);
+  g_hash_table_unref (priv->source_ids);
   g_free (priv->cache_dir);
 
   G_OBJECT_CLASS (champlain_file_cache_parent_class)->finalize (object);
@@ -199,6 +343,150 @@ create_cache_dir (const gchar *dir_name)
 }
 
 
+static gboolean
+prepare_statement (ChamplainFileCache *file_cache,
+    const gchar *query,
+    sqlite3_stmt **stmt)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  gint error;
+
+  error = sqlite3_prepare_v2 (priv->db, query, -1, stmt, NULL);
+  if (error != SQLITE_OK)
+    {
+      *stmt = NULL;
+      DEBUG ("Failed to prepare '%s', error: %s", query, sqlite3_errmsg (priv->db));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/* The eviction score of a tile is log2 (popularity) + t / POPULARITY_HALF_LIFE
+ * where popularity is the decayed number of uses at the time t of the last
+ * use. Ordering tiles by the score orders them by their decayed popularity at
+ * any later time, so the popularity of all tiles decays without updating
+ * them and the least valuable tiles can be found through an index. */
+gdouble
+champlain_file_cache_get_current_score (void)
+{
+  return g_get_real_time () / ((gdouble) G_USEC_PER_SEC * POPULARITY_HALF_LIFE);
+}
+
+
+/* SQL function champlain_bump_score (score, now) returning the score after
+ * one more use of the tile at the time now */
+static void
+bump_score (sqlite3_context *context,
+    int argc,
+    sqlite3_value **argv)
+{
+  gdouble score = sqlite3_value_double (argv[0]);
+  gdouble now = sqlite3_value_double (argv[1]);
+
+  sqlite3_result_double (context, now + log2 (exp2 (score - now) + 1.0));
+}
+
+
+void
+champlain_file_cache_register_score_function (struct sqlite3 *db)
+{
+  sqlite3_create_function (db, "champlain_bump_score", 2, SQLITE_UTF8,
+      NULL, bump_score, NULL, NULL);
+}
+
+
+/* Runs in the I/O thread - brings databases created by older versions up to
+ * date */
+static gboolean
+upgrade_schema (ChamplainFileCache *file_cache)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  sqlite3_stmt *stmt;
+  gchar *error_msg = NULL;
+  gint version = 0;
+
+  if (sqlite3_prepare_v2 (priv->db, "PRAGMA user_version", -1, &stmt, NULL) == SQLITE_OK)
+    {
+      if (sqlite3_step (stmt) == SQLITE_ROW)
+        version = sqlite3_column_int (stmt, 0);
+      sqlite3_finalize (stmt);
+    }
+
+  if (version >= SCHEMA_VERSION)
+    return TRUE;
+
+  DEBUG ("Upgrading cache.db from version %d", version);
+
+  sqlite3_exec (priv->db, "BEGIN", NULL, NULL, NULL);
+
+  /* version 1: running total of the cache size and the eviction index */
+  if (version < 1)
+    {
+      /* fails when the table has just been created with the column */
+      sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN score REAL DEFAULT 0", NULL, NULL, NULL);
+
+      /* existing tiles are treated as used now */
+      if (sqlite3_prepare_v2 (priv->db, "UPDATE tiles SET score = ?", -1, &stmt, NULL) == SQLITE_OK)
+        {
+          sqlite3_bind_double (stmt, 1, champlain_file_cache_get_current_score ());
+          sqlite3_step (stmt);
+          sqlite3_finalize (stmt);
+        }
+
+      /* REPLACE doesn't fire delete triggers, the insert trigger subtracts the
+       * size of the replaced row itself */
+      sqlite3_exec (priv->db,
+          "CREATE TABLE IF NOT EXISTS cache_size (size INT);"
+          "DELETE FROM cache_size;"
+          "INSERT INTO cache_size SELECT IFNULL (SUM (size), 0) FROM tiles;"
+          "CREATE INDEX IF NOT EXISTS tiles_score ON tiles (score);"
+          "CREATE TRIGGER IF NOT EXISTS tiles_insert BEFORE INSERT ON tiles BEGIN "
+          "UPDATE cache_size SET size = size + NEW.size - "
+          "IFNULL ((SELECT size FROM tiles WHERE filename = NEW.filename), 0); END;"
+          "CREATE TRIGGER IF NOT EXISTS tiles_delete AFTER DELETE ON tiles BEGIN "
+          "UPDATE cache_size SET size = size - OLD.size; END;"
+          "CREATE TRIGGER IF NOT EXISTS tiles_update AFTER UPDATE OF size ON tiles BEGIN "
+          "UPDATE cache_size SET size = size - OLD.size + NEW.size; END;",
+          NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        goto error;
+    }
+
+  /* version 2: expiration times sent by the servers */
+  if (version < 2)
+    {
+      sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN expires INT DEFAULT 0", NULL, NULL, NULL);
+      sqlite3_exec (priv->db,
+          "CREATE INDEX IF NOT EXISTS tiles_expires ON tiles (expires);",
+          NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        goto error;
+    }
+
+  /* version 3: tiles missing at the tile source */
+  if (version < 3)
+    sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN missing INT DEFAULT 0", NULL, NULL, NULL);
+
+  sqlite3_exec (priv->db,
+      "PRAGMA user_version = " G_STRINGIFY (SCHEMA_VERSION) ";"
+      "COMMIT",
+      NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    goto error;
+
+  return TRUE;
+
+error:
+  DEBUG ("Upgrading cache.db failed: %s", error_msg);
+  sqlite3_free (error_msg);
+  sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+  return FALSE;
+}
+
+
+/* Runs in the I/O thread */
 static void
 init_cache (ChamplainFileCache *file_cache)
 {
@@ -215,20 +503,26 @@ init_cache (ChamplainFileCache *file_cache)
         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
   g_free (filename);
 
-  if (error == SQLITE_ERROR)
+  if (error != SQLITE_OK)
     {
       DEBUG ("Sqlite returned error %d when opening cache.db", error);
+      finalize_sql (file_cache);
       return;
     }
 
+  /* other processes may use the cache at the same time */
+  sqlite3_busy_timeout (priv->db, 5000);
+
   sqlite3_exec (priv->db,
       "PRAGMA synchronous=OFF;"
-      "PRAGMA auto_vacuum=INCREMENTAL;",
+      "PRAGMA auto_vacuum=INCREMENTAL;"
+      "PRAGMA journal_mode=WAL;",
       NULL, NULL, &error_msg);
   if (error_msg != NULL)
     {
       DEBUG ("Set PRAGMA: %s", error_msg);
       sqlite3_free (error_msg);
+      finalize_sql (file_cache);
       return;
     }
 
@@ -237,38 +531,61 @@ init_cache (ChamplainFileCache *file_cache)
       "filename TEXT PRIMARY KEY, "
       "etag TEXT, "
       "popularity INT DEFAULT 1, "
-      "size INT DEFAULT 0)",
+      "size INT DEFAULT 0, "
+      "score REAL DEFAULT 0, "
+      "expires INT DEFAULT 0, "
+      "missing INT DEFAULT 0)",
       NULL, NULL, &error_msg);
   if (error_msg != NULL)
     {
       DEBUG ("Creating table 'tiles' failed: %s", error_msg);
       sqlite3_free (error_msg);
+      finalize_sql (file_cache);
       return;
     }
 
-  error = sqlite3_prepare_v2 (priv->db,
-        "SELECT etag FROM tiles WHERE filename = ?", -1,
-        &priv->stmt_select, NULL);
-  if (error != SQLITE_OK)
-    {
-      priv->stmt_select = NULL;
-      DEBUG ("Failed to prepare the select Etag statement, error:%d: %s",
-          error, sqlite3_errmsg (priv->db));
-      return;
-    }
-
-  error = sqlite3_prepare_v2 (priv->db,
-        "UPDATE tiles SET popularity = popularity + 1 WHERE filename = ?", -1,
-        &priv->stmt_update, NULL);
-  if (error != SQLITE_OK)
+  if (!upgrade_schema (file_cache))
     {
-      priv->stmt_update = NULL;
-      DEBUG ("Failed to prepare the update popularity statement, error: %s",
-          sqlite3_errmsg (priv->db));
+      finalize_sql (file_cache);
       return;
     }
 
-  g_object_notify (G_OBJECT (file_cache), "cache-dir");
+  champlain_file_cache_register_score_function (priv->db);
+
+  if (!prepare_statement (file_cache,
+          "SELECT rowid, etag, expires, missing FROM tiles WHERE filename = ?",
+          &priv->stmt_select) ||
+      !prepare_statement (file_cache,
+          "REPLACE INTO tiles (filename, etag, size, score, expires) VALUES (?, ?, ?, ?, ?)",
+          &priv->stmt_store) ||
+      !prepare_statement (file_cache,
+          "REPLACE INTO tiles (filename, size, score, expires, missing) VALUES (?, 0, ?, ?, 1)",
+          &priv->stmt_store_missing) ||
+      !prepare_statement (file_cache,
+          "UPDATE tiles SET expires = ? WHERE filename = ?",
+          &priv->stmt_touch) ||
+      !prepare_statement (file_cache,
+          "UPDATE tiles SET popularity = popularity + 1, "
+          "score = champlain_bump_score (score, ?) WHERE filename = ?",
+          &priv->stmt_popularity) ||
+      !prepare_statement (file_cache,
+          "UPDATE tiles SET popularity = popularity + 1, "
+          "score = champlain_bump_score (score, ?) WHERE rowid = ?",
+          &priv->stmt_popularity_rowid) ||
+      !prepare_statement (file_cache,
+          "SELECT size FROM cache_size",
+          &priv->stmt_size) ||
+      !prepare_statement (file_cache,
+          "SELECT rowid, filename, size FROM tiles ORDER BY score LIMIT ?",
+          &priv->stmt_evict) ||
+      !prepare_statement (file_cache,
+          "SELECT rowid, filename, size FROM tiles "
+          "WHERE expires > 0 AND expires < ? ORDER BY expires LIMIT ?",
+          &priv->stmt_evict_expired) ||
+      !prepare_statement (file_cache,
+          "DELETE FROM tiles WHERE rowid = ?",
+          &priv->stmt_delete))
+    finalize_sql (file_cache);
 }
 
 
@@ -277,6 +594,7 @@ champlain_file_cache_constructed (GObject *object)
 {
   ChamplainFileCache *file_cache = CHAMPLAIN_FILE_CACHE (object);
   ChamplainFileCachePrivate *priv = file_cache->priv;
+  Job *job;
 
   if (!priv->cache_dir)
     {
@@ -289,7 +607,12 @@ champlain_file_cache_constructed (GObject *object)
 #endif
     }
 
-  init_cache (file_cache);
+  /* the database is opened by the first job of the I/O thread */
+  job = g_slice_new (Job);
+  job->type = JOB_INIT;
+  push_job (file_cache, job);
+
+  g_object_notify (G_OBJECT (file_cache), "cache-dir");
 
   G_OBJECT_CLASS (champlain_file_cache_parent_class)->constructed (object);
 }
@@ -347,6 +670,7 @@ champlain_file_cache_class_init (ChamplainFileCacheClass *klass)
   tile_cache_class->store_tile = store_tile;
   tile_cache_class->refresh_tile_time = refresh_tile_time;
   tile_cache_class->on_tile_filled = on_tile_filled;
+  champlain_tile_cache_class_set_store_missing_tile (tile_cache_class, store_missing_tile);
 
   map_source_class->fill_tile = fill_tile;
 }
@@ -359,12 +683,28 @@ champlain_file_cache_init (ChamplainFileCache *file_cache)
 
   file_cache->priv = priv;
 
-  priv->cache_dir = NULL;
   priv->size_limit = 100000000;
   priv->cache_dir = NULL;
+  priv->rowids = champlain_tile_table_new (NULL);
+  priv->source_id_name = NULL;
+  priv->source_id = 0;
+  priv->source_ids = champlain_tile_key_source_ids_new ();
+  priv->pending_writes = g_ptr_array_new_with_free_func ((GDestroyNotify) free_write_op);
+  priv->pending_stores = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->write_timeout = 0;
+  /* a single thread so that the jobs are run in order */
+  priv->io_thread = g_thread_pool_new ((GFunc) run_job, file_cache, 1, FALSE, NULL);
   priv->db = NULL;
   priv->stmt_select = NULL;
-  priv->stmt_update = NULL;
+  priv->stmt_store = NULL;
+  priv->stmt_store_missing = NULL;
+  priv->stmt_touch = NULL;
+  priv->stmt_popularity = NULL;
+  priv->stmt_popularity_rowid = NULL;
+  priv->stmt_size = NULL;
+  priv->stmt_evict = NULL;
+  priv->stmt_evict_expired = NULL;
+  priv->stmt_delete = NULL;
 }
 
 
@@ -457,14 +797,245 @@ champlain_file_cache_set_size_limit (ChamplainFileCache *file_cache,
 }
 
 
-static gchar *
-get_filename (ChamplainFileCache *file_cache,
-    ChamplainTile *tile)
+static void
+free_write_op (WriteOp *op)
+{
+  g_free (op->filename);
+  g_free (op->etag);
+  if (op->data)
+    g_bytes_unref (op->data);
+  g_slice_free (WriteOp, op);
+}
+
+
+static void
+push_job (ChamplainFileCache *file_cache,
+    Job *job)
+{
+  g_thread_pool_push (file_cache->priv->io_thread, job, NULL);
+}
+
+
+/* Runs in the I/O thread */
+static gboolean
+write_file (WriteOp *op)
+{
+  GFile *file;
+  GError *error = NULL;
+  gchar *path;
+  gboolean ret;
+
+  /* If needed, create the cache's dirs */
+  path = g_path_get_dirname (op->filename);
+  if (g_mkdir_with_parents (path, 0700) == -1 && errno != EEXIST)
+    {
+      g_warning ("Unable to create the image cache path '%s': %s",
+          path, g_strerror (errno));
+      g_free (path);
+      return FALSE;
+    }
+  g_free (path);
+
+  file = g_file_new_for_path (op->filename);
+  ret = g_file_replace_contents (file,
+        g_bytes_get_data (op->data, NULL),
+        g_bytes_get_size (op->data),
+        NULL, FALSE,
+        G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION,
+        NULL, NULL, &error);
+  if (!ret)
+    {
+      DEBUG ("Writing file contents failed: %s", error->message);
+      g_error_free (error);
+    }
+  g_object_unref (file);
+
+  return ret;
+}
+
+
+/* Runs in the I/O thread - writes all changes of the batch, database
+ * changes in a single transaction */
+static void
+write_batch (ChamplainFileCache *file_cache,
+    GPtrArray *ops)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  gdouble now = champlain_file_cache_get_current_score ();
+  guint i;
+
+  if (priv->db)
+    sqlite3_exec (priv->db, "BEGIN", NULL, NULL, NULL);
+
+  for (i = 0; i < ops->len; i++)
+    {
+      WriteOp *op = g_ptr_array_index (ops, i);
+      sqlite3_stmt *stmt = NULL;
+
+      switch (op->type)
+        {
+        case WRITE_STORE:
+          if (!write_file (op))
+            continue;
+          stmt = priv->stmt_store;
+          if (!stmt)
+            continue;
+          sqlite3_reset (stmt);
+          sqlite3_bind_text (stmt, 1, op->filename, -1, SQLITE_STATIC);
+          sqlite3_bind_text (stmt, 2, op->etag, -1, SQLITE_STATIC);
+          sqlite3_bind_int (stmt, 3, g_bytes_get_size (op->data));
+          sqlite3_bind_double (stmt, 4, now);
+          sqlite3_bind_int64 (stmt, 5, op->expires);
+          break;
+
+        case WRITE_STORE_MISSING:
+          /* remove the previous version of the tile */
+          if (g_unlink (op->filename) == -1 && errno != ENOENT)
+            DEBUG ("Deleting '%s' failed: %s", op->filename, g_strerror (errno));
+          stmt = priv->stmt_store_missing;
+          if (!stmt)
+            continue;
+          sqlite3_reset (stmt);
+          sqlite3_bind_text (stmt, 1, op->filename, -1, SQLITE_STATIC);
+          sqlite3_bind_double (stmt, 2, now);
+          sqlite3_bind_int64 (stmt, 3, op->expires);
+          break;
+
+        case WRITE_TOUCH:
+          if (g_utime (op->filename, NULL) == -1)
+            DEBUG ("Updating time of '%s' failed: %s", op->filename, g_strerror (errno));
+          stmt = priv->stmt_touch;
+          if (!stmt)
+            continue;
+          sqlite3_reset (stmt);
+          sqlite3_bind_int64 (stmt, 1, op->expires);
+          sqlite3_bind_text (stmt, 2, op->filename, -1, SQLITE_STATIC);
+          break;
+
+        case WRITE_POPULARITY:
+          if (op->rowid > 0)
+            {
+              stmt = priv->stmt_popularity_rowid;
+              if (!stmt)
+                continue;
+              sqlite3_reset (stmt);
+              sqlite3_bind_double (stmt, 1, now);
+              sqlite3_bind_int64 (stmt, 2, op->rowid);
+            }
+          else
+            {
+              stmt = priv->stmt_popularity;
+              if (!stmt)
+                continue;
+              sqlite3_reset (stmt);
+              sqlite3_bind_double (stmt, 1, now);
+              sqlite3_bind_text (stmt, 2, op->filename, -1, SQLITE_STATIC);
+            }
+          break;
+        }
+
+      if (sqlite3_step (stmt) != SQLITE_DONE)
+        DEBUG ("Writing to the database failed: %s", sqlite3_errmsg (priv->db));
+      sqlite3_clear_bindings (stmt);
+    }
+
+  if (!priv->db)
+    return;
+
+  if (sqlite3_exec (priv->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Committing %u changes failed: %s", ops->len, sqlite3_errmsg (priv->db));
+      sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+    }
+  else
+    DEBUG ("Committed %u changes", ops->len);
+}
+
+
+/* Passes the queued changes to the I/O thread */
+static void
+flush_writes (ChamplainFileCache *file_cache)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  WriteJob *job;
+
+  if (priv->write_timeout != 0)
+    {
+      g_source_remove (priv->write_timeout);
+      priv->write_timeout = 0;
+    }
+
+  if (priv->pending_writes->len == 0 || !priv->io_thread)
+    return;
+
+  job = g_slice_new (WriteJob);
+  job->job.type = JOB_WRITE;
+  job->ops = priv->pending_writes;
+  push_job (file_cache, (Job *) job);
+
+  priv->pending_writes = g_ptr_array_new_with_free_func ((GDestroyNotify) free_write_op);
+  g_hash_table_remove_all (priv->pending_stores);
+}
+
+
+static gboolean
+flush_writes_cb (ChamplainFileCache *file_cache)
+{
+  file_cache->priv->write_timeout = 0;
+  flush_writes (file_cache);
+
+  return FALSE;
+}
+
+
+/* Takes ownership of filename */
+static void
+queue_write (ChamplainFileCache *file_cache,
+    WriteType type,
+    gchar *filename,
+    const gchar *etag,
+    GBytes *data,
+    gint64 expires,
+    sqlite3_int64 rowid)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  WriteOp *op;
+
+  /* already disposed */
+  if (!priv->io_thread)
+    {
+      g_free (filename);
+      return;
+    }
+
+  op = g_slice_new (WriteOp);
+  op->type = type;
+  op->filename = filename;
+  op->etag = g_strdup (etag);
+  op->data = data ? g_bytes_ref (data) : NULL;
+  op->expires = expires;
+  op->rowid = rowid;
+  g_ptr_array_add (priv->pending_writes, op);
+
+  if (type == WRITE_STORE || type == WRITE_STORE_MISSING)
+    g_hash_table_add (priv->pending_stores, op->filename);
+
+  if (priv->pending_writes->len >= WRITE_BATCH_SIZE)
+    flush_writes (file_cache);
+  else if (priv->write_timeout == 0)
+    priv->write_timeout = g_timeout_add (WRITE_INTERVAL, (GSourceFunc) flush_writes_cb, file_cache);
+}
+
+
+gchar *
+champlain_file_cache_get_tile_filename (ChamplainFileCache *file_cache,
+    guint zoom_level,
+    gint x,
+    gint y)
 {
   ChamplainFileCachePrivate *priv = file_cache->priv;
 
   g_return_val_if_fail (CHAMPLAIN_IS_FILE_CACHE (file_cache), NULL);
-  g_return_val_if_fail (CHAMPLAIN_IS_TILE (tile), NULL);
   g_return_val_if_fail (priv->cache_dir, NULL);
 
   ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (file_cache);
@@ -475,13 +1046,90 @@ get_filename (ChamplainFileCache *file_cache,
         "%d" G_DIR_SEPARATOR_S "%d.png",
         priv->cache_dir,
         champlain_map_source_get_id (map_source),
-        champlain_tile_get_zoom_level (tile),
-        champlain_tile_get_x (tile),
-        champlain_tile_get_y (tile));
+        zoom_level,
+        x,
+        y);
   return filename;
 }
 
 
+static gchar *
+get_filename (ChamplainFileCache *file_cache,
+    ChamplainTile *tile)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_TILE (tile), NULL);
+
+  return champlain_file_cache_get_tile_filename (file_cache,
+      champlain_tile_get_zoom_level (tile),
+      champlain_tile_get_x (tile),
+      champlain_tile_get_y (tile));
+}
+
+
+static guint64
+get_key (ChamplainFileCache *file_cache,
+    guint zoom_level,
+    gint x,
+    gint y)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  const gchar *id;
+
+  id = champlain_map_source_get_id (CHAMPLAIN_MAP_SOURCE (file_cache));
+  if (g_strcmp0 (id, priv->source_id_name) != 0)
+    {
+      g_free (priv->source_id_name);
+      priv->source_id_name = g_strdup (id);
+      priv->source_id = champlain_tile_key_intern_source_in (priv->source_ids, id);
+
+      if (priv->source_id == CHAMPLAIN_TILE_KEY_NO_SOURCE && id)
+        {
+          /* all ids are taken by other sources - start over */
+          champlain_tile_table_remove_all (priv->rowids);
+          g_hash_table_remove_all (priv->source_ids);
+          priv->source_id = champlain_tile_key_intern_source_in (priv->source_ids, id);
+        }
+    }
+
+  if (priv->source_id == CHAMPLAIN_TILE_KEY_NO_SOURCE)
+    return CHAMPLAIN_TILE_KEY_INVALID;
+
+  return champlain_tile_key_new (priv->source_id, zoom_level, x, y);
+}
+
+
+static guint64
+get_tile_key (ChamplainFileCache *file_cache,
+    ChamplainTile *tile)
+{
+  return get_key (file_cache,
+      champlain_tile_get_zoom_level (tile),
+      champlain_tile_get_x (tile),
+      champlain_tile_get_y (tile));
+}
+
+
+static void
+index_tile_rowid (ChamplainFileCache *file_cache,
+    guint64 key,
+    sqlite3_int64 rowid)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+
+  if (key == CHAMPLAIN_TILE_KEY_INVALID)
+    return;
+
+  if (rowid > 0 && rowid <= G_MAXINT)
+    {
+      if (champlain_tile_table_size (priv->rowids) >= ROWID_INDEX_SIZE_LIMIT)
+        champlain_tile_table_remove_all (priv->rowids);
+      champlain_tile_table_insert (priv->rowids, key, GINT_TO_POINTER ((gint) rowid));
+    }
+  else
+    champlain_tile_table_remove (priv->rowids, key);
+}
+
+
 static gboolean
 tile_is_expired (ChamplainFileCache *file_cache,
     ChamplainTile *tile)
@@ -491,9 +1139,16 @@ tile_is_expired (ChamplainFileCache *file_cache,
 
   GTimeVal now = { 0, };
   const GTimeVal *modified_time = champlain_tile_get_modified_time (tile);
+  const GTimeVal *expiration_time = champlain_tile_get_expiration_time (tile);
   gboolean validate_cache = TRUE;
 
-  if (modified_time)
+  /* prefer the lifetime declared by the server */
+  if (expiration_time)
+    {
+      g_get_current_time (&now);
+      validate_cache = expiration_time->tv_sec <= now.tv_sec;
+    }
+  else if (modified_time)
     {
       g_get_current_time (&now);
       g_time_val_add (&now, (-24ul * 60ul * 60ul * 1000ul * 1000ul * 7ul)); /* Cache expires in 7 days */
@@ -506,34 +1161,100 @@ tile_is_expired (ChamplainFileCache *file_cache,
 }
 
 
-typedef struct
+/* Returns the expiration time of the tile as stored in the database,
+ * 0 when unknown */
+static gint64
+get_tile_expires (ChamplainTile *tile)
 {
-  ChamplainMapSource *map_source;
-  ChamplainTile *tile;
-} FileLoadedData;
+  const GTimeVal *expiration_time = champlain_tile_get_expiration_time (tile);
+
+  return expiration_time ? MAX (expiration_time->tv_sec, 1) : 0;
+}
+
+
+static void
+free_load_job (LoadJob *job)
+{
+  g_object_unref (job->tile);
+  g_object_unref (job->file_cache);
+  g_free (job->filename);
+  g_free (job->contents);
+  g_free (job->etag);
+  g_slice_free (LoadJob, job);
+}
+
+
+/* Runs in the I/O thread */
+static void
+load_tile (ChamplainFileCache *file_cache,
+    LoadJob *job)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  GError *error = NULL;
+  GStatBuf st;
+
+  if (!g_file_get_contents (job->filename, &job->contents, &job->length, &error))
+    {
+      DEBUG ("Failed to load tile %s, error: %s", job->filename, error->message);
+      g_error_free (error);
+
+      /* the tile source may have reported the tile as missing */
+      if (priv->stmt_select)
+        {
+          sqlite3_reset (priv->stmt_select);
+          if (sqlite3_bind_text (priv->stmt_select, 1, job->filename, -1, SQLITE_STATIC) == SQLITE_OK &&
+              sqlite3_step (priv->stmt_select) == SQLITE_ROW &&
+              sqlite3_column_int (priv->stmt_select, 3) != 0)
+            {
+              job->rowid = sqlite3_column_int64 (priv->stmt_select, 0);
+              job->expires = sqlite3_column_int64 (priv->stmt_select, 2);
+              job->missing = job->expires > g_get_real_time () / G_USEC_PER_SEC;
+            }
+          sqlite3_clear_bindings (priv->stmt_select);
+        }
+      return;
+    }
+
+  /* Retrieve modification time */
+  if (g_stat (job->filename, &st) == 0)
+    {
+      job->modified_time.tv_sec = st.st_mtime;
+      job->modified_time.tv_usec = 0;
+      job->has_modified_time = TRUE;
+    }
+
+  if (!priv->stmt_select)
+    return;
+
+  /* Retrieve rowid and etag */
+  sqlite3_reset (priv->stmt_select);
+  if (sqlite3_bind_text (priv->stmt_select, 1, job->filename, -1, SQLITE_STATIC) == SQLITE_OK &&
+      sqlite3_step (priv->stmt_select) == SQLITE_ROW)
+    {
+      job->rowid = sqlite3_column_int64 (priv->stmt_select, 0);
+      job->etag = g_strdup ((const gchar *) sqlite3_column_text (priv->stmt_select, 1));
+      job->expires = sqlite3_column_int64 (priv->stmt_select, 2);
+    }
+  else
+    DEBUG ("'%s' is not in the database", job->filename);
+  sqlite3_clear_bindings (priv->stmt_select);
+}
+
 
 static void
 tile_rendered_cb (ChamplainTile *tile,
     gpointer data,
     guint size,
     gboolean error,
-    FileLoadedData *user_data)
+    LoadJob *job)
 {
-  ChamplainMapSource *map_source = user_data->map_source;
-  GFile *file;
-  ChamplainFileCache *file_cache;
+  ChamplainFileCache *file_cache = job->file_cache;
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (file_cache);
   ChamplainMapSource *next_source;
-  ChamplainFileCachePrivate *priv;
-  GFileInfo *info = NULL;
-  GTimeVal modified_time = { 0, };
-  gchar *filename = NULL;
 
-  g_signal_handlers_disconnect_by_func (tile, tile_rendered_cb, user_data);
-  g_slice_free (FileLoadedData, user_data);
+  g_signal_handlers_disconnect_by_func (tile, tile_rendered_cb, job);
 
   next_source = champlain_map_source_get_next_source (map_source);
-  file_cache = CHAMPLAIN_FILE_CACHE (map_source);
-  priv = file_cache->priv;
 
   if (error)
     {
@@ -543,21 +1264,17 @@ tile_rendered_cb (ChamplainTile *tile,
 
   champlain_tile_set_state (tile, CHAMPLAIN_STATE_LOADED);
 
-  filename = get_filename (file_cache, tile);
-  file = g_file_new_for_path (filename);
+  if (job->has_modified_time)
+    champlain_tile_set_modified_time (tile, &job->modified_time);
 
-  /* Retrieve modification time */
-  info = g_file_query_info (file,
-        G_FILE_ATTRIBUTE_TIME_MODIFIED,
-        G_FILE_QUERY_INFO_NONE, NULL, NULL);
-  if (info)
+  if (job->expires > 0)
     {
-      g_file_info_get_modification_time (info, &modified_time);
-      champlain_tile_set_modified_time (tile, &modified_time);
+      GTimeVal expiration_time = { job->expires, 0 };
 
-      g_object_unref (info);
+      champlain_tile_set_expiration_time (tile, &expiration_time);
     }
-  g_object_unref (file);
+  else
+    champlain_tile_set_expiration_time (tile, NULL);
 
   /* Notify other caches that the tile has been filled */
   if (CHAMPLAIN_IS_TILE_CACHE (next_source))
@@ -565,34 +1282,19 @@ tile_rendered_cb (ChamplainTile *tile,
 
   if (tile_is_expired (file_cache, tile))
     {
-      int sql_rc = SQLITE_OK;
+      champlain_tile_cache_display_stale_tile (CHAMPLAIN_TILE_CACHE (file_cache), tile);
 
-      /* Retrieve etag */
-      sqlite3_reset (priv->stmt_select);
-      sql_rc = sqlite3_bind_text (priv->stmt_select, 1, filename, -1, SQLITE_STATIC);
-      if (sql_rc == SQLITE_ERROR)
+      if (job->rowid == 0)
         {
-          DEBUG ("Failed to prepare the SQL query for finding the Etag of '%s', error: %s",
-              filename, sqlite3_errmsg (priv->db));
+          DEBUG ("'%s' is not in the database", job->filename);
           goto load_next;
         }
 
-      sql_rc = sqlite3_step (priv->stmt_select);
-      if (sql_rc == SQLITE_ROW)
-        {
-          const gchar *etag = (const gchar *) sqlite3_column_text (priv->stmt_select, 0);
-          champlain_tile_set_etag (CHAMPLAIN_TILE (tile), etag);
-        }
-      else if (sql_rc == SQLITE_DONE)
-        {
-          DEBUG ("'%s' does't have an etag",
-              filename);
-          goto load_next;
-        }
-      else if (sql_rc == SQLITE_ERROR)
+      if (job->etag)
+        champlain_tile_set_etag (tile, job->etag);
+      else
         {
-          DEBUG ("Failed to finding the Etag of '%s', %d error: %s",
-              filename, sql_rc, sqlite3_errmsg (priv->db));
+          DEBUG ("'%s' does't have an etag", job->filename);
           goto load_next;
         }
 
@@ -619,50 +1321,43 @@ load_next:
     }
 
 cleanup:
-  g_free (filename);
-  g_object_unref (tile);
-  g_object_unref (map_source);
+  free_load_job (job);
 }
 
 
-static void
-file_loaded_cb (GFile *file,
-    GAsyncResult *res,
-    FileLoadedData *user_data)
+/* Called in the main loop when the I/O thread has loaded the tile */
+static gboolean
+load_finished_cb (LoadJob *job)
 {
-  gboolean ok;
-  gchar *contents;
-  gsize length;
-  GError *error = NULL;
-  ChamplainTile *tile = user_data->tile;
-  ChamplainMapSource *map_source = user_data->map_source;
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (job->file_cache);
   ChamplainRenderer *renderer;
+  GBytes *bytes;
 
-  ok = g_file_load_contents_finish (file, res, &contents, &length, NULL, &error);
+  index_tile_rowid (job->file_cache, job->key, job->rowid);
 
-  if (!ok)
+  if (job->missing)
     {
-      gchar *path;
-
-      path = g_file_get_path (file);
-      DEBUG ("Failed to load tile %s, error: %s", path, error->message);
-      g_free (path);
-      contents = NULL;
-      length = 0;
-      g_error_free (error);
+      DEBUG ("'%s' is missing", job->filename);
+      champlain_tile_cache_fill_missing_tile (CHAMPLAIN_TILE_CACHE (map_source), job->tile);
+      free_load_job (job);
+      return FALSE;
     }
 
-  g_object_unref (file);
-
   renderer = champlain_map_source_get_renderer (map_source);
+  if (!CHAMPLAIN_IS_RENDERER (renderer))
+    {
+      free_load_job (job);
+      g_return_val_if_reached (FALSE);
+    }
 
-  g_return_if_fail (CHAMPLAIN_IS_RENDERER (renderer));
+  g_signal_connect (job->tile, "render-complete", G_CALLBACK (tile_rendered_cb), job);
 
-  g_signal_connect (tile, "render-complete", G_CALLBACK (tile_rendered_cb), user_data);
+  bytes = g_bytes_new_take (job->contents, job->length);
+  job->contents = NULL;
+  champlain_renderer_render_bytes (renderer, job->tile, bytes);
+  g_bytes_unref (bytes);
 
-  champlain_renderer_set_data (renderer, contents, length);
-  g_free (contents);
-  champlain_renderer_render (renderer, tile);
+  return FALSE;
 }
 
 
@@ -674,30 +1369,30 @@ fill_tile (ChamplainMapSource *map_source,
   g_return_if_fail (CHAMPLAIN_IS_TILE (tile));
 
   ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+  ChamplainFileCache *file_cache = CHAMPLAIN_FILE_CACHE (map_source);
+  ChamplainFileCachePrivate *priv = file_cache->priv;
 
   if (champlain_tile_get_state (tile) == CHAMPLAIN_STATE_DONE)
     return;
 
-  if (champlain_tile_get_state (tile) != CHAMPLAIN_STATE_LOADED)
+  if (champlain_tile_get_state (tile) != CHAMPLAIN_STATE_LOADED && priv->io_thread)
     {
-      FileLoadedData *user_data;
-      gchar *filename;
-      GFile *file;
+      LoadJob *job;
 
-      filename = get_filename (CHAMPLAIN_FILE_CACHE (map_source), tile);
-      file = g_file_new_for_path (filename);
-      g_free (filename);
-
-      user_data = g_slice_new (FileLoadedData);
-      user_data->tile = tile;
-      user_data->map_source = map_source;
+      job = g_slice_new0 (LoadJob);
+      job->job.type = JOB_LOAD;
+      job->file_cache = g_object_ref (file_cache);
+      job->tile = g_object_ref (tile);
+      job->key = get_tile_key (file_cache, tile);
+      job->filename = get_filename (file_cache, tile);
 
-      g_object_ref (tile);
-      g_object_ref (map_source);
+      DEBUG ("fill of %s", job->filename);
 
-      DEBUG ("fill of %s", filename);
+      /* make sure the tile is on the disk if its store is still queued */
+      if (g_hash_table_contains (priv->pending_stores, job->filename))
+        flush_writes (file_cache);
 
-      g_file_load_contents_async (file, NULL, (GAsyncReadyCallback) file_loaded_cb, user_data);
+      push_job (file_cache, (Job *) job);
     }
   else if (CHAMPLAIN_IS_MAP_SOURCE (next_source))
     champlain_map_source_fill_tile (next_source, tile);
@@ -719,30 +1414,9 @@ refresh_tile_time (ChamplainTileCache *tile_cache,
   ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
   ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
   ChamplainFileCache *file_cache = CHAMPLAIN_FILE_CACHE (tile_cache);
-  gchar *filename = NULL;
-  GFile *file;
-  GFileInfo *info;
-
-  filename = get_filename (file_cache, tile);
-  file = g_file_new_for_path (filename);
-  g_free (filename);
-
-  info = g_file_query_info (file, G_FILE_ATTRIBUTE_TIME_MODIFIED,
-        G_FILE_QUERY_INFO_NONE, NULL, NULL);
 
-  if (info)
-    {
-      GTimeVal now = { 0, };
-
-      g_get_current_time (&now);
-
-      g_file_info_set_modification_time (info, &now);
-      g_file_set_attributes_from_info (file, info, G_FILE_QUERY_INFO_NONE, NULL, NULL);
-
-      g_object_unref (info);
-    }
-
-  g_object_unref (file);
+  queue_write (file_cache, WRITE_TOUCH, get_filename (file_cache, tile), NULL, NULL,
+      get_tile_expires (tile), 0);
 
   if (CHAMPLAIN_IS_TILE_CACHE (next_source))
     champlain_tile_cache_refresh_tile_time (CHAMPLAIN_TILE_CACHE (next_source), tile);
@@ -760,74 +1434,64 @@ store_tile (ChamplainTileCache *tile_cache,
   ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
   ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
   ChamplainFileCache *file_cache = CHAMPLAIN_FILE_CACHE (tile_cache);
-  ChamplainFileCachePrivate *priv = file_cache->priv;
-  gchar *query = NULL;
-  gchar *error = NULL;
-  gchar *path = NULL;
-  gchar *filename = NULL;
-  GError *gerror = NULL;
-  GFile *file;
-  GFileOutputStream *ostream;
-  gsize bytes_written;
+  GBytes *data;
 
   DEBUG ("Update of %p", tile);
 
-  filename = get_filename (file_cache, tile);
-  file = g_file_new_for_path (filename);
+  /* REPLACE gives the row a new rowid */
+  index_tile_rowid (file_cache, get_tile_key (file_cache, tile), 0);
 
-  /* If the file exists, delete it */
-  g_file_delete (file, NULL, NULL);
+  data = g_bytes_new (contents, size);
+  queue_write (file_cache, WRITE_STORE, get_filename (file_cache, tile),
+      champlain_tile_get_etag (tile), data, get_tile_expires (tile), 0);
+  g_bytes_unref (data);
 
-  /* If needed, create the cache's dirs */
-  path = g_path_get_dirname (filename);
-  if (g_mkdir_with_parents (path, 0700) == -1)
-    {
-      if (errno != EEXIST)
-        {
-          g_warning ("Unable to create the image cache path '%s': %s",
-              path, g_strerror (errno));
-          goto store_next;
-        }
-    }
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_store_tile (CHAMPLAIN_TILE_CACHE (next_source), tile, contents, size);
+}
 
-  ostream = g_file_create (file, G_FILE_CREATE_PRIVATE, NULL, &gerror);
-  if (!ostream)
-    {
-      DEBUG ("GFileOutputStream creation failed: %s", gerror->message);
-      g_error_free (gerror);
-      goto store_next;
-    }
 
-  /* Write the cache */
-  if (!g_output_stream_write_all (G_OUTPUT_STREAM (ostream), contents, size, &bytes_written, NULL, &gerror))
-    {
-      DEBUG ("Writing file contents failed: %s", gerror->message);
-      g_error_free (gerror);
-      g_object_unref (ostream);
-      goto store_next;
-    }
+void
+champlain_file_cache_store_tile_data (ChamplainFileCache *file_cache,
+    guint zoom_level,
+    gint x,
+    gint y,
+    const gchar *etag,
+    GBytes *data)
+{
+  g_return_if_fail (CHAMPLAIN_IS_FILE_CACHE (file_cache));
+  g_return_if_fail (data != NULL);
 
-  g_object_unref (ostream);
+  DEBUG ("Update of %u, %d, %d", zoom_level, x, y);
 
-  query = sqlite3_mprintf ("REPLACE INTO tiles (filename, etag, size) VALUES (%Q, %Q, %d)",
-        filename,
-        champlain_tile_get_etag (tile),
-        size);
-  sqlite3_exec (priv->db, query, NULL, NULL, &error);
-  if (error != NULL)
-    {
-      DEBUG ("Saving Etag and size failed: %s", error);
-      sqlite3_free (error);
-    }
-  sqlite3_free (query);
+  index_tile_rowid (file_cache, get_key (file_cache, zoom_level, x, y), 0);
+  queue_write (file_cache, WRITE_STORE,
+      champlain_file_cache_get_tile_filename (file_cache, zoom_level, x, y),
+      etag, data, 0, 0);
+}
 
-store_next:
-  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
-    champlain_tile_cache_store_tile (CHAMPLAIN_TILE_CACHE (next_source), tile, contents, size);
 
-  g_free (filename);
-  g_free (path);
-  g_object_unref (file);
+static void
+store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_FILE_CACHE (tile_cache));
+
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+  ChamplainFileCache *file_cache = CHAMPLAIN_FILE_CACHE (tile_cache);
+
+  DEBUG ("Missing %p", tile);
+
+  index_tile_rowid (file_cache, get_tile_key (file_cache, tile), 0);
+
+  /* without an expiration time the entry would never be used */
+  if (champlain_tile_get_expiration_time (tile))
+    queue_write (file_cache, WRITE_STORE_MISSING, get_filename (file_cache, tile), NULL, NULL,
+        get_tile_expires (tile), 0);
+
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_store_missing_tile (CHAMPLAIN_TILE_CACHE (next_source), tile);
 }
 
 
@@ -842,62 +1506,202 @@ on_tile_filled (ChamplainTileCache *tile_cache,
   ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
   ChamplainFileCache *file_cache = CHAMPLAIN_FILE_CACHE (tile_cache);
   ChamplainFileCachePrivate *priv = file_cache->priv;
-  int sql_rc = SQLITE_OK;
-  gchar *filename = NULL;
+  gpointer value;
 
-  filename = get_filename (file_cache, tile);
+  DEBUG ("popularity of %p", tile);
 
-  DEBUG ("popularity of %s", filename);
+  /* may not be present in this cache, the update is a no-op then */
+  value = champlain_tile_table_lookup (priv->rowids, get_tile_key (file_cache, tile));
+  if (value)
+    queue_write (file_cache, WRITE_POPULARITY, NULL, NULL, NULL, 0, GPOINTER_TO_INT (value));
+  else
+    queue_write (file_cache, WRITE_POPULARITY, get_filename (file_cache, tile), NULL, NULL, 0, 0);
 
-  sqlite3_reset (priv->stmt_update);
-  sql_rc = sqlite3_bind_text (priv->stmt_update, 1, filename, -1, SQLITE_STATIC);
-  if (sql_rc != SQLITE_OK)
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_on_tile_filled (CHAMPLAIN_TILE_CACHE (next_source), tile);
+}
+
+
+typedef struct
+{
+  sqlite3_int64 rowid;
+  gchar *filename;
+} EvictedTile;
+
+
+/* Appends the tiles returned by stmt to evicted until the cache size drops
+ * to size_limit. Returns the resulting cache size. */
+static gint64
+collect_evicted_tiles (sqlite3_stmt *stmt,
+    GArray *evicted,
+    gint64 current_size,
+    guint size_limit)
+{
+  while (current_size > size_limit && sqlite3_step (stmt) == SQLITE_ROW)
     {
-      DEBUG ("Failed to set values to the popularity query of '%s', error: %s",
-          filename, sqlite3_errmsg (priv->db));
-      goto call_next;
+      EvictedTile tile;
+
+      tile.rowid = sqlite3_column_int64 (stmt, 0);
+      tile.filename = g_strdup ((const gchar *) sqlite3_column_text (stmt, 1));
+      current_size -= sqlite3_column_int (stmt, 2);
+      g_array_append_val (evicted, tile);
     }
+  sqlite3_reset (stmt);
+
+  return current_size;
+}
 
-  sql_rc = sqlite3_step (priv->stmt_update);
-  if (sql_rc != SQLITE_DONE)
+
+/* Runs in the I/O thread - deletes at most PURGE_SLICE_SIZE of the least
+ * valuable tiles. Returns TRUE when the cache fits into size_limit. */
+static gboolean
+purge_db (ChamplainFileCache *file_cache,
+    guint size_limit)
+{
+  ChamplainFileCachePrivate *priv = file_cache->priv;
+  GArray *evicted;
+  gint64 current_size = 0;
+  guint i;
+
+  if (!priv->stmt_size)
+    return TRUE;
+
+  sqlite3_reset (priv->stmt_size);
+  if (sqlite3_step (priv->stmt_size) != SQLITE_ROW)
     {
-      /* may not be present in this cache */
-      goto call_next;
+      DEBUG ("Failed to get the total cache consumption %s",
+          sqlite3_errmsg (priv->db));
+      return TRUE;
     }
+  current_size = sqlite3_column_int64 (priv->stmt_size, 0);
+  sqlite3_reset (priv->stmt_size);
 
-call_next:
-  g_free (filename);
-  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
-    champlain_tile_cache_on_tile_filled (CHAMPLAIN_TILE_CACHE (next_source), tile);
+  if (current_size <= size_limit)
+    {
+      DEBUG ("Cache doesn't need to be purged at %" G_GINT64_FORMAT " bytes", current_size);
+      return TRUE;
+    }
+
+  /* Ok, delete the least valuable tiles until size_limit reached. Tiles
+   * the server declared stale go first, the next slice continues with the
+   * least popular ones when there are no more. */
+  evicted = g_array_new (FALSE, FALSE, sizeof (EvictedTile));
+
+  sqlite3_reset (priv->stmt_evict_expired);
+  sqlite3_bind_int64 (priv->stmt_evict_expired, 1, g_get_real_time () / G_USEC_PER_SEC);
+  sqlite3_bind_int (priv->stmt_evict_expired, 2, PURGE_SLICE_SIZE);
+  current_size = collect_evicted_tiles (priv->stmt_evict_expired, evicted, current_size, size_limit);
+
+  if (evicted->len == 0)
+    {
+      sqlite3_reset (priv->stmt_evict);
+      sqlite3_bind_int (priv->stmt_evict, 1, PURGE_SLICE_SIZE);
+      current_size = collect_evicted_tiles (priv->stmt_evict, evicted, current_size, size_limit);
+    }
+
+  sqlite3_exec (priv->db, "BEGIN", NULL, NULL, NULL);
+
+  for (i = 0; i < evicted->len; i++)
+    {
+      EvictedTile *tile = &g_array_index (evicted, EvictedTile, i);
+
+      DEBUG ("Deleting %s", tile->filename);
+
+      if (g_unlink (tile->filename) == -1)
+        DEBUG ("Deleting tile from disk failed: %s", g_strerror (errno));
+
+      sqlite3_reset (priv->stmt_delete);
+      sqlite3_bind_int64 (priv->stmt_delete, 1, tile->rowid);
+      if (sqlite3_step (priv->stmt_delete) != SQLITE_DONE)
+        DEBUG ("Deleting tile from database failed: %s", sqlite3_errmsg (priv->db));
+
+      g_free (tile->filename);
+    }
+
+  if (sqlite3_exec (priv->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Committing the purge failed: %s", sqlite3_errmsg (priv->db));
+      sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+      current_size = 0;
+    }
+  else
+    DEBUG ("Cache size is now %" G_GINT64_FORMAT, current_size);
+
+  sqlite3_exec (priv->db, "PRAGMA incremental_vacuum;", NULL, NULL, NULL);
+
+  /* stop when nothing more can be deleted */
+  if (evicted->len == 0)
+    current_size = 0;
+
+  g_array_unref (evicted);
+
+  return current_size <= size_limit;
 }
 
 
-static void
-delete_tile (ChamplainFileCache *file_cache, const gchar *filename)
+/* Called in the main loop when the I/O thread has finished a purge step */
+static gboolean
+purge_finished_cb (PurgeJob *job)
 {
-  g_return_if_fail (CHAMPLAIN_IS_FILE_CACHE (file_cache));
-  gchar *query, *error = NULL;
-  GError *gerror = NULL;
-  GFile *file;
-
+  ChamplainFileCache *file_cache = job->file_cache;
   ChamplainFileCachePrivate *priv = file_cache->priv;
 
-  query = sqlite3_mprintf ("DELETE FROM tiles WHERE filename = %Q", filename);
-  sqlite3_exec (priv->db, query, NULL, NULL, &error);
-  if (error != NULL)
+  /* rowids of the deleted tiles may get reused */
+  champlain_tile_table_remove_all (priv->rowids);
+
+  /* continue with the next step so that loads and stores queued in the
+   * meantime don't wait for the whole purge */
+  if (!job->finished && priv->io_thread)
     {
-      DEBUG ("Deleting tile from db failed: %s", error);
-      sqlite3_free (error);
+      push_job (file_cache, (Job *) job);
+      return FALSE;
     }
-  sqlite3_free (query);
 
-  file = g_file_new_for_path (filename);
-  if (!g_file_delete (file, NULL, &gerror))
+  g_object_unref (file_cache);
+  g_slice_free (PurgeJob, job);
+
+  return FALSE;
+}
+
+
+/* Runs in the I/O thread */
+static void
+run_job (Job *job,
+    ChamplainFileCache *file_cache)
+{
+  switch (job->type)
     {
-      DEBUG ("Deleting tile from disk failed: %s", gerror->message);
-      g_error_free (gerror);
+    case JOB_INIT:
+      init_cache (file_cache);
+      g_slice_free (Job, job);
+      break;
+
+    case JOB_LOAD:
+      load_tile (file_cache, (LoadJob *) job);
+      clutter_threads_add_idle_full (CLUTTER_PRIORITY_REDRAW,
+          (GSourceFunc) load_finished_cb, job, NULL);
+      break;
+
+    case JOB_WRITE:
+      {
+        WriteJob *write_job = (WriteJob *) job;
+
+        write_batch (file_cache, write_job->ops);
+        g_ptr_array_unref (write_job->ops);
+        g_slice_free (WriteJob, write_job);
+      }
+      break;
+
+    case JOB_PURGE:
+      {
+        PurgeJob *purge_job = (PurgeJob *) job;
+
+        purge_job->finished = purge_db (file_cache, purge_job->size_limit);
+      }
+      clutter_threads_add_idle_full (CLUTTER_PRIORITY_REDRAW,
+          (GSourceFunc) purge_finished_cb, job, NULL);
+      break;
     }
-  g_object_unref (file);
 }
 
 
@@ -934,6 +1738,9 @@ champlain_file_cache_purge_on_idle (ChamplainFileCache *file_cache)
  * @file_cache: a #ChamplainFileCache
  *
  * Purge the cache from the less popular tiles until cache's size limit is reached.
+ * The purge is performed by the cache's I/O thread after all pending changes
+ * have been written; this call doesn't block. Tiles are deleted in small
+ * steps so that tile loads aren't delayed by a large purge.
  *
  * Since: 0.4
  */
@@ -943,77 +1750,17 @@ champlain_file_cache_purge (ChamplainFileCache *file_cache)
   g_return_if_fail (CHAMPLAIN_IS_FILE_CACHE (file_cache));
 
   ChamplainFileCachePrivate *priv = file_cache->priv;
-  gchar *query;
-  sqlite3_stmt *stmt;
-  int rc = 0;
-  guint current_size = 0;
-  guint highest_popularity = 0;
-  gchar *error;
-
-  query = "SELECT SUM (size) FROM tiles";
-  rc = sqlite3_prepare (priv->db, query, strlen (query), &stmt, NULL);
-  if (rc != SQLITE_OK)
-    {
-      DEBUG ("Can't compute cache size %s", sqlite3_errmsg (priv->db));
-    }
-
-  rc = sqlite3_step (stmt);
-  if (rc != SQLITE_ROW)
-    {
-      DEBUG ("Failed to count the total cache consumption %s",
-          sqlite3_errmsg (priv->db));
-      sqlite3_finalize (stmt);
-      return;
-    }
-
-  current_size = sqlite3_column_int (stmt, 0);
-  if (current_size < priv->size_limit)
-    {
-      DEBUG ("Cache doesn't need to be purged at %d bytes", current_size);
-      sqlite3_finalize (stmt);
-      return;
-    }
-
-  sqlite3_finalize (stmt);
-
-  /* Ok, delete the less popular tiles until size_limit reached */
-  query = "SELECT filename, size, popularity FROM tiles ORDER BY popularity";
-  rc = sqlite3_prepare (priv->db, query, strlen (query), &stmt, NULL);
-  if (rc != SQLITE_OK)
-    {
-      DEBUG ("Can't fetch tiles to delete: %s", sqlite3_errmsg (priv->db));
-    }
-
-  rc = sqlite3_step (stmt);
-  while (rc == SQLITE_ROW && current_size > priv->size_limit)
-    {
-      const char *filename;
-      guint size;
+  PurgeJob *job;
 
-      filename = (const char *) sqlite3_column_text (stmt, 0);
-      size = sqlite3_column_int (stmt, 1);
-      highest_popularity = sqlite3_column_int (stmt, 2);
-      DEBUG ("Deleting %s of size %d", filename, size);
-
-      delete_tile (file_cache, filename);
-
-      current_size -= size;
-
-      rc = sqlite3_step (stmt);
-    }
-  DEBUG ("Cache size is now %d", current_size);
+  if (!priv->io_thread)
+    return;
 
-  sqlite3_finalize (stmt);
+  flush_writes (file_cache);
 
-  query = sqlite3_mprintf ("UPDATE tiles SET popularity = popularity - %d",
-        highest_popularity);
-  sqlite3_exec (priv->db, query, NULL, NULL, &error);
-  if (error != NULL)
-    {
-      DEBUG ("Updating popularity failed: %s", error);
-      sqlite3_free (error);
-    }
-  sqlite3_free (query);
-  
-  sqlite3_exec (priv->db, "PRAGMA incremental_vacuum;", NULL, NULL, &error);
+  job = g_slice_new (PurgeJob);
+  job->job.type = JOB_PURGE;
+  job->file_cache = g_object_ref (file_cache);
+  job->size_limit = priv->size_limit;
+  job->finished = FALSE;
+  push_job (file_cache, (Job *) job);
 }
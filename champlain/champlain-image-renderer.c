@@ -23,9 +23,16 @@
  * #ChamplainImageRenderer renders tiles from binary image data. The rendering
  * is performed using #GdkPixbufLoader so the set of supported image
  * formats is equal to the set of formats supported by #GdkPixbufLoader.
+ *
+ * The images are decoded by a pool of threads shared by all image renderers,
+ * see champlain_image_renderer_set_max_decode_threads(). Tiles closer to the
+ * center of the view are decoded first and tiles which were discarded before
+ * their turn came are not decoded at all.
  */
 
 #include "champlain-image-renderer.h"
+#include "champlain-private.h"
+#include "champlain-texture-atlas.h"
 #include <gdk/gdk.h>
 
 G_DEFINE_TYPE (ChamplainImageRenderer, champlain_image_renderer, CHAMPLAIN_TYPE_RENDERER)
@@ -35,8 +42,7 @@ G_DEFINE_TYPE (ChamplainImageRenderer, champlain_image_renderer, CHAMPLAIN_TYPE_
 
 struct _ChamplainImageRendererPrivate
 {
-  gchar *data;
-  guint size;
+  GBytes *data;
 };
 
 typedef struct _RendererData RendererData;
@@ -45,15 +51,32 @@ struct _RendererData
 {
   ChamplainRenderer *renderer;
   ChamplainTile *tile;
-  gchar *data;
-  guint size;
+  GBytes *data;
+  guint priority;
+  guint serial;
+  gulong state_handler;
+  /* set by the main thread when the tile is discarded */
+  volatile gint cancelled;
+  /* set by the decoding thread */
+  GdkPixbuf *pixbuf;
+  gboolean skipped;
 };
 
+#define DEFAULT_MAX_DECODE_THREADS 2
+
+/* only accessed from the main thread */
+static GThreadPool *decode_pool = NULL;
+static guint max_decode_threads = DEFAULT_MAX_DECODE_THREADS;
+static guint decode_serial = 0;
+
 static void set_data (ChamplainRenderer *renderer,
     const gchar *data,
     guint size);
 static void render (ChamplainRenderer *renderer,
     ChamplainTile *tile);
+static void render_bytes (ChamplainRenderer *renderer,
+    ChamplainTile *tile,
+    GBytes *data);
 
 
 static void
@@ -68,7 +91,8 @@ champlain_image_renderer_finalize (GObject *object)
 {
   ChamplainImageRendererPrivate *priv = GET_PRIVATE (object);
 
-  g_free (priv->data);
+  if (priv->data)
+    g_bytes_unref (priv->data);
 
   G_OBJECT_CLASS (champlain_image_renderer_parent_class)->finalize (object);
 }
@@ -87,6 +111,7 @@ champlain_image_renderer_class_init (ChamplainImageRendererClass *klass)
 
   renderer_class->set_data = set_data;
   renderer_class->render = render;
+  champlain_renderer_class_set_render_bytes (renderer_class, render_bytes);
 }
 
 
@@ -123,51 +148,72 @@ set_data (ChamplainRenderer *renderer, const gchar *data, guint size)
   ChamplainImageRendererPrivate *priv = GET_PRIVATE (renderer);
 
   if (priv->data)
-    g_free (priv->data);
+    g_bytes_unref (priv->data);
 
-  priv->data = g_memdup (data, size);
-  priv->size = size;
+  priv->data = g_bytes_new (data, size);
 }
 
 
-static void 
-image_rendered_cb (GInputStream *stream, GAsyncResult *res, RendererData *data)
+static gboolean
+image_decoded_cb (RendererData *data)
 {
   ChamplainTile *tile = data->tile;
+  GdkPixbuf *pixbuf = data->pixbuf;
+  CoglPixelFormat format;
   gboolean error = TRUE;
   GError *gerror = NULL;
   ClutterActor *actor = NULL;
-  GdkPixbuf *pixbuf;
   ClutterContent *content;
   gfloat width, height;
-  
-  pixbuf = gdk_pixbuf_new_from_stream_finish (res, NULL);
+  gconstpointer contents;
+  gsize size;
+
+  g_signal_handler_disconnect (tile, data->state_handler);
+
+  /* report success so the data still gets cached, the tile just stays
+   * without content */
+  if (data->skipped)
+    {
+      error = FALSE;
+      goto finish;
+    }
+
   if (!pixbuf)
     {
       g_warning ("NULL pixbuf");
       goto finish;
     }
   
-  /* Load the image into clutter */
-  content = clutter_image_new ();
-  if (!clutter_image_set_data (CLUTTER_IMAGE (content),
-          gdk_pixbuf_get_pixels (pixbuf),
-          gdk_pixbuf_get_has_alpha (pixbuf)
-            ? COGL_PIXEL_FORMAT_RGBA_8888
-            : COGL_PIXEL_FORMAT_RGB_888,
-          gdk_pixbuf_get_width (pixbuf),
-          gdk_pixbuf_get_height (pixbuf),
-          gdk_pixbuf_get_rowstride (pixbuf),
-          &gerror))
+  /* Load the image into clutter, the pixels with alpha are premultiplied
+   * already so only opaque pixels have to be converted by Cogl while they
+   * are uploaded. The tiles share atlas textures when possible. */
+  format = gdk_pixbuf_get_has_alpha (pixbuf) ?
+    COGL_PIXEL_FORMAT_RGBA_8888_PRE : COGL_PIXEL_FORMAT_RGB_888;
+  content = champlain_texture_atlas_create_content (gdk_pixbuf_get_pixels (pixbuf),
+        format,
+        gdk_pixbuf_get_width (pixbuf),
+        gdk_pixbuf_get_height (pixbuf),
+        gdk_pixbuf_get_rowstride (pixbuf));
+  if (!content)
     {
-      if (gerror)
+      content = clutter_image_new ();
+      if (!clutter_image_set_data (CLUTTER_IMAGE (content),
+              gdk_pixbuf_get_pixels (pixbuf),
+              format,
+              gdk_pixbuf_get_width (pixbuf),
+              gdk_pixbuf_get_height (pixbuf),
+              gdk_pixbuf_get_rowstride (pixbuf),
+              &gerror))
         {
-          g_warning ("Unable to transfer to clutter: %s", gerror->message);
-          g_error_free (gerror);
+          if (gerror)
+            {
+              g_warning ("Unable to transfer to clutter: %s", gerror->message);
+              g_error_free (gerror);
+            }
+
+          g_object_unref (content);
+          goto finish;
         }
-
-      g_object_unref (content);
-      goto finish;
     }
 
   clutter_content_get_preferred_size (content, &width, &height);
@@ -175,8 +221,6 @@ image_rendered_cb (GInputStream *stream, GAsyncResult *res, RendererData *data)
   clutter_actor_set_size (actor, width, height);
   clutter_actor_set_content (actor, content);
   g_object_unref (content);
-  /* has to be set for proper opacity */
-  clutter_actor_set_offscreen_redirect (actor, CLUTTER_OFFSCREEN_REDIRECT_AUTOMATIC_FOR_OPACITY);
   
   error = FALSE;
 
@@ -185,41 +229,222 @@ finish:
   if (actor)
     champlain_tile_set_content (tile, actor);
 
-  g_signal_emit_by_name (tile, "render-complete", data->data, data->size, error);
+  contents = g_bytes_get_data (data->data, &size);
+  g_signal_emit_by_name (tile, "render-complete", contents, (guint) size, error);
 
   if (pixbuf)
     g_object_unref (pixbuf);
 
   g_object_unref (data->renderer);
   g_object_unref (tile);
-  g_object_unref (stream);
-  g_free (data->data);
+  g_bytes_unref (data->data);
   g_slice_free (RendererData, data);
+
+  return FALSE;
 }
 
 
+/* Premultiplies the pixels of pixbufs with alpha which is the format of the
+ * texture, opaque pixbufs are returned unchanged */
+static GdkPixbuf *
+premultiply_pixbuf (GdkPixbuf *pixbuf)
+{
+  GdkPixbuf *rgba;
+  guchar *pixels;
+  gint width, height, rowstride;
+  gint x, y;
+
+  if (!gdk_pixbuf_get_has_alpha (pixbuf))
+    return g_object_ref (pixbuf);
+
+  /* nobody else uses the pixbuf so it can be modified in place */
+  rgba = g_object_ref (pixbuf);
+  pixels = gdk_pixbuf_get_pixels (rgba);
+  width = gdk_pixbuf_get_width (rgba);
+  height = gdk_pixbuf_get_height (rgba);
+  rowstride = gdk_pixbuf_get_rowstride (rgba);
+
+  for (y = 0; y < height; y++)
+    {
+      guchar *p = pixels + y * rowstride;
+
+      for (x = 0; x < width; x++, p += 4)
+        {
+          guint alpha = p[3];
+
+          if (alpha == 255)
+            continue;
+
+          p[0] = (p[0] * alpha + 127) / 255;
+          p[1] = (p[1] * alpha + 127) / 255;
+          p[2] = (p[2] * alpha + 127) / 255;
+        }
+    }
 
+  return rgba;
+}
+
+
+/* Runs in the decoding threads */
 static void
-render (ChamplainRenderer *renderer, ChamplainTile *tile)
+decode_image (RendererData *data,
+    G_GNUC_UNUSED gpointer user_data)
 {
-  ChamplainImageRendererPrivate *priv = GET_PRIVATE (renderer);
-  GInputStream *stream;
+  GdkPixbufLoader *loader;
+  GError *error = NULL;
+  gconstpointer contents;
+  gsize size;
 
-  if (!priv->data || priv->size == 0)
+  /* the tile was discarded while waiting */
+  if (g_atomic_int_get (&data->cancelled))
     {
-      g_signal_emit_by_name (tile, "render-complete", priv->data, priv->size, TRUE);
-      return;
+      data->skipped = TRUE;
+      goto finish;
+    }
+
+  contents = g_bytes_get_data (data->data, &size);
+
+  loader = gdk_pixbuf_loader_new ();
+  if (!gdk_pixbuf_loader_write (loader, contents, size, &error))
+    gdk_pixbuf_loader_close (loader, NULL);
+  else
+    gdk_pixbuf_loader_close (loader, &error);
+
+  if (error)
+    {
+      g_warning ("Unable to decode the image: %s", error->message);
+      g_error_free (error);
     }
-    
+  else if (gdk_pixbuf_loader_get_pixbuf (loader))
+    data->pixbuf = premultiply_pixbuf (gdk_pixbuf_loader_get_pixbuf (loader));
+
+  g_object_unref (loader);
+
+finish:
+
+  clutter_threads_add_idle_full (CLUTTER_PRIORITY_REDRAW,
+      (GSourceFunc) image_decoded_cb, data, NULL);
+}
+
+
+static void
+tile_state_notify (ChamplainTile *tile,
+    G_GNUC_UNUSED GParamSpec *pspec,
+    RendererData *data)
+{
+  if (champlain_tile_get_state (tile) == CHAMPLAIN_STATE_DONE)
+    g_atomic_int_set (&data->cancelled, TRUE);
+}
+
+
+static gint
+compare_decode_jobs (gconstpointer a,
+    gconstpointer b,
+    G_GNUC_UNUSED gpointer user_data)
+{
+  const RendererData *data_a = a;
+  const RendererData *data_b = b;
+
+  if (data_a->priority != data_b->priority)
+    return data_a->priority < data_b->priority ? -1 : 1;
+
+  /* first come, first served otherwise */
+  if (data_a->serial != data_b->serial)
+    return data_a->serial < data_b->serial ? -1 : 1;
+
+  return 0;
+}
+
+
+static void
+render_bytes (ChamplainRenderer *renderer,
+    ChamplainTile *tile,
+    GBytes *bytes)
+{
   RendererData *data;
+  gconstpointer contents = NULL;
+  gsize size = 0;
+
+  if (bytes)
+    contents = g_bytes_get_data (bytes, &size);
+
+  if (!contents || size == 0)
+    {
+      g_signal_emit_by_name (tile, "render-complete", contents, (guint) size, TRUE);
+      return;
+    }
+
+  if (!decode_pool)
+    {
+      decode_pool = g_thread_pool_new ((GFunc) decode_image, NULL,
+            max_decode_threads, FALSE, NULL);
+      g_thread_pool_set_sort_function (decode_pool, compare_decode_jobs, NULL);
+    }
 
   data = g_slice_new (RendererData);
   data->tile = g_object_ref (tile);
   data->renderer = g_object_ref (renderer);
-  data->data = priv->data;
-  data->size = priv->size;
-    
-  stream = g_memory_input_stream_new_from_data (priv->data, priv->size, NULL);
-  gdk_pixbuf_new_from_stream_async (stream, NULL, (GAsyncReadyCallback)image_rendered_cb, data);
+  data->data = g_bytes_ref (bytes);
+  data->priority = champlain_tile_get_load_priority (tile);
+  data->serial = decode_serial++;
+  data->pixbuf = NULL;
+  data->skipped = FALSE;
+  data->cancelled = champlain_tile_get_state (tile) == CHAMPLAIN_STATE_DONE;
+  /* the tile is only read from the main thread, the decoding thread checks
+   * the flag */
+  data->state_handler = g_signal_connect (tile, "notify::state",
+        G_CALLBACK (tile_state_notify), data);
+
+  g_thread_pool_push (decode_pool, data, NULL);
+}
+
+
+static void
+render (ChamplainRenderer *renderer, ChamplainTile *tile)
+{
+  ChamplainImageRendererPrivate *priv = GET_PRIVATE (renderer);
+  GBytes *bytes = priv->data;
+
   priv->data = NULL;
+  render_bytes (renderer, tile, bytes);
+
+  if (bytes)
+    g_bytes_unref (bytes);
+}
+
+
+/**
+ * champlain_image_renderer_set_max_decode_threads:
+ * @max_threads: the maximal number of threads
+ *
+ * Sets the maximal number of threads decoding images. The threads are shared
+ * by all image renderers. Has to be called from the main thread.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_image_renderer_set_max_decode_threads (guint max_threads)
+{
+  g_return_if_fail (max_threads > 0);
+
+  max_decode_threads = max_threads;
+
+  if (decode_pool)
+    g_thread_pool_set_max_threads (decode_pool, max_threads, NULL);
+}
+
+
+/**
+ * champlain_image_renderer_get_max_decode_threads:
+ *
+ * Gets the maximal number of threads decoding images.
+ *
+ * Returns: the maximal number of threads
+ *
+ * Since: 0.12.6
+ */
+guint
+champlain_image_renderer_get_max_decode_threads (void)
+{
+  return max_decode_threads;
 }
@@ -74,6 +74,9 @@ GType champlain_image_renderer_get_type (void);
 
 ChamplainImageRenderer *champlain_image_renderer_new (void);
 
+void champlain_image_renderer_set_max_decode_threads (guint max_threads);
+guint champlain_image_renderer_get_max_decode_threads (void);
+
 G_END_DECLS
 
 #endif /* __CHAMPLAIN_IMAGE_RENDERER_H__ */
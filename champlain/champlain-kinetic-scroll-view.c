@@ -22,6 +22,7 @@
  */
 
 #include "champlain-kinetic-scroll-view.h"
+#include "champlain-private.h"
 #include "champlain-enum-types.h"
 #include "champlain-marshal.h"
 #include "champlain-adjustment.h"
@@ -671,3 +672,30 @@ champlain_kinetic_scroll_view_stop (ChamplainKineticScrollView *scroll)
       priv->deceleration_timeline = NULL;
     }
 }
+
+
+gboolean
+champlain_kinetic_scroll_view_get_remaining_distance (ChamplainKineticScrollView *scroll,
+    gdouble *dx,
+    gdouble *dy)
+{
+  ChamplainKineticScrollViewPrivate *priv;
+  gdouble factor;
+
+  g_return_val_if_fail (CHAMPLAIN_IS_KINETIC_SCROLL_VIEW (scroll), FALSE);
+
+  priv = scroll->priv;
+
+  if (!priv->deceleration_timeline ||
+      !clutter_timeline_is_playing (priv->deceleration_timeline) ||
+      priv->decel_rate <= 1.0)
+    return FALSE;
+
+  /* every step moves by dx and divides it by decel_rate - the sum of the
+   * geometric series */
+  factor = priv->decel_rate / (priv->decel_rate - 1.0);
+  *dx = priv->dx * factor;
+  *dy = priv->dy * factor;
+
+  return TRUE;
+}
@@ -31,6 +31,8 @@
  */
 
 #include "champlain-map-source-chain.h"
+#include "champlain-network-tile-source.h"
+#include "champlain-private.h"
 #include "champlain-tile-cache.h"
 #include "champlain-tile-source.h"
 
@@ -285,6 +287,51 @@ assign_cache_of_next_source_sequence (ChamplainMapSourceChain *source_chain,
 }
 
 
+/* Returns the first source of map_source and its next sources which isn't
+ * a chain, looking inside of the chains */
+static ChamplainMapSource *
+skip_chains (ChamplainMapSource *map_source)
+{
+  /* the bottom of the stack continues with the chain's next source */
+  while (CHAMPLAIN_IS_MAP_SOURCE_CHAIN (map_source))
+    {
+      if (CHAMPLAIN_MAP_SOURCE_CHAIN (map_source)->priv->stack_top)
+        map_source = CHAMPLAIN_MAP_SOURCE_CHAIN (map_source)->priv->stack_top;
+      else
+        map_source = champlain_map_source_get_next_source (map_source);
+    }
+
+  return map_source;
+}
+
+
+void
+champlain_map_source_warm_up (ChamplainMapSource *map_source)
+{
+  for (map_source = skip_chains (map_source); map_source;
+       map_source = skip_chains (champlain_map_source_get_next_source (map_source)))
+    {
+      if (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (map_source))
+        champlain_network_tile_source_warm_up (CHAMPLAIN_NETWORK_TILE_SOURCE (map_source));
+    }
+}
+
+
+ChamplainMapSource *
+champlain_map_source_find_by_type (ChamplainMapSource *map_source,
+    GType type)
+{
+  for (map_source = skip_chains (map_source); map_source;
+       map_source = skip_chains (champlain_map_source_get_next_source (map_source)))
+    {
+      if (G_TYPE_CHECK_INSTANCE_TYPE (map_source, type))
+        return map_source;
+    }
+
+  return NULL;
+}
+
+
 /**
  * champlain_map_source_chain_push:
  * @source_chain: a #ChamplainMapSourceChain
@@ -44,6 +44,7 @@
 #include "champlain-memphis-renderer.h"
 #endif
 #include "champlain-file-cache.h"
+#include "champlain-packed-cache.h"
 #include "champlain-defines.h"
 #include "champlain-enum-types.h"
 #include "champlain-map-source.h"
@@ -67,6 +68,8 @@ enum
 enum
 {
   PROP_0,
+  PROP_CACHE_BACKEND,
+  PROP_REVALIDATE_IN_BACKGROUND
 };
 
 /* static guint champlain_map_source_factory_signals[LAST_SIGNAL] = { 0, }; */
@@ -77,9 +80,16 @@ G_DEFINE_TYPE (ChamplainMapSourceFactory, champlain_map_source_factory, G_TYPE_O
 #define GET_PRIVATE(obj) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((obj), CHAMPLAIN_TYPE_MAP_SOURCE_FACTORY, ChamplainMapSourceFactoryPrivate))
 
+/* decoded tiles kept by the memory caches of created sources, enough for
+ * a few screens of 256x256 tiles which the view shows as placeholders
+ * while zooming */
+#define MEMORY_CACHE_CONTENT_SIZE_LIMIT (32 * 1024 * 1024)
+
 struct _ChamplainMapSourceFactoryPrivate
 {
   GSList *registered_sources;
+  ChamplainCacheBackend cache_backend;
+  gboolean revalidate_in_background;
 };
 
 static ChamplainMapSource *champlain_map_source_new_generic (
@@ -91,6 +101,54 @@ static ChamplainMapSource *champlain_map_source_new_memphis (
 #endif
 
 
+static void
+champlain_map_source_factory_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainMapSourceFactory *factory = CHAMPLAIN_MAP_SOURCE_FACTORY (object);
+
+  switch (property_id)
+    {
+    case PROP_CACHE_BACKEND:
+      g_value_set_enum (value, champlain_map_source_factory_get_cache_backend (factory));
+      break;
+
+    case PROP_REVALIDATE_IN_BACKGROUND:
+      g_value_set_boolean (value, champlain_map_source_factory_get_revalidate_in_background (factory));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+champlain_map_source_factory_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainMapSourceFactory *factory = CHAMPLAIN_MAP_SOURCE_FACTORY (object);
+
+  switch (property_id)
+    {
+    case PROP_CACHE_BACKEND:
+      champlain_map_source_factory_set_cache_backend (factory, g_value_get_enum (value));
+      break;
+
+    case PROP_REVALIDATE_IN_BACKGROUND:
+      champlain_map_source_factory_set_revalidate_in_background (factory, g_value_get_boolean (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
 static void
 champlain_map_source_factory_finalize (GObject *object)
 {
@@ -135,6 +193,41 @@ champlain_map_source_factory_class_init (ChamplainMapSourceFactoryClass *klass)
 
   object_class->constructor = champlain_map_source_factory_constructor;
   object_class->finalize = champlain_map_source_factory_finalize;
+  object_class->get_property = champlain_map_source_factory_get_property;
+  object_class->set_property = champlain_map_source_factory_set_property;
+
+  /**
+   * ChamplainMapSourceFactory:cache-backend:
+   *
+   * The persistent cache used by the map sources created by
+   * champlain_map_source_factory_create_cached_source().
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_CACHE_BACKEND,
+      g_param_spec_enum ("cache-backend",
+          "Cache Backend",
+          "The persistent cache used by cached sources",
+          CHAMPLAIN_TYPE_CACHE_BACKEND,
+          CHAMPLAIN_CACHE_BACKEND_FILE,
+          G_PARAM_READWRITE));
+
+  /**
+   * ChamplainMapSourceFactory:revalidate-in-background:
+   *
+   * The value of #ChamplainTileCache:revalidate-in-background of the
+   * persistent caches created by champlain_map_source_factory_create_cached_source().
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_REVALIDATE_IN_BACKGROUND,
+      g_param_spec_boolean ("revalidate-in-background",
+          "Revalidate in background",
+          "Display expired cached tiles while they are validated",
+          FALSE,
+          G_PARAM_READWRITE));
 }
 
 
@@ -146,6 +239,8 @@ champlain_map_source_factory_init (ChamplainMapSourceFactory *factory)
 
   factory->priv = priv;
   priv->registered_sources = NULL;
+  priv->cache_backend = CHAMPLAIN_CACHE_BACKEND_FILE;
+  priv->revalidate_in_background = FALSE;
 
   desc = champlain_map_source_desc_new_full (
         CHAMPLAIN_MAP_SOURCE_OSM_MAPNIK,
@@ -437,6 +532,88 @@ champlain_map_source_factory_create (ChamplainMapSourceFactory *factory,
 }
 
 
+/**
+ * champlain_map_source_factory_get_cache_backend:
+ * @factory: the Factory
+ *
+ * Gets the persistent cache used by champlain_map_source_factory_create_cached_source().
+ *
+ * Returns: the cache backend
+ *
+ * Since: 0.12.6
+ */
+ChamplainCacheBackend
+champlain_map_source_factory_get_cache_backend (ChamplainMapSourceFactory *factory)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_MAP_SOURCE_FACTORY (factory), CHAMPLAIN_CACHE_BACKEND_FILE);
+
+  return factory->priv->cache_backend;
+}
+
+
+/**
+ * champlain_map_source_factory_set_cache_backend:
+ * @factory: the Factory
+ * @cache_backend: the cache backend
+ *
+ * Sets the persistent cache used by the map sources created by
+ * champlain_map_source_factory_create_cached_source() afterwards.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_map_source_factory_set_cache_backend (ChamplainMapSourceFactory *factory,
+    ChamplainCacheBackend cache_backend)
+{
+  g_return_if_fail (CHAMPLAIN_IS_MAP_SOURCE_FACTORY (factory));
+
+  factory->priv->cache_backend = cache_backend;
+  g_object_notify (G_OBJECT (factory), "cache-backend");
+}
+
+
+/**
+ * champlain_map_source_factory_get_revalidate_in_background:
+ * @factory: the Factory
+ *
+ * Gets whether the persistent caches created by
+ * champlain_map_source_factory_create_cached_source() display expired tiles
+ * while they are validated.
+ *
+ * Returns: %TRUE when expired tiles are displayed immediately
+ *
+ * Since: 0.12.6
+ */
+gboolean
+champlain_map_source_factory_get_revalidate_in_background (ChamplainMapSourceFactory *factory)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_MAP_SOURCE_FACTORY (factory), FALSE);
+
+  return factory->priv->revalidate_in_background;
+}
+
+
+/**
+ * champlain_map_source_factory_set_revalidate_in_background:
+ * @factory: the Factory
+ * @revalidate: whether expired tiles should be displayed immediately
+ *
+ * Sets #ChamplainTileCache:revalidate-in-background of the persistent caches
+ * created by champlain_map_source_factory_create_cached_source() afterwards.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_map_source_factory_set_revalidate_in_background (ChamplainMapSourceFactory *factory,
+    gboolean revalidate)
+{
+  g_return_if_fail (CHAMPLAIN_IS_MAP_SOURCE_FACTORY (factory));
+
+  factory->priv->revalidate_in_background = revalidate;
+  g_object_notify (G_OBJECT (factory), "revalidate-in-background");
+}
+
+
 /**
  * champlain_map_source_factory_create_cached_source:
  * @factory: the Factory
@@ -445,8 +622,11 @@ champlain_map_source_factory_create (ChamplainMapSourceFactory *factory,
  * Creates a cached map source.
  *
  * Returns: (transfer none): a ready to use #ChamplainMapSourceChain consisting of
- * #ChamplainMemoryCache, #ChamplainFileCache, #ChamplainMapSource matching the given name, and
+ * #ChamplainMemoryCache, a persistent cache selected by
+ * #ChamplainMapSourceFactory:cache-backend, #ChamplainMapSource matching the given name, and
  * an error tile source created with champlain_map_source_factory_create_error_source ().
+ * The memory cache keeps up to 32 MB of decoded tiles (see
+ * #ChamplainMemoryCache:content-size-limit).
  *
  * Since: 0.6
  */
@@ -468,10 +648,17 @@ champlain_map_source_factory_create_cached_source (ChamplainMapSourceFactory *fa
   error_source = champlain_map_source_factory_create_error_source (factory, tile_size);
 
   renderer = CHAMPLAIN_RENDERER (champlain_image_renderer_new ());
-  file_cache = CHAMPLAIN_MAP_SOURCE (champlain_file_cache_new_full (100000000, NULL, renderer));
+  if (factory->priv->cache_backend == CHAMPLAIN_CACHE_BACKEND_PACKED)
+    file_cache = CHAMPLAIN_MAP_SOURCE (champlain_packed_cache_new_full (100000000, NULL, renderer));
+  else
+    file_cache = CHAMPLAIN_MAP_SOURCE (champlain_file_cache_new_full (100000000, NULL, renderer));
+  champlain_tile_cache_set_revalidate_in_background (CHAMPLAIN_TILE_CACHE (file_cache),
+      factory->priv->revalidate_in_background);
 
   renderer = CHAMPLAIN_RENDERER (champlain_image_renderer_new ());
   memory_cache = CHAMPLAIN_MAP_SOURCE (champlain_memory_cache_new_full (100, renderer));
+  champlain_memory_cache_set_content_size_limit (CHAMPLAIN_MEMORY_CACHE (memory_cache),
+      MEMORY_CACHE_CONTENT_SIZE_LIMIT);
 
   source_chain = champlain_map_source_chain_new ();
   champlain_map_source_chain_push (source_chain, error_source);
@@ -508,6 +695,8 @@ champlain_map_source_factory_create_memcached_source (ChamplainMapSourceFactory
 
   renderer = CHAMPLAIN_RENDERER (champlain_image_renderer_new ());
   memory_cache = CHAMPLAIN_MAP_SOURCE (champlain_memory_cache_new_full (100, renderer));
+  champlain_memory_cache_set_content_size_limit (CHAMPLAIN_MEMORY_CACHE (memory_cache),
+      MEMORY_CACHE_CONTENT_SIZE_LIMIT);
 
   source_chain = champlain_map_source_chain_new ();
   champlain_map_source_chain_push (source_chain, tile_source);
@@ -52,6 +52,22 @@ G_BEGIN_DECLS
 
 typedef struct _ChamplainMapSourceFactoryPrivate ChamplainMapSourceFactoryPrivate;
 
+/**
+ * ChamplainCacheBackend:
+ * @CHAMPLAIN_CACHE_BACKEND_FILE: tiles are cached in separate files by #ChamplainFileCache
+ * @CHAMPLAIN_CACHE_BACKEND_PACKED: tiles are cached in a single database per map
+ *     source by #ChamplainPackedCache
+ *
+ * The persistent cache used by champlain_map_source_factory_create_cached_source().
+ *
+ * Since: 0.12.6
+ */
+typedef enum
+{
+  CHAMPLAIN_CACHE_BACKEND_FILE,
+  CHAMPLAIN_CACHE_BACKEND_PACKED
+} ChamplainCacheBackend;
+
 typedef struct _ChamplainMapSourceFactory ChamplainMapSourceFactory;
 typedef struct _ChamplainMapSourceFactoryClass ChamplainMapSourceFactoryClass;
 
@@ -87,6 +103,13 @@ ChamplainMapSource *champlain_map_source_factory_create_memcached_source (Champl
 ChamplainMapSource *champlain_map_source_factory_create_error_source (ChamplainMapSourceFactory *factory,
     guint tile_size);
 
+ChamplainCacheBackend champlain_map_source_factory_get_cache_backend (ChamplainMapSourceFactory *factory);
+void champlain_map_source_factory_set_cache_backend (ChamplainMapSourceFactory *factory,
+    ChamplainCacheBackend cache_backend);
+gboolean champlain_map_source_factory_get_revalidate_in_background (ChamplainMapSourceFactory *factory);
+void champlain_map_source_factory_set_revalidate_in_background (ChamplainMapSourceFactory *factory,
+    gboolean revalidate);
+
 gboolean champlain_map_source_factory_register (ChamplainMapSourceFactory *factory,
     ChamplainMapSourceDesc *desc);
 GSList *champlain_map_source_factory_get_registered (ChamplainMapSourceFactory *factory);
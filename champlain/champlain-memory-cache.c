@@ -24,12 +24,20 @@
  * memory. The cache contents is not preserved between application restarts
  * so this cache serves mostly as a quick access temporary cache to the
  * most recently used tiles.
+ *
+ * Optionally, the cache can also keep the decoded contents of the most
+ * recently displayed tiles (see #ChamplainMemoryCache:content-size-limit).
+ * Tiles found in this part of the cache are displayed directly without being
+ * passed to the renderer again.
  */
 
 #define DEBUG_FLAG CHAMPLAIN_DEBUG_CACHE
 #include "champlain-debug.h"
 
 #include "champlain-memory-cache.h"
+#include "champlain-private.h"
+#include "champlain-tile-table.h"
+#include "champlain-texture-atlas.h"
 
 #include <glib.h>
 #include <string.h>
@@ -42,23 +50,44 @@ G_DEFINE_TYPE (ChamplainMemoryCache, champlain_memory_cache, CHAMPLAIN_TYPE_TILE
 enum
 {
   PROP_0,
-  PROP_SIZE_LIMIT
+  PROP_SIZE_LIMIT,
+  PROP_CONTENT_SIZE_LIMIT
 };
 
 struct _ChamplainMemoryCachePrivate
 {
   guint size_limit;
   GQueue *queue;
-  GHashTable *hash_table;
+  ChamplainTileTable *hash_table;
+
+  guint content_size_limit;
+  gsize content_size;
+  GQueue *content_queue;
+  ChamplainTileTable *content_hash_table;
+
+  /* last seen id of the map source and its interned value */
+  gchar *source_id_name;
+  guint16 source_id;
+  /* ids of the map sources of the cached tiles */
+  GHashTable *source_ids;
 };
 
 typedef struct
 {
-  gchar *key;
-  gchar *data;
-  guint size;
+  guint64 key;
+  /* NULL for tiles missing at the tile source */
+  GBytes *data;
+  /* time in seconds until which a missing tile isn't requested again */
+  gint64 missing_until;
 } QueueMember;
 
+typedef struct
+{
+  guint64 key;
+  ClutterContent *content;
+  gsize size;
+} ContentMember;
+
 
 static void fill_tile (ChamplainMapSource *map_source,
     ChamplainTile *tile);
@@ -71,6 +100,8 @@ static void refresh_tile_time (ChamplainTileCache *tile_cache,
     ChamplainTile *tile);
 static void on_tile_filled (ChamplainTileCache *tile_cache,
     ChamplainTile *tile);
+static void store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
 
 
 static void
@@ -87,6 +118,10 @@ champlain_memory_cache_get_property (GObject *object,
       g_value_set_uint (value, champlain_memory_cache_get_size_limit (memory_cache));
       break;
 
+    case PROP_CONTENT_SIZE_LIMIT:
+      g_value_set_uint (value, champlain_memory_cache_get_content_size_limit (memory_cache));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -107,6 +142,10 @@ champlain_memory_cache_set_property (GObject *object,
       champlain_memory_cache_set_size_limit (memory_cache, g_value_get_uint (value));
       break;
 
+    case PROP_CONTENT_SIZE_LIMIT:
+      champlain_memory_cache_set_content_size_limit (memory_cache, g_value_get_uint (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -127,7 +166,11 @@ champlain_memory_cache_finalize (GObject *object)
 
   champlain_memory_cache_clean (memory_cache);
   g_queue_free (memory_cache->priv->queue);
-  g_hash_table_destroy (memory_cache->priv->hash_table);
+  champlain_tile_table_free (memory_cache->priv->hash_table);
+  g_queue_free (memory_cache->priv->content_queue);
+  champlain_tile_table_free (memory_cache->priv->content_hash_table);
+  g_free (memory_cache->priv->source_id_name);
+  g_hash_table_unref (memory_cache->priv->source_ids);
 
   G_OBJECT_CLASS (champlain_memory_cache_parent_class)->finalize (object);
 }
@@ -164,9 +207,29 @@ champlain_memory_cache_class_init (ChamplainMemoryCacheClass *klass)
         G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
   g_object_class_install_property (object_class, PROP_SIZE_LIMIT, pspec);
 
+  /**
+   * ChamplainMemoryCache:content-size-limit:
+   *
+   * The maximum size in bytes of decoded tile contents kept in the cache.
+   * The size of a tile is computed from its pixel size, independently of
+   * the size of the compressed tile data. When set to 0, decoded contents
+   * are not cached.
+   *
+   * Since: 0.12.6
+   */
+  pspec = g_param_spec_uint ("content-size-limit",
+        "Content Size Limit",
+        "Maximal size of stored decoded tiles in bytes",
+        0,
+        G_MAXUINT,
+        0,
+        G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_CONTENT_SIZE_LIMIT, pspec);
+
   tile_cache_class->store_tile = store_tile;
   tile_cache_class->refresh_tile_time = refresh_tile_time;
   tile_cache_class->on_tile_filled = on_tile_filled;
+  champlain_tile_cache_class_set_store_missing_tile (tile_cache_class, store_missing_tile);
 
   map_source_class->fill_tile = fill_tile;
 }
@@ -206,7 +269,13 @@ champlain_memory_cache_init (ChamplainMemoryCache *memory_cache)
   memory_cache->priv = priv;
 
   priv->queue = g_queue_new ();
-  priv->hash_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  priv->hash_table = champlain_tile_table_new (NULL);
+  priv->content_size = 0;
+  priv->content_queue = g_queue_new ();
+  priv->content_hash_table = champlain_tile_table_new (NULL);
+  priv->source_id_name = NULL;
+  priv->source_id = 0;
+  priv->source_ids = champlain_tile_key_source_ids_new ();
 }
 
 
@@ -251,22 +320,104 @@ champlain_memory_cache_set_size_limit (ChamplainMemoryCache *memory_cache,
 }
 
 
-static gchar *
-generate_queue_key (ChamplainMemoryCache *memory_cache,
-    ChamplainTile *tile)
+static void delete_content_member (ContentMember *member,
+    gpointer user_data);
+
+
+static void
+trim_contents (ChamplainMemoryCache *memory_cache)
 {
-  g_return_val_if_fail (CHAMPLAIN_IS_MEMORY_CACHE (memory_cache), NULL);
-  g_return_val_if_fail (CHAMPLAIN_IS_TILE (tile), NULL);
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+
+  while (priv->content_size > priv->content_size_limit &&
+         !g_queue_is_empty (priv->content_queue))
+    {
+      ContentMember *member = g_queue_pop_tail (priv->content_queue);
+
+      champlain_tile_table_remove (priv->content_hash_table, member->key);
+      priv->content_size -= member->size;
+      delete_content_member (member, NULL);
+    }
+}
+
+
+/**
+ * champlain_memory_cache_get_content_size_limit:
+ * @memory_cache: a #ChamplainMemoryCache
+ *
+ * Gets the maximum size in bytes of decoded tile contents stored in the cache.
+ *
+ * Returns: maximum size of stored decoded tiles
+ *
+ * Since: 0.12.6
+ */
+guint
+champlain_memory_cache_get_content_size_limit (ChamplainMemoryCache *memory_cache)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_MEMORY_CACHE (memory_cache), 0);
+
+  return memory_cache->priv->content_size_limit;
+}
+
+
+/**
+ * champlain_memory_cache_set_content_size_limit:
+ * @memory_cache: a #ChamplainMemoryCache
+ * @content_size_limit: maximum size in bytes of decoded tiles stored in the
+ * cache, 0 disables caching of decoded tiles
+ *
+ * Sets the maximum size in bytes of decoded tile contents stored in the cache.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_memory_cache_set_content_size_limit (ChamplainMemoryCache *memory_cache,
+    guint content_size_limit)
+{
+  g_return_if_fail (CHAMPLAIN_IS_MEMORY_CACHE (memory_cache));
+
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+
+  priv->content_size_limit = content_size_limit;
+  trim_contents (memory_cache);
+  g_object_notify (G_OBJECT (memory_cache), "content-size-limit");
+}
+
+
+static guint16
+get_source_id (ChamplainMemoryCache *memory_cache)
+{
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+  const gchar *id;
+
+  /* the id is taken from the next source so it can change when the chain
+   * changes - only intern it again in that case */
+  id = champlain_map_source_get_id (CHAMPLAIN_MAP_SOURCE (memory_cache));
+  if (g_strcmp0 (id, priv->source_id_name) != 0)
+    {
+      g_free (priv->source_id_name);
+      priv->source_id_name = g_strdup (id);
+      priv->source_id = champlain_tile_key_intern_source_in (priv->source_ids, id);
 
-  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (memory_cache);
-  gchar *key;
+      if (priv->source_id == CHAMPLAIN_TILE_KEY_NO_SOURCE && id)
+        {
+          /* all ids are taken by other sources - start over */
+          DEBUG ("Too many map sources, cleaning the cache");
+          champlain_memory_cache_clean (memory_cache);
+          g_hash_table_remove_all (priv->source_ids);
+          priv->source_id = champlain_tile_key_intern_source_in (priv->source_ids, id);
+        }
+    }
 
-  key = g_strdup_printf ("%d/%d/%d/%s",
-        champlain_tile_get_zoom_level (tile),
-        champlain_tile_get_x (tile),
-        champlain_tile_get_y (tile),
-        champlain_map_source_get_id (map_source));
-  return key;
+  return priv->source_id;
+}
+
+
+static guint64
+generate_queue_key (ChamplainMemoryCache *memory_cache,
+    ChamplainTile *tile)
+{
+  return champlain_tile_key_for_tile (get_source_id (memory_cache), tile);
 }
 
 
@@ -283,13 +434,177 @@ delete_queue_member (QueueMember *member, gpointer user_data)
 {
   if (member)
     {
-      g_free (member->key);
-      g_free (member->data);
+      if (member->data)
+        g_bytes_unref (member->data);
       g_slice_free (QueueMember, member);
     }
 }
 
 
+static void
+delete_content_member (ContentMember *member, gpointer user_data)
+{
+  if (member)
+    {
+      g_object_unref (member->content);
+      g_slice_free (ContentMember, member);
+    }
+}
+
+
+/* Adds a new member to the head of the queue, takes ownership of data */
+static void
+insert_queue_member (ChamplainMemoryCache *memory_cache,
+    guint64 key,
+    GBytes *data,
+    gint64 missing_until)
+{
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+  QueueMember *member;
+
+  if (priv->queue->length >= priv->size_limit)
+    {
+      member = g_queue_pop_tail (priv->queue);
+      champlain_tile_table_remove (priv->hash_table, member->key);
+      delete_queue_member (member, NULL);
+    }
+
+  member = g_slice_new (QueueMember);
+  member->key = key;
+  member->data = data;
+  member->missing_until = missing_until;
+
+  g_queue_push_head (priv->queue, member);
+  champlain_tile_table_insert (priv->hash_table, key, g_queue_peek_head_link (priv->queue));
+}
+
+
+static void
+store_content (ChamplainMemoryCache *memory_cache,
+    ChamplainTile *tile)
+{
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+  ClutterActor *actor;
+  ClutterContent *content;
+  ContentMember *member;
+  GList *link;
+  gfloat width, height;
+  gsize size;
+  guint64 key;
+
+  if (priv->content_size_limit == 0)
+    return;
+
+  actor = champlain_tile_get_content (tile);
+  if (!actor)
+    return;
+
+  content = clutter_actor_get_content (actor);
+  if (!CLUTTER_IS_IMAGE (content) && !CHAMPLAIN_IS_ATLAS_CONTENT (content))
+    return;
+
+  /* count the uploaded RGBA texture, not the compressed data */
+  clutter_content_get_preferred_size (content, &width, &height);
+  size = (gsize) width * (gsize) height * 4;
+  if (size == 0 || size > priv->content_size_limit)
+    return;
+
+  key = generate_queue_key (memory_cache, tile);
+  if (key == CHAMPLAIN_TILE_KEY_INVALID)
+    return;
+
+  link = champlain_tile_table_lookup (priv->content_hash_table, key);
+  if (link)
+    {
+      member = link->data;
+      move_queue_member_to_head (priv->content_queue, link);
+
+      if (member->content != content)
+        {
+          g_object_unref (member->content);
+          member->content = g_object_ref (content);
+          priv->content_size = priv->content_size - member->size + size;
+          member->size = size;
+        }
+    }
+  else
+    {
+      member = g_slice_new (ContentMember);
+      member->key = key;
+      member->content = g_object_ref (content);
+      member->size = size;
+
+      g_queue_push_head (priv->content_queue, member);
+      champlain_tile_table_insert (priv->content_hash_table, key, g_queue_peek_head_link (priv->content_queue));
+      priv->content_size += size;
+    }
+
+  trim_contents (memory_cache);
+}
+
+
+static gboolean
+display_stored_content (ChamplainMemoryCache *memory_cache,
+    ChamplainTile *tile)
+{
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+  ChamplainMapSource *next_source;
+  ContentMember *member;
+  ClutterActor *actor;
+  gfloat width, height;
+  GList *link;
+
+  if (priv->content_size_limit == 0)
+    return FALSE;
+
+  link = champlain_tile_table_lookup (priv->content_hash_table,
+        generate_queue_key (memory_cache, tile));
+  if (!link)
+    return FALSE;
+
+  member = link->data;
+  move_queue_member_to_head (priv->content_queue, link);
+
+  clutter_content_get_preferred_size (member->content, &width, &height);
+  actor = clutter_actor_new ();
+  clutter_actor_set_size (actor, width, height);
+  clutter_actor_set_content (actor, member->content);
+  champlain_tile_set_content (tile, actor);
+
+  next_source = champlain_map_source_get_next_source (CHAMPLAIN_MAP_SOURCE (memory_cache));
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_on_tile_filled (CHAMPLAIN_TILE_CACHE (next_source), tile);
+
+  /* handlers of the DONE state may drop the last reference to the tile */
+  g_object_ref (tile);
+  champlain_tile_set_fade_in (tile, FALSE);
+  champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
+  champlain_tile_display_content (tile);
+  g_object_unref (tile);
+
+  return TRUE;
+}
+
+
+/* Remembers the decoded content of tiles rendered by the sources behind
+ * this cache */
+static void
+next_source_rendered_cb (ChamplainTile *tile,
+    gpointer data,
+    guint size,
+    gboolean error,
+    ChamplainMemoryCache *memory_cache)
+{
+  g_signal_handlers_disconnect_by_func (tile, next_source_rendered_cb, memory_cache);
+
+  /* error tiles are rendered without data */
+  if (error || !data)
+    return;
+
+  store_content (memory_cache, tile);
+}
+
+
 static void
 tile_rendered_cb (ChamplainTile *tile,
     gpointer data,
@@ -305,6 +620,8 @@ tile_rendered_cb (ChamplainTile *tile,
 
   if (!error)
     {
+      store_content (CHAMPLAIN_MEMORY_CACHE (map_source), tile);
+
       if (CHAMPLAIN_IS_TILE_CACHE (next_source))
         champlain_tile_cache_on_tile_filled (CHAMPLAIN_TILE_CACHE (next_source), tile);
 
@@ -338,11 +655,31 @@ fill_tile (ChamplainMapSource *map_source,
       ChamplainMemoryCachePrivate *priv = memory_cache->priv;
       ChamplainRenderer *renderer;
       GList *link;
-      gchar *key;
 
-      key = generate_queue_key (memory_cache, tile);
-      link = g_hash_table_lookup (priv->hash_table, key);
-      g_free (key);
+      if (display_stored_content (memory_cache, tile))
+        return;
+
+      link = champlain_tile_table_lookup (priv->hash_table,
+            generate_queue_key (memory_cache, tile));
+      if (link && !((QueueMember *) link->data)->data)
+        {
+          QueueMember *member = link->data;
+
+          if (member->missing_until > g_get_real_time () / G_USEC_PER_SEC)
+            {
+              DEBUG ("Tile %d, %d is missing", champlain_tile_get_x (tile), champlain_tile_get_y (tile));
+              move_queue_member_to_head (priv->queue, link);
+              champlain_tile_cache_fill_missing_tile (CHAMPLAIN_TILE_CACHE (memory_cache), tile);
+              return;
+            }
+
+          /* expired, ask the tile source again */
+          g_queue_delete_link (priv->queue, link);
+          champlain_tile_table_remove (priv->hash_table, member->key);
+          delete_queue_member (member, NULL);
+          link = NULL;
+        }
+
       if (link)
         {
           QueueMember *member = link->data;
@@ -358,11 +695,15 @@ fill_tile (ChamplainMapSource *map_source,
 
           g_signal_connect (tile, "render-complete", G_CALLBACK (tile_rendered_cb), map_source);
 
-          champlain_renderer_set_data (renderer, member->data, member->size);
-          champlain_renderer_render (renderer, tile);
+          champlain_renderer_render_bytes (renderer, tile, member->data);
 
           return;
         }
+
+      g_signal_handlers_disconnect_by_func (tile, next_source_rendered_cb, memory_cache);
+      if (priv->content_size_limit > 0)
+        g_signal_connect_object (tile, "render-complete",
+            G_CALLBACK (next_source_rendered_cb), memory_cache, 0);
     }
 
   if (CHAMPLAIN_IS_MAP_SOURCE (next_source))
@@ -389,37 +730,79 @@ store_tile (ChamplainTileCache *tile_cache,
   ChamplainMemoryCache *memory_cache = CHAMPLAIN_MEMORY_CACHE (tile_cache);
   ChamplainMemoryCachePrivate *priv = memory_cache->priv;
   GList *link;
-  gchar *key;
+  guint64 key;
 
   key = generate_queue_key (memory_cache, tile);
-  link = g_hash_table_lookup (priv->hash_table, key);
+  link = champlain_tile_table_lookup (priv->hash_table, key);
   if (link)
     {
+      QueueMember *member = link->data;
+
       move_queue_member_to_head (priv->queue, link);
-      g_free (key);
+
+      /* the tile is no longer missing */
+      if (!member->data)
+        member->data = g_bytes_new (contents, size);
     }
-  else
+  else if (key != CHAMPLAIN_TILE_KEY_INVALID)
+    insert_queue_member (memory_cache, key, g_bytes_new (contents, size), 0);
+
+  store_content (memory_cache, tile);
+
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_store_tile (CHAMPLAIN_TILE_CACHE (next_source), tile, contents, size);
+}
+
+
+static void
+store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_MEMORY_CACHE (tile_cache));
+
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+  ChamplainMemoryCache *memory_cache = CHAMPLAIN_MEMORY_CACHE (tile_cache);
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+  const GTimeVal *expiration_time = champlain_tile_get_expiration_time (tile);
+  gint64 missing_until;
+  GList *link;
+  guint64 key;
+
+  missing_until = expiration_time ? expiration_time->tv_sec : 0;
+
+  key = generate_queue_key (memory_cache, tile);
+  link = champlain_tile_table_lookup (priv->hash_table, key);
+  if (link)
     {
-      QueueMember *member;
+      QueueMember *member = link->data;
+
+      move_queue_member_to_head (priv->queue, link);
 
-      if (priv->queue->length >= priv->size_limit)
+      if (member->data)
         {
-          member = g_queue_pop_tail (priv->queue);
-          g_hash_table_remove (priv->hash_table, member->key);
-          delete_queue_member (member, NULL);
+          g_bytes_unref (member->data);
+          member->data = NULL;
         }
+      member->missing_until = missing_until;
+    }
+  else if (key != CHAMPLAIN_TILE_KEY_INVALID)
+    insert_queue_member (memory_cache, key, NULL, missing_until);
 
-      member = g_slice_new (QueueMember);
-      member->key = key;
-      member->data = g_memdup (contents, size);
-      member->size = size;
+  /* don't display the previous content of the tile any more */
+  link = champlain_tile_table_lookup (priv->content_hash_table, key);
+  if (link)
+    {
+      ContentMember *member = link->data;
 
-      g_queue_push_head (priv->queue, member);
-      g_hash_table_insert (priv->hash_table, g_strdup (key), g_queue_peek_head_link (priv->queue));
+      priv->content_size -= member->size;
+      g_queue_delete_link (priv->content_queue, link);
+      champlain_tile_table_remove (priv->content_hash_table, key);
+      delete_content_member (member, NULL);
     }
 
   if (CHAMPLAIN_IS_TILE_CACHE (next_source))
-    champlain_tile_cache_store_tile (CHAMPLAIN_TILE_CACHE (next_source), tile, contents, size);
+    champlain_tile_cache_store_missing_tile (CHAMPLAIN_TILE_CACHE (next_source), tile);
 }
 
 
@@ -437,6 +820,46 @@ refresh_tile_time (ChamplainTileCache *tile_cache,
 }
 
 
+/**
+ * champlain_memory_cache_get_content:
+ * @memory_cache: a #ChamplainMemoryCache
+ * @zoom_level: the zoom level of the tile
+ * @x: the x coordinate of the tile
+ * @y: the y coordinate of the tile
+ *
+ * Gets the decoded content of a tile if it is kept by the cache (see
+ * #ChamplainMemoryCache:content-size-limit). Nothing is loaded when it
+ * isn't, which makes it suitable for showing placeholders of other zoom
+ * levels while tiles load.
+ *
+ * Returns: (transfer none): the content of the tile or %NULL
+ *
+ * Since: 0.12.6
+ */
+ClutterContent *
+champlain_memory_cache_get_content (ChamplainMemoryCache *memory_cache,
+    guint zoom_level,
+    guint x,
+    guint y)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_MEMORY_CACHE (memory_cache), NULL);
+
+  ChamplainMemoryCachePrivate *priv = memory_cache->priv;
+  GList *link;
+
+  if (priv->content_size_limit == 0 ||
+      get_source_id (memory_cache) == CHAMPLAIN_TILE_KEY_NO_SOURCE)
+    return NULL;
+
+  link = champlain_tile_table_lookup (priv->content_hash_table,
+        champlain_tile_key_new (get_source_id (memory_cache), zoom_level, x, y));
+  if (!link)
+    return NULL;
+
+  return ((ContentMember *) link->data)->content;
+}
+
+
 /**
  * champlain_memory_cache_clean:
  * @memory_cache: a #ChamplainMemoryCache
@@ -452,8 +875,12 @@ champlain_memory_cache_clean (ChamplainMemoryCache *memory_cache)
 
   g_queue_foreach (priv->queue, (GFunc) delete_queue_member, NULL);
   g_queue_clear (priv->queue);
-  g_hash_table_destroy (memory_cache->priv->hash_table);
-  priv->hash_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  champlain_tile_table_remove_all (priv->hash_table);
+
+  g_queue_foreach (priv->content_queue, (GFunc) delete_content_member, NULL);
+  g_queue_clear (priv->content_queue);
+  champlain_tile_table_remove_all (priv->content_hash_table);
+  priv->content_size = 0;
 }
 
 
@@ -469,11 +896,9 @@ on_tile_filled (ChamplainTileCache *tile_cache,
   ChamplainMemoryCache *memory_cache = CHAMPLAIN_MEMORY_CACHE (tile_cache);
   ChamplainMemoryCachePrivate *priv = memory_cache->priv;
   GList *link;
-  gchar *key;
 
-  key = generate_queue_key (memory_cache, tile);
-  link = g_hash_table_lookup (priv->hash_table, key);
-  g_free (key);
+  link = champlain_tile_table_lookup (priv->hash_table,
+        generate_queue_key (memory_cache, tile));
   if (link)
     move_queue_member_to_head (priv->queue, link);
 
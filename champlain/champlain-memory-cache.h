@@ -79,6 +79,15 @@ guint champlain_memory_cache_get_size_limit (ChamplainMemoryCache *memory_cache)
 void champlain_memory_cache_set_size_limit (ChamplainMemoryCache *memory_cache,
     guint size_limit);
 
+guint champlain_memory_cache_get_content_size_limit (ChamplainMemoryCache *memory_cache);
+void champlain_memory_cache_set_content_size_limit (ChamplainMemoryCache *memory_cache,
+    guint content_size_limit);
+
+ClutterContent *champlain_memory_cache_get_content (ChamplainMemoryCache *memory_cache,
+    guint zoom_level,
+    guint x,
+    guint y);
+
 void champlain_memory_cache_clean (ChamplainMemoryCache *memory_cache);
 
 G_END_DECLS
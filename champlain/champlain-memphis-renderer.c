@@ -42,6 +42,7 @@
 #include "champlain-enum-types.h"
 #include "champlain-private.h"
 #include "champlain-memphis-renderer.h"
+#include "champlain-texture-atlas.h"
 #include "champlain-bounding-box.h"
 
 #include <gdk/gdk.h>
@@ -342,19 +343,27 @@ tile_loaded_cb (gpointer worker_data)
   if (!gdk_pixbuf_save_to_buffer (pixbuf, &buffer, &buffer_size, "png", NULL, NULL))
     goto finish;
     
-  content = clutter_image_new ();
-  if (!clutter_image_set_data (CLUTTER_IMAGE (content),
-          gdk_pixbuf_get_pixels (pixbuf),
-          gdk_pixbuf_get_has_alpha (pixbuf)
-            ? COGL_PIXEL_FORMAT_RGBA_8888
-            : COGL_PIXEL_FORMAT_RGB_888,
-          gdk_pixbuf_get_width (pixbuf),
-          gdk_pixbuf_get_height (pixbuf),
-          gdk_pixbuf_get_rowstride (pixbuf),
-          NULL))
+  content = champlain_texture_atlas_create_content (gdk_pixbuf_get_pixels (pixbuf),
+        COGL_PIXEL_FORMAT_RGBA_8888,
+        gdk_pixbuf_get_width (pixbuf),
+        gdk_pixbuf_get_height (pixbuf),
+        gdk_pixbuf_get_rowstride (pixbuf));
+  if (!content)
     {
-      g_object_unref (content);
-      goto finish;
+      content = clutter_image_new ();
+      if (!clutter_image_set_data (CLUTTER_IMAGE (content),
+              gdk_pixbuf_get_pixels (pixbuf),
+              gdk_pixbuf_get_has_alpha (pixbuf)
+                ? COGL_PIXEL_FORMAT_RGBA_8888
+                : COGL_PIXEL_FORMAT_RGB_888,
+              gdk_pixbuf_get_width (pixbuf),
+              gdk_pixbuf_get_height (pixbuf),
+              gdk_pixbuf_get_rowstride (pixbuf),
+              NULL))
+        {
+          g_object_unref (content);
+          goto finish;
+        }
     }
 
   actor = clutter_actor_new ();
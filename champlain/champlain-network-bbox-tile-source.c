@@ -35,6 +35,7 @@
 #include "champlain-debug.h"
 #include "champlain-bounding-box.h"
 #include "champlain-enum-types.h"
+#include "champlain-session-pool.h"
 #include "champlain-version.h"
 #include "champlain-tile.h"
 
@@ -122,8 +123,10 @@ champlain_network_bbox_tile_source_set_property (GObject *object,
 
       priv->proxy_uri = g_value_dup_string (value);
       if (priv->soup_session)
-        g_object_set (G_OBJECT (priv->soup_session), "proxy-uri",
-            soup_uri_new (priv->proxy_uri), NULL);
+        {
+          champlain_session_pool_release (priv->soup_session);
+          priv->soup_session = champlain_session_pool_acquire (priv->proxy_uri, 2, 10);
+        }
       break;
 
     case PROP_STATE:
@@ -144,9 +147,11 @@ champlain_network_bbox_tile_source_dispose (GObject *object)
     CHAMPLAIN_NETWORK_BBOX_TILE_SOURCE (object);
   ChamplainNetworkBboxTileSourcePrivate *priv = self->priv;
 
+  /* messages in flight hold a reference to the source so there are none
+   * left here */
   if (priv->soup_session != NULL)
     {
-      soup_session_abort (priv->soup_session);
+      champlain_session_pool_release (priv->soup_session);
       priv->soup_session = NULL;
     }
 
@@ -242,18 +247,7 @@ champlain_network_bbox_tile_source_init (ChamplainNetworkBboxTileSource *self)
   priv->api_uri = g_strdup ("http://www.informationfreeway.org/api/0.6");
   /* informationfreeway.org is a load-balancer for different api servers */
   priv->proxy_uri = g_strdup ("");
-  priv->soup_session = soup_session_async_new_with_options (
-        "proxy-uri", soup_uri_new (priv->proxy_uri),
-#ifdef HAVE_LIBSOUP_GNOME
-        SOUP_SESSION_ADD_FEATURE_BY_TYPE, 
-        SOUP_TYPE_PROXY_RESOLVER_GNOME,
-#endif
-        NULL);
-  g_object_set (G_OBJECT (priv->soup_session),
-      "user-agent", 
-      "libchamplain/" CHAMPLAIN_VERSION_S,
-      "max-conns-per-host", 2, 
-      NULL);
+  priv->soup_session = champlain_session_pool_acquire (priv->proxy_uri, 2, 10);
 
   priv->state = CHAMPLAIN_STATE_NONE;
 }
@@ -317,6 +311,7 @@ load_map_data_cb (G_GNUC_UNUSED SoupSession *session, SoupMessage *msg,
       DEBUG ("Unable to download file: %s",
           soup_status_get_phrase (msg->status_code));
 
+      g_object_unref (self);
       return;
     }
 
@@ -324,6 +319,8 @@ load_map_data_cb (G_GNUC_UNUSED SoupSession *session, SoupMessage *msg,
 
   renderer = champlain_map_source_get_renderer (CHAMPLAIN_MAP_SOURCE (self));
   champlain_renderer_set_data (renderer, msg->response_body->data, msg->response_body->length);
+
+  g_object_unref (self);
 }
 
 
@@ -367,7 +364,10 @@ champlain_network_bbox_tile_source_load_map_data (
 
   g_object_set (G_OBJECT (self), "state", CHAMPLAIN_STATE_LOADING, NULL);
 
-  soup_session_queue_message (priv->soup_session, msg, load_map_data_cb, self);
+  /* the session is shared so it can't be aborted in dispose, keep the
+   * source alive until the reply arrives */
+  soup_session_queue_message (priv->soup_session, msg, load_map_data_cb,
+      g_object_ref (self));
 }
 
 
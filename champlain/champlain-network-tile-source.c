@@ -29,6 +29,10 @@
  * Some preconfigured network map sources are built-in this library,
  * see #ChamplainMapSourceFactory.
  *
+ * Downloads failing because of network or server errors are repeated a few
+ * times with increasing delays. When a server keeps failing, or when there
+ * is no network connection, tiles are passed to the next source immediately
+ * without waiting for the server until it is tried again later.
  */
 
 #include "config.h"
@@ -44,6 +48,8 @@
 #include "champlain-map-source.h"
 #include "champlain-marshal.h"
 #include "champlain-private.h"
+#include "champlain-session-pool.h"
+#include "champlain-tile-table.h"
 
 #include <errno.h>
 #include <gdk/gdk.h>
@@ -58,54 +64,122 @@
 #endif
 #include <math.h>
 #include <sys/stat.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 enum
 {
   PROP_0,
   PROP_URI_FORMAT,
   PROP_OFFLINE,
-  PROP_PROXY_URI
+  PROP_PROXY_URI,
+  PROP_MIRRORS,
+  PROP_MAX_CONNS_PER_HOST,
+  PROP_MAX_CONNS
 };
 
 G_DEFINE_TYPE (ChamplainNetworkTileSource, champlain_network_tile_source, CHAMPLAIN_TYPE_TILE_SOURCE);
 
+/* time in seconds tiles the server doesn't have aren't requested again
+ * unless the server specifies it */
+#define MISSING_TILE_LIFETIME (24 * 60 * 60)
+/* number of times failed downloads are repeated */
+#define MAX_RETRIES 2
+/* delay in ms before the first repetition, doubled for the next ones */
+#define RETRY_DELAY 500
+
 #define GET_PRIVATE(obj) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((obj), CHAMPLAIN_TYPE_NETWORK_TILE_SOURCE, ChamplainNetworkTileSourcePrivate))
 
+typedef enum
+{
+  URI_TOKEN_TEXT,
+  URI_TOKEN_X,
+  URI_TOKEN_Y,
+  URI_TOKEN_TMSY,
+  URI_TOKEN_Z,
+  URI_TOKEN_MIRROR
+} UriTokenType;
+
+typedef struct
+{
+  UriTokenType type;
+  gchar *text;
+} UriToken;
+
 struct _ChamplainNetworkTileSourcePrivate
 {
   gboolean offline;
   gchar *uri_format;
   gchar *proxy_uri;
+  guint max_conns_per_host;
+  guint max_conns;
+  /* shared with other sources using the same proxy and limits */
   SoupSession *soup_session;
+
+  /* uri_format split into tokens by champlain_network_tile_source_set_uri_format() */
+  GArray *uri_tokens;
+  gchar **mirrors;
+  guint n_mirrors;
+  /* the format contains #S# but no mirrors are set, warned once */
+  gboolean mirrors_warned;
 };
 
+/* A download shared by all tiles with the same source id and coordinates
+ * requested while it is in flight */
 typedef struct
 {
-  ChamplainMapSource *map_source;
+  guint64 key;
+  SoupSession *session;
   SoupMessage *msg;
-} TileCancelledData;
+  /* the If-None-Match or If-Modified-Since value of conditional requests */
+  const gchar *validator_header;
+  gchar *validator;
+  /* TileWaiter, the first one renders the downloaded data */
+  GPtrArray *waiters;
+  guint attempts;
+  /* msg is queued when the timeout fires */
+  guint retry_timeout;
+} TileFetch;
 
 typedef struct
 {
+  TileFetch *fetch;
   ChamplainMapSource *map_source;
   ChamplainTile *tile;
-  TileCancelledData *cancelled_data;
-} TileLoadedData;
+  gulong state_handler;
+} TileWaiter;
 
 typedef struct
 {
   ChamplainMapSource *map_source;
   gchar *etag;
+  GTimeVal expiration_time;
+  gboolean has_expiration_time;
+  /* waiters sharing the rendered content */
+  GPtrArray *waiters;
 } TileRenderedData;
 
+/* downloads in flight of all network tile sources, used from the main
+ * thread only */
+static ChamplainTileTable *fetches = NULL;
+
 
 static void fill_tile (ChamplainMapSource *map_source,
     ChamplainTile *tile);
 static void tile_state_notify (ChamplainTile *tile,
     G_GNUC_UNUSED GParamSpec *pspec,
-    TileCancelledData *data);
+    TileWaiter *waiter);
+static void tile_loaded_cb (SoupSession *session,
+    SoupMessage *msg,
+    gpointer user_data);
+static void render_tile (ChamplainMapSource *map_source,
+    ChamplainTile *tile,
+    GBytes *bytes,
+    const gchar *etag,
+    const GTimeVal *expiration_time,
+    GPtrArray *waiters);
 
 static gchar *get_tile_uri (ChamplainNetworkTileSource *source,
     gint x,
@@ -134,6 +208,18 @@ champlain_network_tile_source_get_property (GObject *object,
       g_value_set_string (value, priv->proxy_uri);
       break;
 
+    case PROP_MIRRORS:
+      g_value_set_boxed (value, priv->mirrors);
+      break;
+
+    case PROP_MAX_CONNS_PER_HOST:
+      g_value_set_uint (value, priv->max_conns_per_host);
+      break;
+
+    case PROP_MAX_CONNS:
+      g_value_set_uint (value, priv->max_conns);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -147,6 +233,7 @@ champlain_network_tile_source_set_property (GObject *object,
     GParamSpec *pspec)
 {
   ChamplainNetworkTileSource *tile_source = CHAMPLAIN_NETWORK_TILE_SOURCE (object);
+  ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
 
   switch (prop_id)
     {
@@ -162,6 +249,20 @@ champlain_network_tile_source_set_property (GObject *object,
       champlain_network_tile_source_set_proxy_uri (tile_source, g_value_get_string (value));
       break;
 
+    case PROP_MIRRORS:
+      champlain_network_tile_source_set_mirrors (tile_source, g_value_get_boxed (value));
+      break;
+
+    case PROP_MAX_CONNS_PER_HOST:
+      champlain_network_tile_source_set_max_conns (tile_source,
+          g_value_get_uint (value), priv->max_conns);
+      break;
+
+    case PROP_MAX_CONNS:
+      champlain_network_tile_source_set_max_conns (tile_source,
+          priv->max_conns_per_host, g_value_get_uint (value));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -173,10 +274,11 @@ champlain_network_tile_source_dispose (GObject *object)
 {
   ChamplainNetworkTileSourcePrivate *priv = CHAMPLAIN_NETWORK_TILE_SOURCE (object)->priv;
 
+  /* messages in flight hold a reference to the source so there are none
+   * left here */
   if (priv->soup_session)
     {
-      soup_session_abort (priv->soup_session);
-      g_object_unref (priv->soup_session);
+      champlain_session_pool_release (priv->soup_session);
       priv->soup_session = NULL;
     }
 
@@ -184,6 +286,17 @@ champlain_network_tile_source_dispose (GObject *object)
 }
 
 
+static void
+clear_uri_tokens (GArray *uri_tokens)
+{
+  guint i;
+
+  for (i = 0; i < uri_tokens->len; i++)
+    g_free (g_array_index (uri_tokens, UriToken, i).text);
+  g_array_set_size (uri_tokens, 0);
+}
+
+
 static void
 champlain_network_tile_source_finalize (GObject *object)
 {
@@ -191,6 +304,9 @@ champlain_network_tile_source_finalize (GObject *object)
 
   g_free (priv->uri_format);
   g_free (priv->proxy_uri);
+  clear_uri_tokens (priv->uri_tokens);
+  g_array_unref (priv->uri_tokens);
+  g_strfreev (priv->mirrors);
 
   G_OBJECT_CLASS (champlain_network_tile_source_parent_class)->finalize (object);
 }
@@ -261,6 +377,51 @@ champlain_network_tile_source_class_init (ChamplainNetworkTileSourceClass *klass
         "",
         G_PARAM_READWRITE);
   g_object_class_install_property (object_class, PROP_PROXY_URI, pspec);
+
+  /**
+   * ChamplainNetworkTileSource:mirrors:
+   *
+   * The host names substituted for the \#S\# marker of the uri format,
+   * see #champlain_network_tile_source_set_mirrors
+   *
+   * Since: 0.12.6
+   */
+  pspec = g_param_spec_boxed ("mirrors",
+        "Mirrors",
+        "The mirror host names",
+        G_TYPE_STRV,
+        G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_MIRRORS, pspec);
+
+  /**
+   * ChamplainNetworkTileSource:max-conns-per-host:
+   *
+   * The maximum number of simultaneous connections to a single tile server,
+   * see #champlain_network_tile_source_set_max_conns
+   *
+   * Since: 0.12.6
+   */
+  pspec = g_param_spec_uint ("max-conns-per-host",
+        "Max connections per host",
+        "The maximum number of connections to a single host",
+        1, G_MAXUINT, 2,
+        G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_MAX_CONNS_PER_HOST, pspec);
+
+  /**
+   * ChamplainNetworkTileSource:max-conns:
+   *
+   * The maximum number of simultaneous connections of all sources sharing
+   * the connection pool, see #champlain_network_tile_source_set_max_conns
+   *
+   * Since: 0.12.6
+   */
+  pspec = g_param_spec_uint ("max-conns",
+        "Max connections",
+        "The maximum number of connections of the connection pool",
+        1, G_MAXUINT, 10,
+        G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_MAX_CONNS, pspec);
 }
 
 
@@ -274,19 +435,32 @@ champlain_network_tile_source_init (ChamplainNetworkTileSource *tile_source)
   priv->proxy_uri = NULL;
   priv->uri_format = NULL;
   priv->offline = FALSE;
+  priv->uri_tokens = g_array_new (FALSE, FALSE, sizeof (UriToken));
+  priv->mirrors = NULL;
+  priv->n_mirrors = 0;
+  priv->mirrors_warned = FALSE;
+  priv->max_conns_per_host = 2;    /* This is as required by OSM */
+  priv->max_conns = 10;
+
+  priv->soup_session = champlain_session_pool_acquire (NULL,
+        priv->max_conns_per_host, priv->max_conns);
+}
 
-  priv->soup_session = soup_session_async_new_with_options (
-        "proxy-uri", NULL,
-#ifdef HAVE_LIBSOUP_GNOME
-        SOUP_SESSION_ADD_FEATURE_BY_TYPE, 
-        SOUP_TYPE_PROXY_RESOLVER_GNOME,
-#endif
-        NULL);
-  g_object_set (G_OBJECT (priv->soup_session),
-      "user-agent", 
-      "libchamplain/" CHAMPLAIN_VERSION_S,
-      "max-conns-per-host", 2,    /* This is as required by OSM */ 
-      NULL); 
+
+/* Switches to the shared session matching the current settings, requests
+ * queued in the old session are finished there */
+static void
+update_session (ChamplainNetworkTileSource *tile_source)
+{
+  ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
+  SoupSession *session;
+
+  session = champlain_session_pool_acquire (priv->proxy_uri,
+        priv->max_conns_per_host, priv->max_conns);
+
+  if (priv->soup_session)
+    champlain_session_pool_release (priv->soup_session);
+  priv->soup_session = session;
 }
 
 
@@ -368,7 +542,10 @@ champlain_network_tile_source_get_uri_format (ChamplainNetworkTileSource *tile_s
  * marked for parsing and insertion.  There can be an unlimited number of
  * marked items in a URI format.  They are delimited by "#" before and after
  * the variable name. There are 4 defined variable names: X, Y, Z, and TMSY for
- * Y in TMS coordinates.
+ * Y in TMS coordinates. In addition, S is replaced by one of the host names
+ * set by champlain_network_tile_source_set_mirrors(). A format containing S
+ * requires mirrors; without them no URIs are generated and tiles of the source
+ * are filled by the next source in the chain.
  *
  * For example, this is the OpenStreetMap URI format:
  * "http://tile.openstreetmap.org/\#Z\#/\#X\#/\#Y\#.png"
@@ -382,14 +559,94 @@ champlain_network_tile_source_set_uri_format (ChamplainNetworkTileSource *tile_s
   g_return_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source));
 
   ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
+  gchar **tokens;
+  gint i;
 
   g_free (priv->uri_format);
   priv->uri_format = g_strdup (uri_format);
 
+  /* split the format once so that URIs are only concatenated for each tile */
+  clear_uri_tokens (priv->uri_tokens);
+  tokens = g_strsplit (priv->uri_format ? priv->uri_format : "", "#", -1);
+  for (i = 0; tokens[i] != NULL; i++)
+    {
+      UriToken token = { URI_TOKEN_TEXT, NULL };
+
+      if (strcmp (tokens[i], "X") == 0)
+        token.type = URI_TOKEN_X;
+      else if (strcmp (tokens[i], "Y") == 0)
+        token.type = URI_TOKEN_Y;
+      else if (strcmp (tokens[i], "TMSY") == 0)
+        token.type = URI_TOKEN_TMSY;
+      else if (strcmp (tokens[i], "Z") == 0)
+        token.type = URI_TOKEN_Z;
+      else if (strcmp (tokens[i], "S") == 0)
+        token.type = URI_TOKEN_MIRROR;
+      else if (tokens[i][0] != '\0')
+        token.text = g_strdup (tokens[i]);
+      else
+        continue;
+
+      g_array_append_val (priv->uri_tokens, token);
+    }
+  g_strfreev (tokens);
+  priv->mirrors_warned = FALSE;
+
   g_object_notify (G_OBJECT (tile_source), "uri-format");
 }
 
 
+/**
+ * champlain_network_tile_source_get_mirrors:
+ * @tile_source: the #ChamplainNetworkTileSource
+ *
+ * Gets the host names substituted for the \#S\# marker of the URI format.
+ *
+ * Returns: (transfer none) (array zero-terminated=1): the mirror host names or %NULL
+ *
+ * Since: 0.12.6
+ */
+const gchar * const *
+champlain_network_tile_source_get_mirrors (ChamplainNetworkTileSource *tile_source)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source), NULL);
+
+  return (const gchar * const *) tile_source->priv->mirrors;
+}
+
+
+/**
+ * champlain_network_tile_source_set_mirrors:
+ * @tile_source: the #ChamplainNetworkTileSource
+ * @mirrors: (array zero-terminated=1) (allow-none): %NULL-terminated array of
+ * host names
+ *
+ * Sets the host names substituted for the \#S\# marker of the URI format,
+ * for instance "a", "b" and "c" for
+ * "http://\#S\#.tile.openstreetmap.org/\#Z\#/\#X\#/\#Y\#.png". The
+ * host is chosen by the tile coordinates so that the requests are spread
+ * evenly over the mirrors while every tile is always requested from the same
+ * host. The connection limit applies to each host separately.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_network_tile_source_set_mirrors (ChamplainNetworkTileSource *tile_source,
+    const gchar * const *mirrors)
+{
+  g_return_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source));
+
+  ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
+
+  g_strfreev (priv->mirrors);
+  priv->mirrors = g_strdupv ((gchar **) mirrors);
+  priv->n_mirrors = priv->mirrors ? g_strv_length (priv->mirrors) : 0;
+  priv->mirrors_warned = FALSE;
+
+  g_object_notify (G_OBJECT (tile_source), "mirrors");
+}
+
+
 /**
  * champlain_network_tile_source_get_proxy_uri:
  * @tile_source: the #ChamplainNetworkTileSource
@@ -425,23 +682,127 @@ champlain_network_tile_source_set_proxy_uri (ChamplainNetworkTileSource *tile_so
   g_return_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source));
 
   ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
-  SoupURI *uri = NULL;
 
   g_free (priv->proxy_uri);
   priv->proxy_uri = g_strdup (proxy_uri);
 
-  if (priv->proxy_uri)
-    uri = soup_uri_new (priv->proxy_uri);
+  update_session (tile_source);
 
-  if (priv->soup_session)
-    g_object_set (G_OBJECT (priv->soup_session),
-        "proxy-uri", uri,
-        NULL);
+  g_object_notify (G_OBJECT (tile_source), "proxy-uri");
+}
 
-  if (uri)
-    soup_uri_free (uri);
 
-  g_object_notify (G_OBJECT (tile_source), "proxy-uri");
+/**
+ * champlain_network_tile_source_get_max_conns_per_host:
+ * @tile_source: the #ChamplainNetworkTileSource
+ *
+ * Gets the maximum number of simultaneous connections to a single host.
+ *
+ * Returns: the maximum number of connections per host
+ *
+ * Since: 0.12.6
+ */
+guint
+champlain_network_tile_source_get_max_conns_per_host (ChamplainNetworkTileSource *tile_source)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source), 0);
+
+  return tile_source->priv->max_conns_per_host;
+}
+
+
+/**
+ * champlain_network_tile_source_get_max_conns:
+ * @tile_source: the #ChamplainNetworkTileSource
+ *
+ * Gets the maximum number of simultaneous connections of the connection pool
+ * used by the source.
+ *
+ * Returns: the maximum number of connections
+ *
+ * Since: 0.12.6
+ */
+guint
+champlain_network_tile_source_get_max_conns (ChamplainNetworkTileSource *tile_source)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source), 0);
+
+  return tile_source->priv->max_conns;
+}
+
+
+/**
+ * champlain_network_tile_source_set_max_conns:
+ * @tile_source: the #ChamplainNetworkTileSource
+ * @max_conns_per_host: the maximum number of connections to a single host
+ * @max_conns: the maximum number of connections of the connection pool
+ *
+ * Sets the connection limits of the source. All network tile sources with the
+ * same limits and proxy share one pool of persistent connections, in all
+ * views, and @max_conns caps the number of connections of the whole pool.
+ * The default of 2 connections per host is what the OpenStreetMap tile usage
+ * policy allows; raise it only for servers which permit it.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_network_tile_source_set_max_conns (ChamplainNetworkTileSource *tile_source,
+    guint max_conns_per_host,
+    guint max_conns)
+{
+  g_return_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source));
+  g_return_if_fail (max_conns_per_host > 0 && max_conns > 0);
+
+  ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
+
+  if (priv->max_conns_per_host == max_conns_per_host && priv->max_conns == max_conns)
+    return;
+
+  priv->max_conns_per_host = max_conns_per_host;
+  priv->max_conns = max_conns;
+
+  update_session (tile_source);
+
+  g_object_notify (G_OBJECT (tile_source), "max-conns-per-host");
+  g_object_notify (G_OBJECT (tile_source), "max-conns");
+}
+
+
+/**
+ * champlain_network_tile_source_warm_up:
+ * @tile_source: the #ChamplainNetworkTileSource
+ *
+ * Opens the connections to the tile servers (all the mirrors when the URI
+ * format contains \#S\#) ahead of the first tile requests so that they
+ * don't wait for the name lookup and the connection setup. #ChamplainView
+ * calls this when the source is set as its map source or overlay source.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_network_tile_source_warm_up (ChamplainNetworkTileSource *tile_source)
+{
+  g_return_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source));
+
+  ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
+  gchar *uri;
+  guint i, zoom_level = 0;
+
+  if (priv->offline || !priv->soup_session)
+    return;
+
+  /* tile (i, 0) is served by mirror i */
+  for (i = 0; i < MAX (priv->n_mirrors, 1); i++)
+    {
+      while ((1u << zoom_level) <= i)
+        zoom_level++;
+
+      uri = get_tile_uri (tile_source, i, 0, zoom_level);
+      if (!uri)
+        return;
+      champlain_session_pool_warm_up (priv->soup_session, uri);
+      g_free (uri);
+    }
 }
 
 
@@ -485,7 +846,6 @@ champlain_network_tile_source_set_offline (ChamplainNetworkTileSource *tile_sour
 }
 
 
-#define SIZE 8
 static gchar *
 get_tile_uri (ChamplainNetworkTileSource *tile_source,
     gint x,
@@ -493,48 +853,187 @@ get_tile_uri (ChamplainNetworkTileSource *tile_source,
     gint z)
 {
   ChamplainNetworkTileSourcePrivate *priv = tile_source->priv;
-
-  gchar **tokens;
-  gchar *token;
   GString *ret;
-  gint i = 0;
+  guint i;
+
+  if (priv->n_mirrors == 0)
+    {
+      for (i = 0; i < priv->uri_tokens->len; i++)
+        {
+          if (g_array_index (priv->uri_tokens, UriToken, i).type != URI_TOKEN_MIRROR)
+            continue;
+
+          if (!priv->mirrors_warned)
+            g_warning ("The URI format '%s' contains #S# but no mirrors are set", priv->uri_format);
+          priv->mirrors_warned = TRUE;
+          return NULL;
+        }
+    }
 
-  tokens = g_strsplit (priv->uri_format, "#", 20);
-  token = tokens[i];
-  ret = g_string_sized_new (strlen (priv->uri_format));
+  ret = g_string_sized_new (priv->uri_format ? strlen (priv->uri_format) + 16 : 16);
 
-  while (token != NULL)
+  for (i = 0; i < priv->uri_tokens->len; i++)
     {
-      gint number = G_MAXINT;
-      gchar value[SIZE];
-
-      if (strcmp (token, "X") == 0)
-        number = x;
-      if (strcmp (token, "Y") == 0)
-        number = y;
-      if (strcmp (token, "TMSY") == 0){
-        int ymax = 1 << z;
-        number = ymax - y - 1;
-      }
-      if (strcmp (token, "Z") == 0)
-        number = z;
-
-      if (number != G_MAXINT)
+      UriToken *token = &g_array_index (priv->uri_tokens, UriToken, i);
+
+      switch (token->type)
         {
-          g_snprintf (value, SIZE, "%d", number);
-          g_string_append (ret, value);
+        case URI_TOKEN_TEXT:
+          g_string_append (ret, token->text);
+          break;
+
+        case URI_TOKEN_X:
+          g_string_append_printf (ret, "%d", x);
+          break;
+
+        case URI_TOKEN_Y:
+          g_string_append_printf (ret, "%d", y);
+          break;
+
+        case URI_TOKEN_TMSY:
+          g_string_append_printf (ret, "%d", (1 << z) - y - 1);
+          break;
+
+        case URI_TOKEN_Z:
+          g_string_append_printf (ret, "%d", z);
+          break;
+
+        case URI_TOKEN_MIRROR:
+          g_string_append (ret, priv->mirrors[(guint) (x + y) % priv->n_mirrors]);
+          break;
         }
-      else
-        g_string_append (ret, token);
+    }
+
+  return g_string_free (ret, FALSE);
+}
 
-      token = tokens[++i];
+
+gchar *
+champlain_network_tile_source_get_tile_uri (ChamplainNetworkTileSource *tile_source,
+    guint zoom_level,
+    gint x,
+    gint y)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_NETWORK_TILE_SOURCE (tile_source), NULL);
+
+  return get_tile_uri (tile_source, x, y, zoom_level);
+}
+
+
+/* Computes the time the response becomes stale from the Cache-Control
+ * max-age directive or the Expires header. Returns FALSE when the server
+ * didn't specify it. */
+static gboolean
+get_expiration_time (SoupMessage *msg,
+    GTimeVal *expiration_time)
+{
+  const gchar *header;
+  gboolean found = FALSE;
+  glong lifetime = 0;
+
+  header = soup_message_headers_get_list (msg->response_headers, "Cache-Control");
+  if (header)
+    {
+      GHashTable *params = soup_header_parse_param_list (header);
+      const gchar *max_age;
+
+      if (g_hash_table_lookup_extended (params, "no-cache", NULL, NULL) ||
+          g_hash_table_lookup_extended (params, "no-store", NULL, NULL))
+        found = TRUE;
+      else if ((max_age = g_hash_table_lookup (params, "max-age")) != NULL)
+        {
+          const gchar *age = soup_message_headers_get_one (msg->response_headers, "Age");
+
+          lifetime = strtol (max_age, NULL, 10);
+          if (age)
+            lifetime -= strtol (age, NULL, 10);
+          found = TRUE;
+        }
+
+      soup_header_free_param_list (params);
     }
 
-  token = ret->str;
-  g_string_free (ret, FALSE);
-  g_strfreev (tokens);
+  header = soup_message_headers_get_one (msg->response_headers, "Expires");
+  if (!found && header)
+    {
+      SoupDate *expires = soup_date_new_from_string (header);
+
+      /* invalid dates like "0" mean already expired */
+      if (expires)
+        {
+          const gchar *date_header = soup_message_headers_get_one (msg->response_headers, "Date");
+          SoupDate *date = date_header ? soup_date_new_from_string (date_header) : NULL;
+
+          /* relative to the server's clock */
+          if (date)
+            {
+              lifetime = soup_date_to_time_t (expires) - soup_date_to_time_t (date);
+              soup_date_free (date);
+            }
+          else
+            lifetime = soup_date_to_time_t (expires) - time (NULL);
+
+          soup_date_free (expires);
+        }
+      found = TRUE;
+    }
+
+  if (found)
+    {
+      g_get_current_time (expiration_time);
+      expiration_time->tv_sec += MAX (lifetime, 0);
+      expiration_time->tv_usec = 0;
+    }
 
-  return token;
+  return found;
+}
+
+
+static void
+free_waiter (TileWaiter *waiter)
+{
+  if (waiter->state_handler)
+    g_signal_handler_disconnect (waiter->tile, waiter->state_handler);
+
+  g_object_unref (waiter->tile);
+  g_object_unref (waiter->map_source);
+  g_slice_free (TileWaiter, waiter);
+}
+
+
+static void
+finish_tile (ChamplainMapSource *map_source,
+    ChamplainTile *tile,
+    gpointer data,
+    guint size,
+    const gchar *etag,
+    const GTimeVal *expiration_time)
+{
+  ChamplainTileSource *tile_source = CHAMPLAIN_TILE_SOURCE (map_source);
+  ChamplainTileCache *tile_cache = champlain_tile_source_get_cache (tile_source);
+
+  if (etag != NULL)
+    champlain_tile_set_etag (tile, etag);
+
+  champlain_tile_set_expiration_time (tile, expiration_time);
+
+  if (tile_cache && data)
+    champlain_tile_cache_store_tile (tile_cache, tile, data, size);
+
+  champlain_tile_set_fade_in (tile, TRUE);
+  champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
+  champlain_tile_display_content (tile);
+}
+
+
+static void
+fill_tile_from_next_source (ChamplainMapSource *map_source,
+    ChamplainTile *tile)
+{
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+
+  if (next_source)
+    champlain_map_source_fill_tile (next_source, tile);
 }
 
 
@@ -546,141 +1045,306 @@ tile_rendered_cb (ChamplainTile *tile,
     TileRenderedData *user_data)
 {
   ChamplainMapSource *map_source = user_data->map_source;
-  ChamplainMapSource *next_source;
-  gchar *etag = user_data->etag;
+  const GTimeVal *expiration_time = user_data->has_expiration_time ? &user_data->expiration_time : NULL;
+  ClutterContent *content = NULL;
+  ClutterActor *actor;
+  guint i;
 
   g_signal_handlers_disconnect_by_func (tile, tile_rendered_cb, user_data);
-  g_slice_free (TileRenderedData, user_data);
-
-  next_source = champlain_map_source_get_next_source (map_source);
 
   if (!error)
     {
-      ChamplainTileSource *tile_source = CHAMPLAIN_TILE_SOURCE (map_source);
-      ChamplainTileCache *tile_cache = champlain_tile_source_get_cache (tile_source);
+      finish_tile (map_source, tile, data, size, user_data->etag, expiration_time);
+
+      actor = champlain_tile_get_content (tile);
+      if (actor)
+        content = clutter_actor_get_content (actor);
+    }
+  else
+    fill_tile_from_next_source (map_source, tile);
+
+  /* the other tiles waiting for the same download show the same content */
+  for (i = 0; user_data->waiters && i < user_data->waiters->len; i++)
+    {
+      TileWaiter *waiter = g_ptr_array_index (user_data->waiters, i);
+
+      if (error)
+        fill_tile_from_next_source (waiter->map_source, waiter->tile);
+      else if (content)
+        {
+          gfloat width, height;
 
-      if (etag != NULL)
-        champlain_tile_set_etag (tile, etag);
+          clutter_content_get_preferred_size (content, &width, &height);
+          actor = clutter_actor_new ();
+          clutter_actor_set_size (actor, width, height);
+          clutter_actor_set_content (actor, content);
+          champlain_tile_set_content (waiter->tile, actor);
 
-      if (tile_cache && data)
-        champlain_tile_cache_store_tile (tile_cache, tile, data, size);
+          finish_tile (waiter->map_source, waiter->tile, data, size,
+              user_data->etag, expiration_time);
+        }
+      else
+        {
+          /* the renderer doesn't produce shareable content */
+          GBytes *bytes = g_bytes_new (data, size);
 
-      champlain_tile_set_fade_in (tile, TRUE);
-      champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
-      champlain_tile_display_content (tile);
+          render_tile (waiter->map_source, waiter->tile, bytes,
+              user_data->etag, expiration_time, NULL);
+          g_bytes_unref (bytes);
+        }
     }
-  else if (next_source)
-    champlain_map_source_fill_tile (next_source, tile);
 
-  g_free (etag);
+  if (user_data->waiters)
+    g_ptr_array_unref (user_data->waiters);
+  g_free (user_data->etag);
+  g_slice_free (TileRenderedData, user_data);
   g_object_unref (map_source);
   g_object_unref (tile);
 }
 
 
+/* Renders bytes into tile, the tiles of waiters get the same content. Takes
+ * over the references of waiters. */
+static void
+render_tile (ChamplainMapSource *map_source,
+    ChamplainTile *tile,
+    GBytes *bytes,
+    const gchar *etag,
+    const GTimeVal *expiration_time,
+    GPtrArray *waiters)
+{
+  ChamplainRenderer *renderer = champlain_map_source_get_renderer (map_source);
+  TileRenderedData *data;
+
+  data = g_slice_new (TileRenderedData);
+  data->map_source = g_object_ref (map_source);
+  data->etag = g_strdup (etag);
+  data->has_expiration_time = expiration_time != NULL;
+  if (expiration_time)
+    data->expiration_time = *expiration_time;
+  data->waiters = waiters;
+
+  g_object_ref (tile);
+  g_signal_connect (tile, "render-complete", G_CALLBACK (tile_rendered_cb), data);
+  champlain_renderer_render_bytes (renderer, tile, bytes);
+}
+
+
+static void
+free_fetch (TileFetch *fetch)
+{
+  g_ptr_array_unref (fetch->waiters);
+  g_object_unref (fetch->session);
+  g_free (fetch->validator);
+  g_slice_free (TileFetch, fetch);
+}
+
+
+static SoupMessage *
+create_message (TileFetch *fetch,
+    SoupURI *uri)
+{
+  SoupMessage *msg = soup_message_new_from_uri (SOUP_METHOD_GET, uri);
+
+  if (fetch->validator)
+    {
+      DEBUG ("%s: %s", fetch->validator_header, fetch->validator);
+      soup_message_headers_append (msg->request_headers,
+          fetch->validator_header, fetch->validator);
+    }
+
+  return msg;
+}
+
+
+static gboolean
+retry_fetch_cb (TileFetch *fetch)
+{
+  fetch->retry_timeout = 0;
+  soup_session_queue_message (fetch->session, fetch->msg, tile_loaded_cb, fetch);
+
+  return FALSE;
+}
+
+
 static void
 tile_loaded_cb (G_GNUC_UNUSED SoupSession *session,
     SoupMessage *msg,
     gpointer user_data)
 {
-  TileLoadedData *callback_data = (TileLoadedData *) user_data;
-  ChamplainMapSource *map_source = callback_data->map_source;
-  ChamplainTileSource *tile_source = CHAMPLAIN_TILE_SOURCE (map_source);
-  ChamplainTileCache *tile_cache = champlain_tile_source_get_cache (tile_source);
-  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
-  ChamplainTile *tile = callback_data->tile;
+  TileFetch *fetch = user_data;
+  GPtrArray *waiters = fetch->waiters;
+  ChamplainMapSource *map_source;
+  ChamplainTile *tile;
+  TileWaiter *first;
   const gchar *etag;
-  TileRenderedData *data;
-  ChamplainRenderer *renderer;
+  GTimeVal expiration_time;
+  gboolean has_expiration_time;
+  SoupBuffer *buffer;
+  GBytes *bytes;
+  guint i;
+
+  if (champlain_session_pool_report_result (msg) && waiters->len > 0 &&
+      fetch->attempts < MAX_RETRIES && champlain_session_pool_is_host_available (msg))
+    {
+      /* jittered exponential backoff, the tiles keep waiting */
+      guint delay = (RETRY_DELAY << fetch->attempts) * g_random_double_range (0.5, 1.5);
+
+      DEBUG ("Download failed with %d, retrying in %u ms", msg->status_code, delay);
+
+      fetch->attempts++;
+      fetch->msg = create_message (fetch, soup_message_get_uri (msg));
+      fetch->retry_timeout = g_timeout_add (delay, (GSourceFunc) retry_fetch_cb, fetch);
+      return;
+    }
+
+  if (champlain_tile_table_lookup (fetches, fetch->key) == fetch)
+    champlain_tile_table_remove (fetches, fetch->key);
+
+  /* from now on the tiles are handled here */
+  for (i = 0; i < waiters->len; i++)
+    {
+      TileWaiter *waiter = g_ptr_array_index (waiters, i);
 
-  g_signal_handlers_disconnect_by_func (tile, tile_state_notify, callback_data->cancelled_data);
-  g_slice_free (TileLoadedData, callback_data);
+      g_signal_handler_disconnect (waiter->tile, waiter->state_handler);
+      waiter->state_handler = 0;
+    }
 
   DEBUG ("Got reply %d", msg->status_code);
 
-  if (msg->status_code == SOUP_STATUS_CANCELLED)
+  if (msg->status_code == SOUP_STATUS_CANCELLED || waiters->len == 0)
     {
-      DEBUG ("Download of tile %d, %d got cancelled",
-          champlain_tile_get_x (tile), champlain_tile_get_y (tile));
+      DEBUG ("Download of tile got cancelled");
       goto cleanup;
     }
 
   if (msg->status_code == SOUP_STATUS_NOT_MODIFIED)
     {
-      if (tile_cache)
-        champlain_tile_cache_refresh_tile_time (tile_cache, tile);
-      goto finish;
+      /* a 304 response may extend the lifetime of the cached tile */
+      has_expiration_time = get_expiration_time (msg, &expiration_time);
+
+      for (i = 0; i < waiters->len; i++)
+        {
+          TileWaiter *waiter = g_ptr_array_index (waiters, i);
+          ChamplainTileCache *tile_cache = champlain_tile_source_get_cache (CHAMPLAIN_TILE_SOURCE (waiter->map_source));
+
+          champlain_tile_set_expiration_time (waiter->tile,
+              has_expiration_time ? &expiration_time : NULL);
+
+          if (tile_cache)
+            champlain_tile_cache_refresh_tile_time (tile_cache, waiter->tile);
+
+          champlain_tile_set_fade_in (waiter->tile, TRUE);
+          champlain_tile_set_state (waiter->tile, CHAMPLAIN_STATE_DONE);
+          champlain_tile_display_content (waiter->tile);
+        }
+      goto cleanup;
+    }
+
+  /* sparse layers don't have all tiles, remember that they are missing */
+  if (msg->status_code == SOUP_STATUS_NOT_FOUND ||
+      msg->status_code == SOUP_STATUS_GONE ||
+      (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code) && msg->response_body->length == 0))
+    {
+      DEBUG ("Tile is missing: %s", soup_status_get_phrase (msg->status_code));
+
+      if (!get_expiration_time (msg, &expiration_time))
+        {
+          g_get_current_time (&expiration_time);
+          expiration_time.tv_sec += MISSING_TILE_LIFETIME;
+          expiration_time.tv_usec = 0;
+        }
+
+      for (i = 0; i < waiters->len; i++)
+        {
+          TileWaiter *waiter = g_ptr_array_index (waiters, i);
+          ChamplainTileCache *tile_cache = champlain_tile_source_get_cache (CHAMPLAIN_TILE_SOURCE (waiter->map_source));
+
+          champlain_tile_set_expiration_time (waiter->tile, &expiration_time);
+
+          if (tile_cache)
+            champlain_tile_cache_store_missing_tile (tile_cache, waiter->tile);
+
+          fill_tile_from_next_source (waiter->map_source, waiter->tile);
+        }
+      goto cleanup;
     }
 
   if (!SOUP_STATUS_IS_SUCCESSFUL (msg->status_code))
     {
-      DEBUG ("Unable to download tile %d, %d: %s",
-          champlain_tile_get_x (tile),
-          champlain_tile_get_y (tile),
+      DEBUG ("Unable to download tile: %s",
           soup_status_get_phrase (msg->status_code));
 
-      goto load_next;
+      for (i = 0; i < waiters->len; i++)
+        {
+          TileWaiter *waiter = g_ptr_array_index (waiters, i);
+
+          fill_tile_from_next_source (waiter->map_source, waiter->tile);
+        }
+      goto cleanup;
     }
 
   /* Verify if the server sent an etag and save it */
   etag = soup_message_headers_get_one (msg->response_headers, "ETag");
   DEBUG ("Received ETag %s", etag);
 
-  renderer = champlain_map_source_get_renderer (map_source);
-  g_return_if_fail (CHAMPLAIN_IS_RENDERER (renderer));
-
-  data = g_slice_new (TileRenderedData);
-  data->map_source = map_source;
-  data->etag = g_strdup (etag);
+  has_expiration_time = get_expiration_time (msg, &expiration_time);
 
-  g_signal_connect (tile, "render-complete", G_CALLBACK (tile_rendered_cb), data);
+  /* hand the response body over to the renderer without copying it, it is
+   * decoded once for all the waiting tiles */
+  buffer = soup_message_body_flatten (msg->response_body);
+  bytes = g_bytes_new_with_free_func (buffer->data, buffer->length,
+        (GDestroyNotify) soup_buffer_free, buffer);
 
-  champlain_renderer_set_data (renderer, msg->response_body->data, msg->response_body->length);
-  champlain_renderer_render (renderer, tile);
+  first = g_ptr_array_index (waiters, 0);
+  map_source = g_object_ref (first->map_source);
+  tile = g_object_ref (first->tile);
+  g_ptr_array_remove_index (waiters, 0);
 
-  return;
+  render_tile (map_source, tile, bytes, etag,
+      has_expiration_time ? &expiration_time : NULL,
+      g_ptr_array_ref (waiters));
 
-load_next:
-  if (next_source)
-    champlain_map_source_fill_tile (next_source, tile);
-
-  goto cleanup;
-
-finish:
-  champlain_tile_set_fade_in (tile, TRUE);
-  champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
-  champlain_tile_display_content (tile);
+  g_object_unref (map_source);
+  g_object_unref (tile);
+  g_bytes_unref (bytes);
 
 cleanup:
-  g_object_unref (tile);
-  g_object_unref (map_source);
+  free_fetch (fetch);
 }
 
 
 static void
-destroy_cancelled_data (TileCancelledData *data,
-    G_GNUC_UNUSED GClosure *closure)
+tile_state_notify (ChamplainTile *tile,
+    G_GNUC_UNUSED GParamSpec *pspec,
+    TileWaiter *waiter)
 {
-  if (data->map_source)
-    g_object_remove_weak_pointer (G_OBJECT (data->map_source), (gpointer *) &data->map_source);
-
-  if (data->msg)
-    g_object_remove_weak_pointer (G_OBJECT (data->msg), (gpointer *) &data->msg);
+  TileFetch *fetch = waiter->fetch;
 
-  g_slice_free (TileCancelledData, data);
-}
+  if (champlain_tile_get_state (tile) != CHAMPLAIN_STATE_DONE)
+    return;
 
+  /* the tile is no longer interested in the download */
+  g_ptr_array_remove (fetch->waiters, waiter);
 
-static void
-tile_state_notify (ChamplainTile *tile,
-    G_GNUC_UNUSED GParamSpec *pspec,
-    TileCancelledData *data)
-{
-  if (champlain_tile_get_state (tile) == CHAMPLAIN_STATE_DONE && data->map_source && data->msg)
+  if (fetch->waiters->len == 0)
     {
       DEBUG ("Canceling tile download");
-      ChamplainNetworkTileSourcePrivate *priv = CHAMPLAIN_NETWORK_TILE_SOURCE (data->map_source)->priv;
-      soup_session_cancel_message (priv->soup_session, data->msg, SOUP_STATUS_CANCELLED);
+      if (champlain_tile_table_lookup (fetches, fetch->key) == fetch)
+        champlain_tile_table_remove (fetches, fetch->key);
+
+      if (fetch->retry_timeout != 0)
+        {
+          g_source_remove (fetch->retry_timeout);
+
+          /* the repetition may have been the trial request of the host */
+          soup_message_set_status (fetch->msg, SOUP_STATUS_CANCELLED);
+          champlain_session_pool_report_result (fetch->msg);
+          g_object_unref (fetch->msg);
+          free_fetch (fetch);
+        }
+      else
+        soup_session_cancel_message (fetch->session, fetch->msg, SOUP_STATUS_CANCELLED);
     }
 }
 
@@ -710,6 +1374,42 @@ get_modified_time_string (ChamplainTile *tile)
 }
 
 
+/* Returns the If-None-Match or If-Modified-Since value used to validate the
+ * tile or NULL when the tile has to be downloaded */
+static gchar *
+get_validator (ChamplainTile *tile)
+{
+  if (champlain_tile_get_state (tile) != CHAMPLAIN_STATE_LOADED)
+    return NULL;
+
+  /* If an etag is available, only use it.
+   * OSM servers seems to send now as the modified time for all tiles
+   * Omarender servers set the modified time correctly
+   */
+  if (champlain_tile_get_etag (tile))
+    return g_strdup (champlain_tile_get_etag (tile));
+
+  return get_modified_time_string (tile);
+}
+
+
+static void
+add_waiter (TileFetch *fetch,
+    ChamplainMapSource *map_source,
+    ChamplainTile *tile)
+{
+  TileWaiter *waiter = g_slice_new (TileWaiter);
+
+  waiter->fetch = fetch;
+  waiter->map_source = g_object_ref (map_source);
+  waiter->tile = g_object_ref (tile);
+  waiter->state_handler = g_signal_connect (tile, "notify::state",
+        G_CALLBACK (tile_state_notify), waiter);
+
+  g_ptr_array_add (fetch->waiters, waiter);
+}
+
+
 static void
 fill_tile (ChamplainMapSource *map_source,
     ChamplainTile *tile)
@@ -725,65 +1425,79 @@ fill_tile (ChamplainMapSource *map_source,
 
   if (!priv->offline)
     {
-      TileLoadedData *callback_data;
+      TileFetch *fetch;
       SoupMessage *msg;
+      SoupURI *soup_uri;
+      gchar *validator;
       gchar *uri;
+      guint64 key;
+
+      if (!fetches)
+        fetches = champlain_tile_table_new (NULL);
+
+      key = champlain_tile_key_for_tile (
+            champlain_tile_key_intern_source (champlain_map_source_get_id (map_source)),
+            tile);
+      validator = get_validator (tile);
+
+      /* join a download of the same tile by another view or source with the
+       * same id unless it validates a different version of the tile */
+      fetch = champlain_tile_table_lookup (fetches, key);
+      if (fetch && (!fetch->validator || g_strcmp0 (fetch->validator, validator) == 0))
+        {
+          DEBUG ("Joining download of tile %d, %d",
+              champlain_tile_get_x (tile), champlain_tile_get_y (tile));
+          add_waiter (fetch, map_source, tile);
+          g_free (validator);
+          return;
+        }
 
       uri = get_tile_uri (tile_source,
             champlain_tile_get_x (tile),
             champlain_tile_get_y (tile),
             champlain_tile_get_zoom_level (tile));
-      msg = soup_message_new (SOUP_METHOD_GET, uri);
+      soup_uri = uri ? soup_uri_new (uri) : NULL;
       g_free (uri);
 
-      if (champlain_tile_get_state (tile) == CHAMPLAIN_STATE_LOADED)
+      if (!soup_uri)
         {
-          /* validate tile */
-
-          const gchar *etag = champlain_tile_get_etag (tile);
-          gchar *date = get_modified_time_string (tile);
-
-          /* If an etag is available, only use it.
-           * OSM servers seems to send now as the modified time for all tiles
-           * Omarender servers set the modified time correctly
-           */
-          if (etag)
-            {
-              DEBUG ("If-None-Match: %s", etag);
-              soup_message_headers_append (msg->request_headers,
-                  "If-None-Match", etag);
-            }
-          else if (date)
-            {
-              DEBUG ("If-Modified-Since %s", date);
-              soup_message_headers_append (msg->request_headers,
-                  "If-Modified-Since", date);
-            }
-
-          g_free (date);
+          g_free (validator);
+          fill_tile_from_next_source (map_source, tile);
+          return;
         }
 
-      TileCancelledData *tile_cancelled_data = g_slice_new (TileCancelledData);
-      tile_cancelled_data->map_source = map_source;
-      tile_cancelled_data->msg = msg;
-
-      g_object_add_weak_pointer (G_OBJECT (msg), (gpointer *) &tile_cancelled_data->msg);
-      g_object_add_weak_pointer (G_OBJECT (map_source), (gpointer *) &tile_cancelled_data->map_source);
-
-      g_signal_connect_data (tile, "notify::state", G_CALLBACK (tile_state_notify),
-          tile_cancelled_data, (GClosureNotify) destroy_cancelled_data, 0);
+      fetch = g_slice_new (TileFetch);
+      fetch->key = key;
+      fetch->session = g_object_ref (priv->soup_session);
+      /* validate tile */
+      fetch->validator_header = champlain_tile_get_etag (tile) ? "If-None-Match" : "If-Modified-Since";
+      fetch->validator = validator;
+      fetch->waiters = g_ptr_array_new_with_free_func ((GDestroyNotify) free_waiter);
+      fetch->attempts = 0;
+      fetch->retry_timeout = 0;
+      msg = fetch->msg = create_message (fetch, soup_uri);
+      soup_uri_free (soup_uri);
+
+      /* fail fast while the host doesn't respond or there is no network */
+      if (!champlain_session_pool_is_host_available (msg))
+        {
+          DEBUG ("Host unavailable, skipping download");
+          g_object_unref (msg);
+          free_fetch (fetch);
+          fill_tile_from_next_source (map_source, tile);
+          return;
+        }
 
-      callback_data = g_slice_new (TileLoadedData);
-      callback_data->tile = tile;
-      callback_data->map_source = map_source;
-      callback_data->cancelled_data = tile_cancelled_data;
+      add_waiter (fetch, map_source, tile);
 
-      g_object_ref (map_source);
-      g_object_ref (tile);
+      /* a fetch validating another version of the tile isn't shared, nor
+       * is one of a tile without a key */
+      if (key != CHAMPLAIN_TILE_KEY_INVALID && !champlain_tile_table_lookup (fetches, key))
+        champlain_tile_table_insert (fetches, key, fetch);
 
       soup_session_queue_message (priv->soup_session, msg,
           tile_loaded_cb,
-          callback_data);
+          fetch);
     }
   else
     {
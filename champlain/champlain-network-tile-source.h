@@ -96,6 +96,18 @@ const gchar *champlain_network_tile_source_get_proxy_uri (ChamplainNetworkTileSo
 void champlain_network_tile_source_set_proxy_uri (ChamplainNetworkTileSource *tile_source,
     const gchar *proxy_uri);
 
+const gchar * const *champlain_network_tile_source_get_mirrors (ChamplainNetworkTileSource *tile_source);
+void champlain_network_tile_source_set_mirrors (ChamplainNetworkTileSource *tile_source,
+    const gchar * const *mirrors);
+
+guint champlain_network_tile_source_get_max_conns_per_host (ChamplainNetworkTileSource *tile_source);
+guint champlain_network_tile_source_get_max_conns (ChamplainNetworkTileSource *tile_source);
+void champlain_network_tile_source_set_max_conns (ChamplainNetworkTileSource *tile_source,
+    guint max_conns_per_host,
+    guint max_conns);
+
+void champlain_network_tile_source_warm_up (ChamplainNetworkTileSource *tile_source);
+
 G_END_DECLS
 
 #endif /* _CHAMPLAIN_NETWORK_TILE_SOURCE_H_ */
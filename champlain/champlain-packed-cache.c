@@ -0,0 +1,1625 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * SECTION:champlain-packed-cache
+ * @short_description: Stores and loads cached tiles from a single database file
+ *
+ * #ChamplainPackedCache is a persistent cache like #ChamplainFileCache but
+ * instead of storing every tile in a separate file, it stores the tile data
+ * together with the Etag, modification time and popularity of the tile in a
+ * single SQLite database per map source. A cache hit costs a single indexed
+ * query and the cache of a map source can be copied or removed as one file.
+ *
+ * The database file is named after the map source id with the .mbtiles
+ * extension and follows the MBTiles layout so it can be read by other tools
+ * supporting this format.
+ *
+ * Like in #ChamplainFileCache, all database access happens in a separate I/O
+ * thread. Stores and popularity updates are queued and written in batches,
+ * one transaction per batch.
+ */
+
+#define DEBUG_FLAG CHAMPLAIN_DEBUG_CACHE
+#include "champlain-debug.h"
+
+#include "champlain-packed-cache.h"
+#include "champlain-private.h"
+
+#include <sqlite3.h>
+#include <errno.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+G_DEFINE_TYPE (ChamplainPackedCache, champlain_packed_cache, CHAMPLAIN_TYPE_TILE_CACHE);
+
+#define GET_PRIVATE(obj) \
+  (G_TYPE_INSTANCE_GET_PRIVATE ((obj), CHAMPLAIN_TYPE_PACKED_CACHE, ChamplainPackedCachePrivate))
+
+/* number of queued changes after which they are written immediately */
+#define WRITE_BATCH_SIZE 100
+/* maximal time in ms database changes stay queued */
+#define WRITE_INTERVAL 500
+/* maximal number of tiles deleted in one purge step */
+#define PURGE_SLICE_SIZE 500
+/* version of the database schema, stored as user_version */
+#define SCHEMA_VERSION 2
+
+enum
+{
+  PROP_0,
+  PROP_SIZE_LIMIT,
+  PROP_CACHE_DIR
+};
+
+struct _ChamplainPackedCachePrivate
+{
+  guint size_limit;
+  gchar *cache_dir;
+
+  /* write-behind queue, all the changes belong to the database of
+   * pending_source_id */
+  GPtrArray *pending_writes;
+  gchar *pending_source_id;
+  gchar *pending_source_name;
+  /* positions of the tiles with queued stores, owned by pending_writes */
+  GHashTable *pending_stores;
+  guint write_timeout;
+
+  guint purge_source_id;
+  gboolean purging;
+
+  /* all database access happens in the I/O thread, the connection,
+   * statements and the id of the map source whose database is open are
+   * used by this thread only */
+  GThreadPool *io_thread;
+  gchar *db_source_id;
+  gboolean db_has_format;
+  sqlite3 *db;
+  sqlite3_stmt *stmt_select;
+  sqlite3_stmt *stmt_select_missing;
+  sqlite3_stmt *stmt_store;
+  sqlite3_stmt *stmt_store_missing;
+  sqlite3_stmt *stmt_delete_missing;
+  sqlite3_stmt *stmt_delete_tile;
+  sqlite3_stmt *stmt_update_popularity;
+  sqlite3_stmt *stmt_update_modified;
+  sqlite3_stmt *stmt_size;
+  sqlite3_stmt *stmt_evict_expired;
+  sqlite3_stmt *stmt_evict;
+  sqlite3_stmt *stmt_delete;
+  sqlite3_stmt *stmt_evict_missing;
+};
+
+typedef enum
+{
+  JOB_LOAD,
+  JOB_WRITE,
+  JOB_PURGE
+} JobType;
+
+/* Every job starts with its type and the map source whose database it
+ * accesses */
+typedef struct
+{
+  JobType type;
+  gchar *source_id;
+  gchar *source_name;
+} Job;
+
+typedef struct
+{
+  Job job;
+  ChamplainPackedCache *packed_cache;
+  ChamplainTile *tile;
+  gint zoom_level;
+  gint x;
+  gint row;
+  /* results */
+  gboolean found;
+  gboolean missing;
+  GBytes *data;
+  gchar *etag;
+  gint64 modified;
+  gint64 expires;
+} LoadJob;
+
+typedef enum
+{
+  WRITE_STORE,
+  WRITE_STORE_MISSING,
+  WRITE_TOUCH,
+  WRITE_POPULARITY
+} WriteType;
+
+typedef struct
+{
+  WriteType type;
+  gint64 position;
+  gint zoom_level;
+  gint x;
+  gint row;
+  gchar *etag;
+  GBytes *data;
+  gint64 modified;
+  gint64 expires;
+} WriteOp;
+
+typedef struct
+{
+  Job job;
+  GPtrArray *ops;
+} WriteJob;
+
+typedef struct
+{
+  Job job;
+  ChamplainPackedCache *packed_cache;
+  guint size_limit;
+  gboolean finished;
+} PurgeJob;
+
+static void run_job (Job *job,
+    ChamplainPackedCache *packed_cache);
+static void free_write_op (WriteOp *op);
+static void flush_writes (ChamplainPackedCache *packed_cache);
+static void close_db (ChamplainPackedCache *packed_cache);
+
+static void fill_tile (ChamplainMapSource *map_source,
+    ChamplainTile *tile);
+
+static void store_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile,
+    const gchar *contents,
+    gsize size);
+static void refresh_tile_time (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
+static void on_tile_filled (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
+static void store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
+
+static void
+champlain_packed_cache_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainPackedCache *packed_cache = CHAMPLAIN_PACKED_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_SIZE_LIMIT:
+      g_value_set_uint (value, champlain_packed_cache_get_size_limit (packed_cache));
+      break;
+
+    case PROP_CACHE_DIR:
+      g_value_set_string (value, champlain_packed_cache_get_cache_dir (packed_cache));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+champlain_packed_cache_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainPackedCache *packed_cache = CHAMPLAIN_PACKED_CACHE (object);
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  switch (property_id)
+    {
+    case PROP_SIZE_LIMIT:
+      champlain_packed_cache_set_size_limit (packed_cache, g_value_get_uint (value));
+      break;
+
+    case PROP_CACHE_DIR:
+      g_free (priv->cache_dir);
+      priv->cache_dir = g_strdup (g_value_get_string (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+champlain_packed_cache_dispose (GObject *object)
+{
+  ChamplainPackedCache *packed_cache = CHAMPLAIN_PACKED_CACHE (object);
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  if (priv->purge_source_id)
+    {
+      g_source_remove (priv->purge_source_id);
+      priv->purge_source_id = 0;
+    }
+
+  /* write all pending changes and wait until they are written */
+  if (priv->io_thread)
+    {
+      flush_writes (packed_cache);
+      g_thread_pool_free (priv->io_thread, FALSE, TRUE);
+      priv->io_thread = NULL;
+    }
+
+  G_OBJECT_CLASS (champlain_packed_cache_parent_class)->dispose (object);
+}
+
+
+static void
+champlain_packed_cache_finalize (GObject *object)
+{
+  ChamplainPackedCache *packed_cache = CHAMPLAIN_PACKED_CACHE (object);
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  close_db (packed_cache);
+
+  g_ptr_array_unref (priv->pending_writes);
+  g_hash_table_unref (priv->pending_stores);
+  g_free (priv->pending_source_id);
+  g_free (priv->pending_source_name);
+  g_free (priv->cache_dir);
+
+  G_OBJECT_CLASS (champlain_packed_cache_parent_class)->finalize (object);
+}
+
+
+static void
+champlain_packed_cache_constructed (GObject *object)
+{
+  ChamplainPackedCache *packed_cache = CHAMPLAIN_PACKED_CACHE (object);
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  if (!priv->cache_dir)
+    {
+#ifdef CHAMPLAIN_HAS_MAEMO
+      priv->cache_dir = g_strdup ("/home/user/MyDocs/.Maps/");
+#else
+      priv->cache_dir = g_build_path (G_DIR_SEPARATOR_S,
+            g_get_user_cache_dir (),
+            "champlain", NULL);
+#endif
+    }
+
+  G_OBJECT_CLASS (champlain_packed_cache_parent_class)->constructed (object);
+}
+
+
+static void
+champlain_packed_cache_class_init (ChamplainPackedCacheClass *klass)
+{
+  ChamplainMapSourceClass *map_source_class = CHAMPLAIN_MAP_SOURCE_CLASS (klass);
+  ChamplainTileCacheClass *tile_cache_class = CHAMPLAIN_TILE_CACHE_CLASS (klass);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GParamSpec *pspec;
+
+  g_type_class_add_private (klass, sizeof (ChamplainPackedCachePrivate));
+
+  object_class->finalize = champlain_packed_cache_finalize;
+  object_class->dispose = champlain_packed_cache_dispose;
+  object_class->get_property = champlain_packed_cache_get_property;
+  object_class->set_property = champlain_packed_cache_set_property;
+  object_class->constructed = champlain_packed_cache_constructed;
+
+  /**
+   * ChamplainPackedCache:size-limit:
+   *
+   * The size limit in bytes of the tile data stored for a map source.
+   *
+   * Note: this new value will not be applied until you call champlain_packed_cache_purge()
+   *
+   * Since: 0.12.6
+   */
+  pspec = g_param_spec_uint ("size-limit",
+        "Size Limit",
+        "The cache's size limit (bytes)",
+        1,
+        G_MAXINT,
+        100000000,
+        G_PARAM_CONSTRUCT | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_SIZE_LIMIT, pspec);
+
+  /**
+   * ChamplainPackedCache:cache-dir:
+   *
+   * The directory where the tile databases are stored.
+   *
+   * Since: 0.12.6
+   */
+  pspec = g_param_spec_string ("cache-dir",
+        "Cache Directory",
+        "The directory of the cache",
+        NULL,
+        G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE);
+  g_object_class_install_property (object_class, PROP_CACHE_DIR, pspec);
+
+  tile_cache_class->store_tile = store_tile;
+  tile_cache_class->refresh_tile_time = refresh_tile_time;
+  tile_cache_class->on_tile_filled = on_tile_filled;
+  champlain_tile_cache_class_set_store_missing_tile (tile_cache_class, store_missing_tile);
+
+  map_source_class->fill_tile = fill_tile;
+}
+
+
+static void
+champlain_packed_cache_init (ChamplainPackedCache *packed_cache)
+{
+  ChamplainPackedCachePrivate *priv = GET_PRIVATE (packed_cache);
+
+  packed_cache->priv = priv;
+
+  priv->size_limit = 100000000;
+  priv->cache_dir = NULL;
+  priv->pending_writes = g_ptr_array_new_with_free_func ((GDestroyNotify) free_write_op);
+  priv->pending_source_id = NULL;
+  priv->pending_source_name = NULL;
+  priv->pending_stores = g_hash_table_new (g_int64_hash, g_int64_equal);
+  priv->write_timeout = 0;
+  priv->purge_source_id = 0;
+  priv->purging = FALSE;
+  /* a single thread so that the jobs are run in order */
+  priv->io_thread = g_thread_pool_new ((GFunc) run_job, packed_cache, 1, FALSE, NULL);
+  priv->db_source_id = NULL;
+  priv->db_has_format = FALSE;
+  priv->db = NULL;
+  priv->stmt_select = NULL;
+  priv->stmt_select_missing = NULL;
+  priv->stmt_store = NULL;
+  priv->stmt_store_missing = NULL;
+  priv->stmt_delete_missing = NULL;
+  priv->stmt_delete_tile = NULL;
+  priv->stmt_update_popularity = NULL;
+  priv->stmt_update_modified = NULL;
+  priv->stmt_size = NULL;
+  priv->stmt_evict_expired = NULL;
+  priv->stmt_evict = NULL;
+  priv->stmt_delete = NULL;
+  priv->stmt_evict_missing = NULL;
+}
+
+
+/**
+ * champlain_packed_cache_new_full:
+ * @size_limit: maximum size of the tile data of a map source in bytes
+ * @cache_dir: (allow-none): the directory where the cache is created. When cache_dir == NULL,
+ * a cache in ~/.cache/champlain is used.
+ * @renderer: the #ChamplainRenderer used for tiles rendering
+ *
+ * Constructor of #ChamplainPackedCache.
+ *
+ * Returns: a constructed #ChamplainPackedCache
+ *
+ * Since: 0.12.6
+ */
+ChamplainPackedCache *
+champlain_packed_cache_new_full (guint size_limit,
+    const gchar *cache_dir,
+    ChamplainRenderer *renderer)
+{
+  ChamplainPackedCache *cache;
+
+  cache = g_object_new (CHAMPLAIN_TYPE_PACKED_CACHE,
+        "size-limit", size_limit,
+        "cache-dir", cache_dir,
+        "renderer", renderer,
+        NULL);
+  return cache;
+}
+
+
+/**
+ * champlain_packed_cache_get_size_limit:
+ * @packed_cache: a #ChamplainPackedCache
+ *
+ * Gets the cache size limit in bytes.
+ *
+ * Returns: size limit
+ *
+ * Since: 0.12.6
+ */
+guint
+champlain_packed_cache_get_size_limit (ChamplainPackedCache *packed_cache)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_PACKED_CACHE (packed_cache), 0);
+
+  return packed_cache->priv->size_limit;
+}
+
+
+/**
+ * champlain_packed_cache_get_cache_dir:
+ * @packed_cache: a #ChamplainPackedCache
+ *
+ * Gets the directory where the tile databases are stored.
+ *
+ * Returns: the directory
+ *
+ * Since: 0.12.6
+ */
+const gchar *
+champlain_packed_cache_get_cache_dir (ChamplainPackedCache *packed_cache)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_PACKED_CACHE (packed_cache), NULL);
+
+  return packed_cache->priv->cache_dir;
+}
+
+
+/**
+ * champlain_packed_cache_set_size_limit:
+ * @packed_cache: a #ChamplainPackedCache
+ * @size_limit: the cache limit in bytes
+ *
+ * Sets the cache size limit in bytes.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_packed_cache_set_size_limit (ChamplainPackedCache *packed_cache,
+    guint size_limit)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (packed_cache));
+
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  priv->size_limit = size_limit;
+  g_object_notify (G_OBJECT (packed_cache), "size-limit");
+}
+
+
+static void
+close_db (ChamplainPackedCache *packed_cache)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  gint error;
+
+  sqlite3_finalize (priv->stmt_select);
+  priv->stmt_select = NULL;
+  sqlite3_finalize (priv->stmt_select_missing);
+  priv->stmt_select_missing = NULL;
+  sqlite3_finalize (priv->stmt_store);
+  priv->stmt_store = NULL;
+  sqlite3_finalize (priv->stmt_store_missing);
+  priv->stmt_store_missing = NULL;
+  sqlite3_finalize (priv->stmt_delete_missing);
+  priv->stmt_delete_missing = NULL;
+  sqlite3_finalize (priv->stmt_delete_tile);
+  priv->stmt_delete_tile = NULL;
+  sqlite3_finalize (priv->stmt_update_popularity);
+  priv->stmt_update_popularity = NULL;
+  sqlite3_finalize (priv->stmt_update_modified);
+  priv->stmt_update_modified = NULL;
+  sqlite3_finalize (priv->stmt_size);
+  priv->stmt_size = NULL;
+  sqlite3_finalize (priv->stmt_evict_expired);
+  priv->stmt_evict_expired = NULL;
+  sqlite3_finalize (priv->stmt_evict);
+  priv->stmt_evict = NULL;
+  sqlite3_finalize (priv->stmt_delete);
+  priv->stmt_delete = NULL;
+  sqlite3_finalize (priv->stmt_evict_missing);
+  priv->stmt_evict_missing = NULL;
+
+  if (priv->db)
+    {
+      error = sqlite3_close (priv->db);
+      if (error != SQLITE_OK)
+        DEBUG ("Sqlite returned error %d when closing %s.mbtiles", error, priv->db_source_id);
+      priv->db = NULL;
+    }
+
+  g_free (priv->db_source_id);
+  priv->db_source_id = NULL;
+}
+
+
+static gboolean
+prepare_statement (ChamplainPackedCache *packed_cache,
+    const gchar *query,
+    sqlite3_stmt **stmt)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  gint error;
+
+  error = sqlite3_prepare_v2 (priv->db, query, -1, stmt, NULL);
+  if (error != SQLITE_OK)
+    {
+      *stmt = NULL;
+      DEBUG ("Failed to prepare '%s', error: %s", query, sqlite3_errmsg (priv->db));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/* Brings databases created by older versions up to date. Like in
+ * #ChamplainFileCache, the size of the cache is kept up to date by triggers
+ * and tiles are evicted in the order of their score (see
+ * champlain_file_cache_get_current_score()) so that a purge doesn't have to
+ * go through the whole table. */
+static gboolean
+upgrade_schema (ChamplainPackedCache *packed_cache)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  sqlite3_stmt *stmt;
+  gchar *error_msg = NULL;
+  gint version = 0;
+
+  if (sqlite3_prepare_v2 (priv->db, "PRAGMA user_version", -1, &stmt, NULL) == SQLITE_OK)
+    {
+      if (sqlite3_step (stmt) == SQLITE_ROW)
+        version = sqlite3_column_int (stmt, 0);
+      sqlite3_finalize (stmt);
+    }
+
+  if (version >= SCHEMA_VERSION)
+    return TRUE;
+
+  DEBUG ("Upgrading %s.mbtiles from version %d", priv->db_source_id, version);
+
+  sqlite3_exec (priv->db, "BEGIN", NULL, NULL, NULL);
+
+  /* version 1: running total of the cache size and the eviction indices */
+  if (version < 1)
+    {
+      /* fail when the table has just been created with the columns */
+      sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN expires INTEGER DEFAULT 0", NULL, NULL, NULL);
+      sqlite3_exec (priv->db, "ALTER TABLE tiles ADD COLUMN score REAL DEFAULT 0", NULL, NULL, NULL);
+
+      /* existing tiles are treated as used now */
+      if (sqlite3_prepare_v2 (priv->db, "UPDATE tiles SET score = ?", -1, &stmt, NULL) == SQLITE_OK)
+        {
+          sqlite3_bind_double (stmt, 1, champlain_file_cache_get_current_score ());
+          sqlite3_step (stmt);
+          sqlite3_finalize (stmt);
+        }
+
+      /* REPLACE doesn't fire delete triggers, the insert trigger subtracts the
+       * size of the replaced row itself */
+      sqlite3_exec (priv->db,
+          "CREATE TABLE IF NOT EXISTS cache_size (size INT);"
+          "DELETE FROM cache_size;"
+          "INSERT INTO cache_size SELECT IFNULL (SUM (length (tile_data)), 0) FROM tiles;"
+          "CREATE INDEX IF NOT EXISTS tiles_score ON tiles (score);"
+          "CREATE INDEX IF NOT EXISTS tiles_expires ON tiles (expires);"
+          "CREATE TRIGGER IF NOT EXISTS tiles_insert BEFORE INSERT ON tiles BEGIN "
+          "UPDATE cache_size SET size = size + length (NEW.tile_data) - "
+          "IFNULL ((SELECT length (tile_data) FROM tiles WHERE zoom_level = NEW.zoom_level "
+          "AND tile_column = NEW.tile_column AND tile_row = NEW.tile_row), 0); END;"
+          "CREATE TRIGGER IF NOT EXISTS tiles_delete AFTER DELETE ON tiles BEGIN "
+          "UPDATE cache_size SET size = size - length (OLD.tile_data); END;"
+          "CREATE TRIGGER IF NOT EXISTS tiles_update AFTER UPDATE OF tile_data ON tiles BEGIN "
+          "UPDATE cache_size SET size = size - length (OLD.tile_data) + length (NEW.tile_data); END;",
+          NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        goto error;
+    }
+
+  /* version 2: tiles the tile source reported as missing, kept outside of
+   * the MBTiles tables so that other readers don't see them */
+  if (version < 2)
+    {
+      sqlite3_exec (priv->db,
+          "CREATE TABLE IF NOT EXISTS missing_tiles ("
+          "zoom_level INTEGER, "
+          "tile_column INTEGER, "
+          "tile_row INTEGER, "
+          "expires INTEGER, "
+          "PRIMARY KEY (zoom_level, tile_column, tile_row));",
+          NULL, NULL, &error_msg);
+      if (error_msg != NULL)
+        goto error;
+    }
+
+  sqlite3_exec (priv->db,
+      "PRAGMA user_version = " G_STRINGIFY (SCHEMA_VERSION) ";"
+      "COMMIT",
+      NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    goto error;
+
+  return TRUE;
+
+error:
+  DEBUG ("Upgrading %s.mbtiles failed: %s", priv->db_source_id, error_msg);
+  sqlite3_free (error_msg);
+  sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+  return FALSE;
+}
+
+
+/* Runs in the I/O thread - opens the database of the map source with the
+ * given id. The map source the cache belongs to is determined by the next
+ * source so the database is reopened when the chain changes. */
+static gboolean
+open_db (ChamplainPackedCache *packed_cache,
+    const gchar *id,
+    const gchar *name)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  gchar *filename, *basename;
+  gchar *error_msg = NULL;
+  gint error;
+
+  if (!id)
+    return FALSE;
+
+  if (priv->db && g_strcmp0 (id, priv->db_source_id) == 0)
+    return TRUE;
+
+  close_db (packed_cache);
+
+  if (g_mkdir_with_parents (priv->cache_dir, 0700) == -1 && errno != EEXIST)
+    {
+      g_warning ("Unable to create the image cache path '%s': %s",
+          priv->cache_dir, g_strerror (errno));
+      return FALSE;
+    }
+
+  basename = g_strconcat (id, ".mbtiles", NULL);
+  filename = g_build_filename (priv->cache_dir, basename, NULL);
+  error = sqlite3_open_v2 (filename, &priv->db,
+        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  g_free (basename);
+  g_free (filename);
+
+  priv->db_source_id = g_strdup (id);
+  priv->db_has_format = FALSE;
+
+  if (error != SQLITE_OK)
+    {
+      DEBUG ("Sqlite returned error %d when opening %s.mbtiles", error, id);
+      close_db (packed_cache);
+      return FALSE;
+    }
+
+  /* other processes may use the cache at the same time */
+  sqlite3_busy_timeout (priv->db, 5000);
+
+  /* the write-ahead log keeps the file consistent when the application
+   * is killed while storing tiles */
+  sqlite3_exec (priv->db,
+      "PRAGMA journal_mode=WAL;"
+      "PRAGMA synchronous=NORMAL;"
+      "PRAGMA auto_vacuum=INCREMENTAL;"
+      "CREATE TABLE IF NOT EXISTS metadata ("
+      "name TEXT PRIMARY KEY, "
+      "value TEXT);"
+      "CREATE TABLE IF NOT EXISTS tiles ("
+      "zoom_level INTEGER, "
+      "tile_column INTEGER, "
+      "tile_row INTEGER, "
+      "tile_data BLOB, "
+      "etag TEXT, "
+      "modified INTEGER DEFAULT 0, "
+      "expires INTEGER DEFAULT 0, "
+      "score REAL DEFAULT 0, "
+      "PRIMARY KEY (zoom_level, tile_column, tile_row));",
+      NULL, NULL, &error_msg);
+  if (error_msg != NULL)
+    {
+      DEBUG ("Creating tables of %s.mbtiles failed: %s", id, error_msg);
+      sqlite3_free (error_msg);
+      close_db (packed_cache);
+      return FALSE;
+    }
+
+  champlain_file_cache_register_score_function (priv->db);
+
+  if (!upgrade_schema (packed_cache))
+    {
+      close_db (packed_cache);
+      return FALSE;
+    }
+
+  error_msg = sqlite3_mprintf ("INSERT OR IGNORE INTO metadata (name, value) VALUES "
+        "('name', %Q), ('type', 'baselayer'), ('version', '1.1'), ('description', %Q)",
+        id, name);
+  sqlite3_exec (priv->db, error_msg, NULL, NULL, NULL);
+  sqlite3_free (error_msg);
+
+  if (!prepare_statement (packed_cache,
+          "SELECT tile_data, etag, modified, expires FROM tiles "
+          "WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+          &priv->stmt_select) ||
+      !prepare_statement (packed_cache,
+          "SELECT expires FROM missing_tiles "
+          "WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+          &priv->stmt_select_missing) ||
+      !prepare_statement (packed_cache,
+          "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data, etag, modified, expires, score) "
+          "VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+          &priv->stmt_store) ||
+      !prepare_statement (packed_cache,
+          "REPLACE INTO missing_tiles (zoom_level, tile_column, tile_row, expires) "
+          "VALUES (?, ?, ?, ?)",
+          &priv->stmt_store_missing) ||
+      !prepare_statement (packed_cache,
+          "DELETE FROM missing_tiles "
+          "WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+          &priv->stmt_delete_missing) ||
+      !prepare_statement (packed_cache,
+          "DELETE FROM tiles "
+          "WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+          &priv->stmt_delete_tile) ||
+      !prepare_statement (packed_cache,
+          "UPDATE tiles SET score = champlain_bump_score (score, ?) "
+          "WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+          &priv->stmt_update_popularity) ||
+      !prepare_statement (packed_cache,
+          "UPDATE tiles SET modified = ?, expires = ? "
+          "WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+          &priv->stmt_update_modified) ||
+      !prepare_statement (packed_cache,
+          "SELECT size FROM cache_size",
+          &priv->stmt_size) ||
+      !prepare_statement (packed_cache,
+          "SELECT rowid, length (tile_data) FROM tiles "
+          "WHERE expires > 0 AND expires < ? ORDER BY expires LIMIT ?",
+          &priv->stmt_evict_expired) ||
+      !prepare_statement (packed_cache,
+          "SELECT rowid, length (tile_data) FROM tiles ORDER BY score LIMIT ?",
+          &priv->stmt_evict) ||
+      !prepare_statement (packed_cache,
+          "DELETE FROM tiles WHERE rowid = ?",
+          &priv->stmt_delete) ||
+      !prepare_statement (packed_cache,
+          "DELETE FROM missing_tiles WHERE expires < ?",
+          &priv->stmt_evict_missing))
+    {
+      close_db (packed_cache);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+
+/* Binds the tile position to the parameters starting at first_param */
+static void
+bind_position (sqlite3_stmt *stmt,
+    gint first_param,
+    gint zoom_level,
+    gint x,
+    gint row)
+{
+  sqlite3_bind_int (stmt, first_param, zoom_level);
+  sqlite3_bind_int (stmt, first_param + 1, x);
+  sqlite3_bind_int (stmt, first_param + 2, row);
+}
+
+
+/* MBTiles rows are numbered from the south like in TMS */
+static gint
+get_tile_row (ChamplainTile *tile)
+{
+  return (1 << champlain_tile_get_zoom_level (tile)) - 1 - champlain_tile_get_y (tile);
+}
+
+
+/* Identifies the tile within the database of a map source */
+static gint64
+get_tile_position (ChamplainTile *tile)
+{
+  return ((gint64) champlain_tile_get_zoom_level (tile) << 50) |
+         ((gint64) champlain_tile_get_x (tile) << 25) |
+         get_tile_row (tile);
+}
+
+
+/* Returns the expiration time of the tile as stored in the database,
+ * 0 when unknown */
+static gint64
+get_tile_expires (ChamplainTile *tile)
+{
+  const GTimeVal *expiration_time = champlain_tile_get_expiration_time (tile);
+
+  return expiration_time ? MAX (expiration_time->tv_sec, 1) : 0;
+}
+
+
+static gboolean
+tile_is_expired (ChamplainTile *tile)
+{
+  GTimeVal now = { 0, };
+  const GTimeVal *modified_time = champlain_tile_get_modified_time (tile);
+  const GTimeVal *expiration_time = champlain_tile_get_expiration_time (tile);
+  gboolean validate_cache = TRUE;
+
+  /* prefer the lifetime declared by the server */
+  if (expiration_time)
+    {
+      g_get_current_time (&now);
+      validate_cache = expiration_time->tv_sec <= now.tv_sec;
+    }
+  else if (modified_time)
+    {
+      g_get_current_time (&now);
+      g_time_val_add (&now, (-24ul * 60ul * 60ul * 1000ul * 1000ul * 7ul)); /* Cache expires in 7 days */
+      validate_cache = modified_time->tv_sec < now.tv_sec;
+    }
+
+  DEBUG ("%p is %s expired", tile, (validate_cache ? "" : "not"));
+
+  return validate_cache;
+}
+
+
+/* Fills the job header with the map source the cache currently belongs to;
+ * returns FALSE when there is none */
+static gboolean
+init_job (ChamplainPackedCache *packed_cache,
+    Job *job,
+    JobType type)
+{
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (packed_cache);
+  const gchar *id = champlain_map_source_get_id (map_source);
+
+  job->type = type;
+  job->source_id = g_strdup (id);
+  job->source_name = g_strdup (champlain_map_source_get_name (map_source));
+
+  return id != NULL;
+}
+
+
+static void
+clear_job (Job *job)
+{
+  g_free (job->source_id);
+  g_free (job->source_name);
+}
+
+
+static void
+push_job (ChamplainPackedCache *packed_cache,
+    Job *job)
+{
+  g_thread_pool_push (packed_cache->priv->io_thread, job, NULL);
+}
+
+
+static void
+free_write_op (WriteOp *op)
+{
+  g_free (op->etag);
+  if (op->data)
+    g_bytes_unref (op->data);
+  g_slice_free (WriteOp, op);
+}
+
+
+/* Runs in the I/O thread - writes all changes of the batch in a single
+ * transaction */
+static void
+write_batch (ChamplainPackedCache *packed_cache,
+    WriteJob *job)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  gdouble now = champlain_file_cache_get_current_score ();
+  guint i;
+
+  if (!open_db (packed_cache, job->job.source_id, job->job.source_name))
+    return;
+
+  sqlite3_exec (priv->db, "BEGIN", NULL, NULL, NULL);
+
+  for (i = 0; i < job->ops->len; i++)
+    {
+      WriteOp *op = g_ptr_array_index (job->ops, i);
+      sqlite3_stmt *stmt = NULL;
+
+      switch (op->type)
+        {
+        case WRITE_STORE:
+          {
+            gsize size;
+            const guchar *contents = g_bytes_get_data (op->data, &size);
+
+            stmt = priv->stmt_store;
+            sqlite3_reset (stmt);
+            bind_position (stmt, 1, op->zoom_level, op->x, op->row);
+            sqlite3_bind_blob (stmt, 4, contents, (gint) size, SQLITE_STATIC);
+            sqlite3_bind_text (stmt, 5, op->etag, -1, SQLITE_STATIC);
+            sqlite3_bind_int64 (stmt, 6, op->modified);
+            sqlite3_bind_int64 (stmt, 7, op->expires);
+            sqlite3_bind_double (stmt, 8, now);
+
+            if (!priv->db_has_format && size >= 2)
+              {
+                /* MBTiles readers need to know the image format */
+                sqlite3_exec (priv->db,
+                    contents[0] == 0xff && contents[1] == 0xd8 ?
+                    "INSERT OR IGNORE INTO metadata (name, value) VALUES ('format', 'jpg')" :
+                    "INSERT OR IGNORE INTO metadata (name, value) VALUES ('format', 'png')",
+                    NULL, NULL, NULL);
+                priv->db_has_format = TRUE;
+              }
+
+            /* the tile is no longer missing */
+            sqlite3_reset (priv->stmt_delete_missing);
+            bind_position (priv->stmt_delete_missing, 1, op->zoom_level, op->x, op->row);
+            if (sqlite3_step (priv->stmt_delete_missing) != SQLITE_DONE)
+              DEBUG ("Writing to %s.mbtiles failed: %s", priv->db_source_id, sqlite3_errmsg (priv->db));
+          }
+          break;
+
+        case WRITE_STORE_MISSING:
+          /* remove the previous version of the tile */
+          sqlite3_reset (priv->stmt_delete_tile);
+          bind_position (priv->stmt_delete_tile, 1, op->zoom_level, op->x, op->row);
+          if (sqlite3_step (priv->stmt_delete_tile) != SQLITE_DONE)
+            DEBUG ("Writing to %s.mbtiles failed: %s", priv->db_source_id, sqlite3_errmsg (priv->db));
+
+          stmt = priv->stmt_store_missing;
+          sqlite3_reset (stmt);
+          bind_position (stmt, 1, op->zoom_level, op->x, op->row);
+          sqlite3_bind_int64 (stmt, 4, op->expires);
+          break;
+
+        case WRITE_TOUCH:
+          stmt = priv->stmt_update_modified;
+          sqlite3_reset (stmt);
+          sqlite3_bind_int64 (stmt, 1, op->modified);
+          sqlite3_bind_int64 (stmt, 2, op->expires);
+          bind_position (stmt, 3, op->zoom_level, op->x, op->row);
+          break;
+
+        case WRITE_POPULARITY:
+          /* may not be present in this cache, the update is a no-op then */
+          stmt = priv->stmt_update_popularity;
+          sqlite3_reset (stmt);
+          sqlite3_bind_double (stmt, 1, now);
+          bind_position (stmt, 2, op->zoom_level, op->x, op->row);
+          break;
+        }
+
+      if (sqlite3_step (stmt) != SQLITE_DONE)
+        DEBUG ("Writing to %s.mbtiles failed: %s", priv->db_source_id, sqlite3_errmsg (priv->db));
+      sqlite3_clear_bindings (stmt);
+    }
+
+  if (sqlite3_exec (priv->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Committing %u changes failed: %s", job->ops->len, sqlite3_errmsg (priv->db));
+      sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+    }
+  else
+    DEBUG ("Committed %u changes", job->ops->len);
+}
+
+
+/* Passes the queued changes to the I/O thread */
+static void
+flush_writes (ChamplainPackedCache *packed_cache)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  WriteJob *job;
+
+  if (priv->write_timeout != 0)
+    {
+      g_source_remove (priv->write_timeout);
+      priv->write_timeout = 0;
+    }
+
+  if (priv->pending_writes->len == 0 || !priv->io_thread)
+    return;
+
+  job = g_slice_new (WriteJob);
+  job->job.type = JOB_WRITE;
+  job->job.source_id = priv->pending_source_id;
+  job->job.source_name = priv->pending_source_name;
+  job->ops = priv->pending_writes;
+  push_job (packed_cache, (Job *) job);
+
+  priv->pending_writes = g_ptr_array_new_with_free_func ((GDestroyNotify) free_write_op);
+  priv->pending_source_id = NULL;
+  priv->pending_source_name = NULL;
+  g_hash_table_remove_all (priv->pending_stores);
+}
+
+
+static gboolean
+flush_writes_cb (ChamplainPackedCache *packed_cache)
+{
+  packed_cache->priv->write_timeout = 0;
+  flush_writes (packed_cache);
+
+  return FALSE;
+}
+
+
+/* Queues a change of the tile in the database of the map source the cache
+ * currently belongs to */
+static void
+queue_write (ChamplainPackedCache *packed_cache,
+    WriteType type,
+    ChamplainTile *tile,
+    GBytes *data)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  const gchar *id = champlain_map_source_get_id (CHAMPLAIN_MAP_SOURCE (packed_cache));
+  WriteOp *op;
+
+  /* already disposed */
+  if (!priv->io_thread || !id)
+    return;
+
+  /* a batch is written to a single database */
+  if (priv->pending_source_id && g_strcmp0 (id, priv->pending_source_id) != 0)
+    flush_writes (packed_cache);
+  if (!priv->pending_source_id)
+    {
+      priv->pending_source_id = g_strdup (id);
+      priv->pending_source_name = g_strdup (champlain_map_source_get_name (CHAMPLAIN_MAP_SOURCE (packed_cache)));
+    }
+
+  op = g_slice_new (WriteOp);
+  op->type = type;
+  op->position = get_tile_position (tile);
+  op->zoom_level = champlain_tile_get_zoom_level (tile);
+  op->x = champlain_tile_get_x (tile);
+  op->row = get_tile_row (tile);
+  op->etag = g_strdup (champlain_tile_get_etag (tile));
+  op->data = data ? g_bytes_ref (data) : NULL;
+  op->modified = g_get_real_time () / G_USEC_PER_SEC;
+  op->expires = get_tile_expires (tile);
+  g_ptr_array_add (priv->pending_writes, op);
+
+  if (type == WRITE_STORE || type == WRITE_STORE_MISSING)
+    g_hash_table_add (priv->pending_stores, &op->position);
+
+  if (priv->pending_writes->len >= WRITE_BATCH_SIZE)
+    flush_writes (packed_cache);
+  else if (priv->write_timeout == 0)
+    priv->write_timeout = g_timeout_add (WRITE_INTERVAL, (GSourceFunc) flush_writes_cb, packed_cache);
+}
+
+
+static void
+free_load_job (LoadJob *job)
+{
+  clear_job ((Job *) job);
+  g_object_unref (job->tile);
+  g_object_unref (job->packed_cache);
+  if (job->data)
+    g_bytes_unref (job->data);
+  g_free (job->etag);
+  g_slice_free (LoadJob, job);
+}
+
+
+/* Runs in the I/O thread */
+static void
+load_tile (ChamplainPackedCache *packed_cache,
+    LoadJob *job)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  gint sql_rc;
+
+  if (!open_db (packed_cache, job->job.source_id, job->job.source_name))
+    return;
+
+  sqlite3_reset (priv->stmt_select);
+  bind_position (priv->stmt_select, 1, job->zoom_level, job->x, job->row);
+  sql_rc = sqlite3_step (priv->stmt_select);
+  if (sql_rc == SQLITE_ROW)
+    {
+      job->found = TRUE;
+      job->data = g_bytes_new (sqlite3_column_blob (priv->stmt_select, 0),
+            sqlite3_column_bytes (priv->stmt_select, 0));
+      job->etag = g_strdup ((const gchar *) sqlite3_column_text (priv->stmt_select, 1));
+      job->modified = sqlite3_column_int64 (priv->stmt_select, 2);
+      job->expires = sqlite3_column_int64 (priv->stmt_select, 3);
+    }
+  else if (sql_rc != SQLITE_DONE)
+    DEBUG ("Failed to look up %p, error: %s", job->tile, sqlite3_errmsg (priv->db));
+  sqlite3_reset (priv->stmt_select);
+
+  if (job->found)
+    return;
+
+  /* the tile source may have reported the tile as missing */
+  sqlite3_reset (priv->stmt_select_missing);
+  bind_position (priv->stmt_select_missing, 1, job->zoom_level, job->x, job->row);
+  if (sqlite3_step (priv->stmt_select_missing) == SQLITE_ROW)
+    job->missing = sqlite3_column_int64 (priv->stmt_select_missing, 0) > g_get_real_time () / G_USEC_PER_SEC;
+  sqlite3_reset (priv->stmt_select_missing);
+}
+
+
+static void
+fill_tile_from_next_source (ChamplainMapSource *map_source,
+    ChamplainTile *tile)
+{
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+
+  if (CHAMPLAIN_IS_MAP_SOURCE (next_source))
+    champlain_map_source_fill_tile (next_source, tile);
+  else if (champlain_tile_get_state (tile) == CHAMPLAIN_STATE_LOADED)
+    {
+      /* if we have some content, use the tile even if it wasn't validated */
+      champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
+      champlain_tile_display_content (tile);
+    }
+}
+
+
+static void
+tile_rendered_cb (ChamplainTile *tile,
+    gpointer data,
+    guint size,
+    gboolean error,
+    LoadJob *job)
+{
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (job->packed_cache);
+  ChamplainMapSource *next_source;
+
+  g_signal_handlers_disconnect_by_func (tile, tile_rendered_cb, job);
+
+  next_source = champlain_map_source_get_next_source (map_source);
+
+  if (error)
+    {
+      DEBUG ("Tile rendering failed");
+      fill_tile_from_next_source (map_source, tile);
+      goto cleanup;
+    }
+
+  champlain_tile_set_state (tile, CHAMPLAIN_STATE_LOADED);
+
+  /* Notify other caches that the tile has been filled */
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_on_tile_filled (CHAMPLAIN_TILE_CACHE (next_source), tile);
+
+  if (!tile_is_expired (tile))
+    {
+      /* Tile loaded and no validation needed - done */
+      champlain_tile_set_fade_in (tile, FALSE);
+      champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
+      champlain_tile_display_content (tile);
+      goto cleanup;
+    }
+
+  champlain_tile_cache_display_stale_tile (CHAMPLAIN_TILE_CACHE (map_source), tile);
+  fill_tile_from_next_source (map_source, tile);
+
+cleanup:
+  free_load_job (job);
+}
+
+
+/* Called in the main loop when the I/O thread has looked up the tile */
+static gboolean
+load_finished_cb (LoadJob *job)
+{
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (job->packed_cache);
+  ChamplainTile *tile = job->tile;
+  ChamplainRenderer *renderer;
+  GTimeVal modified_time = { 0, };
+  GTimeVal expiration_time = { 0, };
+
+  if (job->missing)
+    {
+      DEBUG ("%p is missing in %s.mbtiles", tile, job->job.source_id);
+      champlain_tile_cache_fill_missing_tile (CHAMPLAIN_TILE_CACHE (map_source), tile);
+      free_load_job (job);
+      return FALSE;
+    }
+
+  if (!job->found)
+    {
+      fill_tile_from_next_source (map_source, tile);
+      free_load_job (job);
+      return FALSE;
+    }
+
+  renderer = champlain_map_source_get_renderer (map_source);
+  if (!CHAMPLAIN_IS_RENDERER (renderer))
+    {
+      free_load_job (job);
+      g_return_val_if_reached (FALSE);
+    }
+
+  DEBUG ("fill of %p from %s.mbtiles", tile, job->job.source_id);
+
+  champlain_tile_set_etag (tile, job->etag);
+  modified_time.tv_sec = job->modified;
+  champlain_tile_set_modified_time (tile, &modified_time);
+  expiration_time.tv_sec = job->expires;
+  champlain_tile_set_expiration_time (tile,
+      expiration_time.tv_sec > 0 ? &expiration_time : NULL);
+
+  g_signal_connect (tile, "render-complete", G_CALLBACK (tile_rendered_cb), job);
+  champlain_renderer_render_bytes (renderer, tile, job->data);
+
+  return FALSE;
+}
+
+
+static void
+fill_tile (ChamplainMapSource *map_source,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (map_source));
+  g_return_if_fail (CHAMPLAIN_IS_TILE (tile));
+
+  ChamplainPackedCache *packed_cache = CHAMPLAIN_PACKED_CACHE (map_source);
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  if (champlain_tile_get_state (tile) == CHAMPLAIN_STATE_DONE)
+    return;
+
+  if (champlain_tile_get_state (tile) != CHAMPLAIN_STATE_LOADED && priv->io_thread)
+    {
+      LoadJob *job;
+      gint64 position;
+
+      job = g_slice_new0 (LoadJob);
+      if (init_job (packed_cache, (Job *) job, JOB_LOAD))
+        {
+          job->packed_cache = g_object_ref (packed_cache);
+          job->tile = g_object_ref (tile);
+          job->zoom_level = champlain_tile_get_zoom_level (tile);
+          job->x = champlain_tile_get_x (tile);
+          job->row = get_tile_row (tile);
+
+          /* make sure the tile is in the database if its store is still queued */
+          position = get_tile_position (tile);
+          if (g_hash_table_contains (priv->pending_stores, &position))
+            flush_writes (packed_cache);
+
+          push_job (packed_cache, (Job *) job);
+          return;
+        }
+
+      clear_job ((Job *) job);
+      g_slice_free (LoadJob, job);
+    }
+
+  fill_tile_from_next_source (map_source, tile);
+}
+
+
+static void
+refresh_tile_time (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (tile_cache));
+
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+
+  queue_write (CHAMPLAIN_PACKED_CACHE (tile_cache), WRITE_TOUCH, tile, NULL);
+
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_refresh_tile_time (CHAMPLAIN_TILE_CACHE (next_source), tile);
+}
+
+
+static void
+store_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile,
+    const gchar *contents,
+    gsize size)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (tile_cache));
+
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+  GBytes *data;
+
+  DEBUG ("Update of %p", tile);
+
+  data = g_bytes_new (contents, size);
+  queue_write (CHAMPLAIN_PACKED_CACHE (tile_cache), WRITE_STORE, tile, data);
+  g_bytes_unref (data);
+
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_store_tile (CHAMPLAIN_TILE_CACHE (next_source), tile, contents, size);
+}
+
+
+static void
+on_tile_filled (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (tile_cache));
+  g_return_if_fail (CHAMPLAIN_IS_TILE (tile));
+
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+
+  DEBUG ("popularity of %p", tile);
+
+  queue_write (CHAMPLAIN_PACKED_CACHE (tile_cache), WRITE_POPULARITY, tile, NULL);
+
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_on_tile_filled (CHAMPLAIN_TILE_CACHE (next_source), tile);
+}
+
+
+static void
+store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (tile_cache));
+
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (map_source);
+
+  DEBUG ("Missing %p", tile);
+
+  /* without an expiration time the entry would never be used */
+  if (champlain_tile_get_expiration_time (tile))
+    queue_write (CHAMPLAIN_PACKED_CACHE (tile_cache), WRITE_STORE_MISSING, tile, NULL);
+
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_store_missing_tile (CHAMPLAIN_TILE_CACHE (next_source), tile);
+}
+
+
+/* Runs in the I/O thread - deletes up to PURGE_SLICE_SIZE tiles selected by
+ * stmt until the cache fits into size_limit; returns the new size of the
+ * cache */
+static gint64
+delete_tiles (ChamplainPackedCache *packed_cache,
+    sqlite3_stmt *stmt,
+    gint64 current_size,
+    guint size_limit,
+    guint *n_deleted)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  while (current_size > size_limit && sqlite3_step (stmt) == SQLITE_ROW)
+    {
+      sqlite3_reset (priv->stmt_delete);
+      sqlite3_bind_int64 (priv->stmt_delete, 1, sqlite3_column_int64 (stmt, 0));
+      if (sqlite3_step (priv->stmt_delete) != SQLITE_DONE)
+        DEBUG ("Deleting tile failed: %s", sqlite3_errmsg (priv->db));
+
+      current_size -= sqlite3_column_int64 (stmt, 1);
+      (*n_deleted)++;
+    }
+  sqlite3_reset (stmt);
+
+  return current_size;
+}
+
+
+/* Runs in the I/O thread - deletes one slice of the least valuable tiles;
+ * returns TRUE when the cache fits into size_limit or nothing more can be
+ * deleted */
+static gboolean
+purge_slice (ChamplainPackedCache *packed_cache,
+    PurgeJob *job)
+{
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  gint64 current_size;
+  guint n_deleted = 0;
+
+  if (!open_db (packed_cache, job->job.source_id, job->job.source_name))
+    return TRUE;
+
+  /* missing tiles don't count into the size but their entries are useless
+   * once expired */
+  sqlite3_reset (priv->stmt_evict_missing);
+  sqlite3_bind_int64 (priv->stmt_evict_missing, 1, g_get_real_time () / G_USEC_PER_SEC);
+  if (sqlite3_step (priv->stmt_evict_missing) != SQLITE_DONE)
+    DEBUG ("Deleting expired missing tiles failed: %s", sqlite3_errmsg (priv->db));
+  sqlite3_reset (priv->stmt_evict_missing);
+
+  sqlite3_reset (priv->stmt_size);
+  if (sqlite3_step (priv->stmt_size) != SQLITE_ROW)
+    {
+      DEBUG ("Failed to get the total cache consumption %s",
+          sqlite3_errmsg (priv->db));
+      sqlite3_reset (priv->stmt_size);
+      return TRUE;
+    }
+  current_size = sqlite3_column_int64 (priv->stmt_size, 0);
+  sqlite3_reset (priv->stmt_size);
+
+  if (current_size <= job->size_limit)
+    {
+      DEBUG ("Cache doesn't need to be purged at %" G_GINT64_FORMAT " bytes", current_size);
+      return TRUE;
+    }
+
+  sqlite3_exec (priv->db, "BEGIN", NULL, NULL, NULL);
+
+  /* tiles the server declared stale go first, the next slice continues with
+   * the least popular ones when there are no more */
+  sqlite3_bind_int64 (priv->stmt_evict_expired, 1, g_get_real_time () / G_USEC_PER_SEC);
+  sqlite3_bind_int (priv->stmt_evict_expired, 2, PURGE_SLICE_SIZE);
+  current_size = delete_tiles (packed_cache, priv->stmt_evict_expired, current_size,
+        job->size_limit, &n_deleted);
+
+  if (n_deleted == 0)
+    {
+      sqlite3_bind_int (priv->stmt_evict, 1, PURGE_SLICE_SIZE);
+      current_size = delete_tiles (packed_cache, priv->stmt_evict, current_size,
+            job->size_limit, &n_deleted);
+    }
+
+  if (sqlite3_exec (priv->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      DEBUG ("Committing the purge failed: %s", sqlite3_errmsg (priv->db));
+      sqlite3_exec (priv->db, "ROLLBACK", NULL, NULL, NULL);
+      return TRUE;
+    }
+
+  DEBUG ("Cache size is now %" G_GINT64_FORMAT, current_size);
+
+  sqlite3_exec (priv->db, "PRAGMA incremental_vacuum;", NULL, NULL, NULL);
+
+  /* stop when nothing more can be deleted */
+  return n_deleted == 0 || current_size <= job->size_limit;
+}
+
+
+/* Called in the main loop when the I/O thread has finished a purge step */
+static gboolean
+purge_finished_cb (PurgeJob *job)
+{
+  ChamplainPackedCache *packed_cache = job->packed_cache;
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  /* continue with the next step so that loads and stores queued in the
+   * meantime don't wait for the whole purge */
+  if (!job->finished && priv->io_thread)
+    {
+      job->size_limit = priv->size_limit;
+      push_job (packed_cache, (Job *) job);
+      return FALSE;
+    }
+
+  priv->purging = FALSE;
+
+  clear_job ((Job *) job);
+  g_object_unref (packed_cache);
+  g_slice_free (PurgeJob, job);
+
+  return FALSE;
+}
+
+
+/* Runs in the I/O thread */
+static void
+run_job (Job *job,
+    ChamplainPackedCache *packed_cache)
+{
+  switch (job->type)
+    {
+    case JOB_LOAD:
+      load_tile (packed_cache, (LoadJob *) job);
+      clutter_threads_add_idle_full (CLUTTER_PRIORITY_REDRAW,
+          (GSourceFunc) load_finished_cb, job, NULL);
+      break;
+
+    case JOB_WRITE:
+      {
+        WriteJob *write_job = (WriteJob *) job;
+
+        write_batch (packed_cache, write_job);
+        clear_job (job);
+        g_ptr_array_unref (write_job->ops);
+        g_slice_free (WriteJob, write_job);
+      }
+      break;
+
+    case JOB_PURGE:
+      {
+        PurgeJob *purge_job = (PurgeJob *) job;
+
+        purge_job->finished = purge_slice (packed_cache, purge_job);
+      }
+      clutter_threads_add_idle_full (CLUTTER_PRIORITY_REDRAW,
+          (GSourceFunc) purge_finished_cb, job, NULL);
+      break;
+    }
+}
+
+
+static gboolean
+purge_on_idle (gpointer data)
+{
+  ChamplainPackedCache *packed_cache = CHAMPLAIN_PACKED_CACHE (data);
+
+  packed_cache->priv->purge_source_id = 0;
+  champlain_packed_cache_purge (packed_cache);
+
+  return FALSE;
+}
+
+
+/**
+ * champlain_packed_cache_purge_on_idle:
+ * @packed_cache: a #ChamplainPackedCache
+ *
+ * Purge the cache from the less popular tiles until cache's size limit is reached.
+ * This is a non blocking call as the purge will happen when the application is idle
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_packed_cache_purge_on_idle (ChamplainPackedCache *packed_cache)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (packed_cache));
+
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+
+  if (priv->purge_source_id)
+    return;
+
+  priv->purge_source_id = g_idle_add_full (CLUTTER_PRIORITY_REDRAW,
+        (GSourceFunc) purge_on_idle,
+        g_object_ref (packed_cache),
+        (GDestroyNotify) g_object_unref);
+}
+
+
+/**
+ * champlain_packed_cache_purge:
+ * @packed_cache: a #ChamplainPackedCache
+ *
+ * Purge the cache of the current map source from the less popular tiles
+ * until cache's size limit is reached. The purge is performed by the cache's
+ * I/O thread after all pending changes have been written; this call doesn't
+ * block. Tiles are deleted in small steps so that tile loads aren't delayed
+ * by a large purge.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_packed_cache_purge (ChamplainPackedCache *packed_cache)
+{
+  g_return_if_fail (CHAMPLAIN_IS_PACKED_CACHE (packed_cache));
+
+  ChamplainPackedCachePrivate *priv = packed_cache->priv;
+  PurgeJob *job;
+
+  /* a running purge picks up the current size limit in its next step */
+  if (!priv->io_thread || priv->purging)
+    return;
+
+  flush_writes (packed_cache);
+
+  job = g_slice_new (PurgeJob);
+  if (!init_job (packed_cache, (Job *) job, JOB_PURGE))
+    {
+      clear_job ((Job *) job);
+      g_slice_free (PurgeJob, job);
+      return;
+    }
+  job->packed_cache = g_object_ref (packed_cache);
+  job->size_limit = priv->size_limit;
+  job->finished = FALSE;
+  priv->purging = TRUE;
+  push_job (packed_cache, (Job *) job);
+}
@@ -22,6 +22,13 @@
 #include <glib.h>
 #include <clutter/clutter.h>
 
+#include "champlain-file-cache.h"
+#include "champlain-kinetic-scroll-view.h"
+#include "champlain-map-source.h"
+#include "champlain-network-tile-source.h"
+#include "champlain-renderer.h"
+#include "champlain-tile-cache.h"
+
 
 #define CHAMPLAIN_PARAM_READABLE     \
   (G_PARAM_READABLE |     \
@@ -31,4 +38,82 @@
   (G_PARAM_READABLE | G_PARAM_WRITABLE | \
    G_PARAM_STATIC_NICK | G_PARAM_STATIC_NAME | G_PARAM_STATIC_BLURB)
 
+/* Implementation of champlain_renderer_render_bytes(); the default one
+ * passes the data to set_data() and calls render() */
+typedef void (*ChamplainRendererRenderBytesFunc)(ChamplainRenderer *renderer,
+    ChamplainTile *tile,
+    GBytes *data);
+void champlain_renderer_class_set_render_bytes (ChamplainRendererClass *klass,
+    ChamplainRendererRenderBytesFunc func);
+
+/* Implementation of champlain_tile_cache_store_missing_tile(); the default
+ * one passes the tile to the next source when it is a tile cache */
+typedef void (*ChamplainTileCacheStoreMissingTileFunc)(ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
+void champlain_tile_cache_class_set_store_missing_tile (ChamplainTileCacheClass *klass,
+    ChamplainTileCacheStoreMissingTileFunc func);
+
+/* Computes how far the viewport is still going to move until the running
+ * deceleration stops. Returns FALSE when not decelerating. */
+gboolean champlain_kinetic_scroll_view_get_remaining_distance (ChamplainKineticScrollView *self,
+    gdouble *dx,
+    gdouble *dy);
+
+/* Calls champlain_network_tile_source_warm_up() for all network tile sources
+ * reachable from map_source, including those inside of source chains */
+void champlain_map_source_warm_up (ChamplainMapSource *map_source);
+
+/* Returns the first source of the given type reachable from map_source,
+ * including those inside of source chains */
+ChamplainMapSource *champlain_map_source_find_by_type (ChamplainMapSource *map_source,
+    GType type);
+
+/* Returns the tile into the state of a newly created tile without content so
+ * it can be reused for other coordinates; no notifications are emitted and
+ * all render-complete and notify::state handlers are disconnected */
+void champlain_tile_reset (ChamplainTile *self);
+
+/* The order in which tiles waiting for rendering are rendered, tiles with
+ * lower values first; the view uses the distance from its center */
+void champlain_tile_set_load_priority (ChamplainTile *self,
+    guint priority);
+guint champlain_tile_get_load_priority (ChamplainTile *self);
+
+/* Whether champlain_tile_display_content() fades the content in or shows it
+ * at once */
+void champlain_tile_set_animate_display (ChamplainTile *self,
+    gboolean animate);
+
+/* Returns the URI of the tile with the given coordinates, NULL when the URI
+ * format contains #S# but no mirrors are set */
+gchar *champlain_network_tile_source_get_tile_uri (ChamplainNetworkTileSource *tile_source,
+    guint zoom_level,
+    gint x,
+    gint y);
+
+/* Returns the file name under which the tile with the given coordinates is
+ * stored */
+gchar *champlain_file_cache_get_tile_filename (ChamplainFileCache *file_cache,
+    guint zoom_level,
+    gint x,
+    gint y);
+
+/* Queues writing of the tile data like champlain_tile_cache_store_tile() but
+ * without a tile; the data is stored in this cache only */
+void champlain_file_cache_store_tile_data (ChamplainFileCache *file_cache,
+    guint zoom_level,
+    gint x,
+    gint y,
+    const gchar *etag,
+    GBytes *data);
+
+/* The eviction score of a tile used now; tiles with lower scores are less
+ * valuable. Also used by #ChamplainPackedCache. */
+gdouble champlain_file_cache_get_current_score (void);
+
+/* Registers the SQL function champlain_bump_score (score, now) which returns
+ * the score of a tile after one more use */
+struct sqlite3;
+void champlain_file_cache_register_score_function (struct sqlite3 *db);
+
 #endif
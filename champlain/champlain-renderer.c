@@ -22,11 +22,33 @@
  * A renderer is used to render tiles textures. A tile is rendered based on
  * the provided data - this can be arbitrary data the given renderer understands
  * (e.g. raw bitmap data, vector xml map representation and so on).
+ *
+ * Data which belongs to a single tile should be passed together with the tile
+ * using champlain_renderer_render_bytes(). In this case the renderer keeps no
+ * per-call state so the same renderer can render several tiles at once and
+ * the data are not copied. champlain_renderer_set_data() is meant for data
+ * shared by all the rendered tiles (e.g. the vector data of
+ * #ChamplainMemphisRenderer).
  */
 
 #include "champlain-renderer.h"
+#include "champlain-private.h"
+
+/* Kept outside of ChamplainRendererClass so its layout doesn't change */
+typedef struct
+{
+  ChamplainRendererRenderBytesFunc render_bytes;
+} ChamplainRendererClassPrivate;
+
+G_DEFINE_TYPE_WITH_CODE (ChamplainRenderer, champlain_renderer, G_TYPE_INITIALLY_UNOWNED,
+    g_type_add_class_private (g_define_type_id, sizeof (ChamplainRendererClassPrivate)))
 
-G_DEFINE_TYPE (ChamplainRenderer, champlain_renderer, G_TYPE_INITIALLY_UNOWNED)
+#define GET_CLASS_PRIVATE(klass) \
+  (G_TYPE_CLASS_GET_PRIVATE ((klass), CHAMPLAIN_TYPE_RENDERER, ChamplainRendererClassPrivate))
+
+static void render_bytes (ChamplainRenderer *renderer,
+    ChamplainTile *tile,
+    GBytes *data);
 
 static void
 champlain_renderer_dispose (GObject *object)
@@ -52,6 +74,18 @@ champlain_renderer_class_init (ChamplainRendererClass *klass)
 
   klass->set_data = NULL;
   klass->render = NULL;
+  GET_CLASS_PRIVATE (klass)->render_bytes = render_bytes;
+}
+
+
+void
+champlain_renderer_class_set_render_bytes (ChamplainRendererClass *klass,
+    ChamplainRendererRenderBytesFunc func)
+{
+  g_return_if_fail (CHAMPLAIN_IS_RENDERER_CLASS (klass));
+  g_return_if_fail (func != NULL);
+
+  GET_CLASS_PRIVATE (klass)->render_bytes = func;
 }
 
 
@@ -98,6 +132,49 @@ champlain_renderer_render (ChamplainRenderer *renderer,
 }
 
 
+/**
+ * champlain_renderer_render_bytes:
+ * @renderer: a #ChamplainRenderer
+ * @tile: the tile to render
+ * @data: (allow-none): data used for rendering of this tile
+ *
+ * Renders the texture for the provided tile from the given data. Unlike
+ * champlain_renderer_set_data() followed by champlain_renderer_render(), the
+ * data are bound to this call only - the renderer keeps a reference to @data
+ * for the time of rendering instead of copying it. Otherwise the function
+ * behaves like champlain_renderer_render() and the same data are passed to the
+ * #ChamplainTile::render-complete signal.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_renderer_render_bytes (ChamplainRenderer *renderer,
+    ChamplainTile *tile,
+    GBytes *data)
+{
+  g_return_if_fail (CHAMPLAIN_IS_RENDERER (renderer));
+
+  GET_CLASS_PRIVATE (CHAMPLAIN_RENDERER_GET_CLASS (renderer))->render_bytes (renderer, tile, data);
+}
+
+
+static void
+render_bytes (ChamplainRenderer *renderer,
+    ChamplainTile *tile,
+    GBytes *data)
+{
+  gconstpointer contents = NULL;
+  gsize size = 0;
+
+  /* fallback for renderers which only implement set_data() and render() */
+  if (data)
+    contents = g_bytes_get_data (data, &size);
+
+  champlain_renderer_set_data (renderer, contents, size);
+  champlain_renderer_render (renderer, tile);
+}
+
+
 static void
 champlain_renderer_init (ChamplainRenderer *self)
 {
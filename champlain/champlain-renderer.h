@@ -79,6 +79,9 @@ void champlain_renderer_set_data (ChamplainRenderer *renderer,
     guint size);
 void champlain_renderer_render (ChamplainRenderer *renderer,
     ChamplainTile *tile);
+void champlain_renderer_render_bytes (ChamplainRenderer *renderer,
+    ChamplainTile *tile,
+    GBytes *data);
 
 G_END_DECLS
 
@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Network sources share their SoupSessions so that tile requests of all
+ * views and sources reuse the same persistent connections. One session is
+ * created for every combination of proxy and connection limits in use and
+ * lives as long as a source holds it.
+ *
+ * The pool also tracks the health of the hosts requested through its
+ * sessions. After repeated failures of a host its circuit opens: requests
+ * queued for the host fail immediately and new ones aren't sent until the
+ * circuit closes again after a growing delay, so that tiles fall through to
+ * the next sources instead of waiting for timeouts one by one.
+ *
+ * GNetworkMonitor is only used as a hint as it may be wrong, e.g. for hosts
+ * on a local network or behind a VPN. While it reports no network, the first
+ * transport failure of a host opens its circuit at once; requests are never
+ * refused before they actually fail. When the network comes back, all
+ * circuits are closed.
+ */
+
+#include "config.h"
+
+#include "champlain-session-pool.h"
+
+#define DEBUG_FLAG CHAMPLAIN_DEBUG_NETWORK
+#include "champlain-debug.h"
+
+#include "champlain-version.h"
+
+#include <gio/gio.h>
+
+/* time in seconds after which a stalled request fails */
+#define REQUEST_TIMEOUT 20
+/* number of consecutive failures of a host opening its circuit */
+#define CIRCUIT_FAILURES 3
+/* time in seconds the circuit stays open, doubled every time a trial
+ * request fails */
+#define CIRCUIT_OPEN_TIME 5
+#define CIRCUIT_MAX_OPEN_TIME 300
+
+typedef struct
+{
+  guint failures;
+  /* monotonic time the circuit is open until, 0 when it is closed */
+  gint64 open_until;
+  guint open_time;
+  /* a trial request is in flight after open_until */
+  gboolean probing;
+} HostHealth;
+
+/* maps the session settings to sessions, the sessions are not referenced */
+static GHashTable *sessions = NULL;
+/* maps host names to HostHealth of hosts which failed recently */
+static GHashTable *hosts = NULL;
+/* maps the messages queued in the sessions to their sessions */
+static GHashTable *queued = NULL;
+static gboolean network_available = TRUE;
+
+
+/* Fails the queued requests of host except for except */
+static void
+fail_queued_messages (const gchar *host,
+    SoupMessage *except)
+{
+  GHashTableIter iter;
+  GPtrArray *messages;
+  gpointer msg, session;
+  guint i;
+
+  /* cancelling removes the messages from the table */
+  messages = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, queued);
+  while (g_hash_table_iter_next (&iter, &msg, &session))
+    {
+      SoupURI *uri = soup_message_get_uri (msg);
+
+      if (msg != except && g_strcmp0 (uri->host, host) == 0)
+        g_ptr_array_add (messages, msg);
+    }
+
+  for (i = 0; i < messages->len; i++)
+    {
+      msg = g_ptr_array_index (messages, i);
+      session = g_hash_table_lookup (queued, msg);
+      if (session)
+        soup_session_cancel_message (session, msg, SOUP_STATUS_CANT_CONNECT);
+    }
+
+  g_ptr_array_unref (messages);
+}
+
+
+static void
+network_changed_cb (G_GNUC_UNUSED GNetworkMonitor *monitor,
+    gboolean available,
+    G_GNUC_UNUSED gpointer user_data)
+{
+  if (available == network_available)
+    return;
+
+  DEBUG ("Network %s", available ? "available" : "unavailable");
+  network_available = available;
+
+  /* give all hosts a new chance */
+  if (available)
+    g_hash_table_remove_all (hosts);
+}
+
+
+static void
+request_queued_cb (SoupSession *session,
+    SoupMessage *msg)
+{
+  g_hash_table_insert (queued, msg, session);
+}
+
+
+static void
+request_unqueued_cb (G_GNUC_UNUSED SoupSession *session,
+    SoupMessage *msg)
+{
+  g_hash_table_remove (queued, msg);
+}
+
+
+static void
+init_pool (void)
+{
+  GNetworkMonitor *monitor;
+
+  sessions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  queued = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  monitor = g_network_monitor_get_default ();
+  network_available = g_network_monitor_get_network_available (monitor);
+  g_signal_connect (monitor, "network-changed", G_CALLBACK (network_changed_cb), NULL);
+}
+
+
+static void
+session_finalized (gchar *key,
+    G_GNUC_UNUSED GObject *where_the_object_was)
+{
+  DEBUG ("Closing shared session %s", key);
+  g_hash_table_remove (sessions, key);
+}
+
+
+/*
+ * champlain_session_pool_acquire:
+ * @proxy_uri: (allow-none): the proxy to use or %NULL
+ * @max_conns_per_host: maximum number of connections to a single host
+ * @max_conns: maximum number of connections of the session
+ *
+ * Returns: (transfer full): a session shared with all other users asking for
+ * the same settings, release it with champlain_session_pool_release()
+ */
+SoupSession *
+champlain_session_pool_acquire (const gchar *proxy_uri,
+    guint max_conns_per_host,
+    guint max_conns)
+{
+  SoupSession *session;
+  SoupURI *uri = NULL;
+  gchar *key;
+
+  if (proxy_uri != NULL && *proxy_uri == '\0')
+    proxy_uri = NULL;
+
+  if (!sessions)
+    init_pool ();
+
+  key = g_strdup_printf ("%u %u %s", max_conns_per_host, max_conns,
+        proxy_uri ? proxy_uri : "");
+  session = g_hash_table_lookup (sessions, key);
+  if (session)
+    {
+      g_free (key);
+      return g_object_ref (session);
+    }
+
+  DEBUG ("Opening shared session %s", key);
+
+  if (proxy_uri)
+    uri = soup_uri_new (proxy_uri);
+
+  session = soup_session_async_new_with_options (
+        "proxy-uri", uri,
+#ifdef HAVE_LIBSOUP_GNOME
+        SOUP_SESSION_ADD_FEATURE_BY_TYPE,
+        SOUP_TYPE_PROXY_RESOLVER_GNOME,
+#endif
+        NULL);
+  g_object_set (G_OBJECT (session),
+      "user-agent",
+      "libchamplain/" CHAMPLAIN_VERSION_S,
+      "max-conns-per-host", max_conns_per_host,
+      "max-conns", max_conns,
+      "timeout", REQUEST_TIMEOUT,
+      NULL);
+  g_signal_connect (session, "request-queued", G_CALLBACK (request_queued_cb), NULL);
+  g_signal_connect (session, "request-unqueued", G_CALLBACK (request_unqueued_cb), NULL);
+
+  if (uri)
+    soup_uri_free (uri);
+
+  /* the key is freed by the hash table */
+  g_hash_table_insert (sessions, key, session);
+  g_object_weak_ref (G_OBJECT (session), (GWeakNotify) session_finalized, key);
+
+  return session;
+}
+
+
+/*
+ * champlain_session_pool_release:
+ * @session: a session returned by champlain_session_pool_acquire()
+ *
+ * Drops the reference to @session. Messages queued by the caller have to be
+ * cancelled by the caller as they may share the session with others.
+ */
+void
+champlain_session_pool_release (SoupSession *session)
+{
+  g_return_if_fail (SOUP_IS_SESSION (session));
+
+  g_object_unref (session);
+}
+
+
+/*
+ * champlain_session_pool_warm_up:
+ * @session: the session
+ * @uri: an URI which is going to be requested soon
+ *
+ * Sends a HEAD request for @uri so that the name lookup and the connection
+ * setup are done before the first real request, which then reuses the
+ * persistent connection.
+ */
+void
+champlain_session_pool_warm_up (SoupSession *session,
+    const gchar *uri)
+{
+  SoupMessage *msg;
+
+  g_return_if_fail (SOUP_IS_SESSION (session));
+
+  msg = soup_message_new (SOUP_METHOD_HEAD, uri);
+  if (!msg)
+    return;
+
+  DEBUG ("Warming up connection for %s", uri);
+  soup_session_queue_message (session, msg, NULL, NULL);
+}
+
+
+/*
+ * champlain_session_pool_is_host_available:
+ * @msg: a message which is about to be queued
+ *
+ * Checks whether requests to the host of @msg should be sent. When the
+ * circuit of the host is about to close, a single trial request is allowed
+ * and its result has to be passed to champlain_session_pool_report_result().
+ *
+ * Returns: %FALSE when the circuit of the host is open
+ */
+gboolean
+champlain_session_pool_is_host_available (SoupMessage *msg)
+{
+  HostHealth *health;
+
+  g_return_val_if_fail (SOUP_IS_MESSAGE (msg), FALSE);
+
+  if (!hosts)
+    return TRUE;
+
+  health = g_hash_table_lookup (hosts, soup_message_get_uri (msg)->host);
+  if (!health || health->open_until == 0)
+    return TRUE;
+
+  if (g_get_monotonic_time () < health->open_until || health->probing)
+    return FALSE;
+
+  DEBUG ("Probing %s", soup_message_get_uri (msg)->host);
+  health->probing = TRUE;
+  return TRUE;
+}
+
+
+/*
+ * champlain_session_pool_report_result:
+ * @msg: a finished message
+ *
+ * Updates the health of the host of @msg, opening its circuit after
+ * repeated failures.
+ *
+ * Returns: %TRUE when @msg failed in a way which may not happen when the
+ * request is repeated
+ */
+gboolean
+champlain_session_pool_report_result (SoupMessage *msg)
+{
+  const gchar *host;
+  HostHealth *health;
+  gint64 now;
+
+  g_return_val_if_fail (SOUP_IS_MESSAGE (msg), FALSE);
+
+  if (!hosts)
+    return FALSE;
+
+  host = soup_message_get_uri (msg)->host;
+  health = g_hash_table_lookup (hosts, host);
+
+  if (msg->status_code == SOUP_STATUS_CANCELLED)
+    {
+      /* let the next request probe the host */
+      if (health)
+        health->probing = FALSE;
+      return FALSE;
+    }
+
+  if (!SOUP_STATUS_IS_TRANSPORT_ERROR (msg->status_code) &&
+      !SOUP_STATUS_IS_SERVER_ERROR (msg->status_code))
+    {
+      if (health && health->open_until != 0)
+        DEBUG ("Closing circuit of %s", host);
+      g_hash_table_remove (hosts, host);
+      return FALSE;
+    }
+
+  now = g_get_monotonic_time ();
+
+  if (!health)
+    {
+      health = g_new0 (HostHealth, 1);
+      g_hash_table_insert (hosts, g_strdup (host), health);
+    }
+  /* failed because the circuit was opened by another request */
+  else if (now < health->open_until)
+    return FALSE;
+
+  health->failures++;
+
+  /* the failure confirms what the network monitor reports */
+  if (!network_available && SOUP_STATUS_IS_TRANSPORT_ERROR (msg->status_code))
+    health->failures = MAX (health->failures, CIRCUIT_FAILURES);
+
+  if (health->probing || health->failures >= CIRCUIT_FAILURES)
+    {
+      health->open_time = health->open_time == 0 ? CIRCUIT_OPEN_TIME :
+        MIN (health->open_time * 2, CIRCUIT_MAX_OPEN_TIME);
+      health->open_until = now + (gint64) health->open_time * G_USEC_PER_SEC;
+      health->probing = FALSE;
+
+      DEBUG ("Opening circuit of %s for %u s", host, health->open_time);
+      fail_queued_messages (host, msg);
+      return FALSE;
+    }
+
+  return TRUE;
+}
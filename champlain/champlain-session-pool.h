@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CHAMPLAIN_SESSION_POOL_H__
+#define __CHAMPLAIN_SESSION_POOL_H__
+
+#include <glib.h>
+
+#ifdef HAVE_LIBSOUP_GNOME
+#include <libsoup/soup-gnome.h>
+#else
+#include <libsoup/soup.h>
+#endif
+
+G_BEGIN_DECLS
+
+SoupSession *champlain_session_pool_acquire (const gchar *proxy_uri,
+    guint max_conns_per_host,
+    guint max_conns);
+void champlain_session_pool_release (SoupSession *session);
+void champlain_session_pool_warm_up (SoupSession *session,
+    const gchar *uri);
+gboolean champlain_session_pool_is_host_available (SoupMessage *msg);
+gboolean champlain_session_pool_report_result (SoupMessage *msg);
+
+G_END_DECLS
+
+#endif /* __CHAMPLAIN_SESSION_POOL_H__ */
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Rendered tiles of the same size share large textures, the atlas pages,
+ * instead of getting a texture each. Every tile occupies a slot of a page
+ * and is painted by a ChamplainAtlasContent as a sub-region of the page's
+ * texture. Tiles painted from the same page use equal pipelines so Cogl
+ * batches them into a single draw call, no matter how many tiles are
+ * visible.
+ *
+ * A slot is in use as long as its content exists, i.e. until the tile
+ * actors showing it are gone and the memory cache dropped it, so the slots
+ * are reused in the order the cache evicts the tiles. Pages without used
+ * slots are freed.
+ *
+ * All functions have to be called from the main thread.
+ */
+
+#include "champlain-texture-atlas.h"
+
+#define DEBUG_FLAG CHAMPLAIN_DEBUG_LOADING
+#include "champlain-debug.h"
+
+#include <string.h>
+
+/* width and height of the page textures */
+#define ATLAS_PAGE_SIZE 2048
+/* pixels the tile edges are repeated around every slot so that scaled tiles
+ * don't show the neighbouring slots */
+#define ATLAS_PADDING 1
+
+typedef struct
+{
+  CoglTexture *texture;
+  gint tile_size;
+  gint slot_size;
+  guint n_columns;
+  /* indexes of the unused slots */
+  GArray *free_slots;
+  guint n_used;
+} AtlasPage;
+
+typedef struct _ChamplainAtlasContent ChamplainAtlasContent;
+typedef struct _ChamplainAtlasContentClass ChamplainAtlasContentClass;
+
+struct _ChamplainAtlasContent
+{
+  GObject parent_instance;
+
+  AtlasPage *page;
+  guint slot;
+};
+
+struct _ChamplainAtlasContentClass
+{
+  GObjectClass parent_class;
+};
+
+static void clutter_content_iface_init (ClutterContentIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (ChamplainAtlasContent, champlain_atlas_content, G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (CLUTTER_TYPE_CONTENT, clutter_content_iface_init))
+
+#define CHAMPLAIN_ATLAS_CONTENT(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CHAMPLAIN_TYPE_ATLAS_CONTENT, ChamplainAtlasContent))
+
+/* maps tile sizes to GPtrArrays of their AtlasPages */
+static GHashTable *pages = NULL;
+
+
+static AtlasPage *
+page_new (gint tile_size)
+{
+  AtlasPage *page;
+  CoglTexture *texture;
+  guint n_slots, i;
+
+  texture = cogl_texture_new_with_size (ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE,
+        COGL_TEXTURE_NO_AUTO_MIPMAP | COGL_TEXTURE_NO_SLICING | COGL_TEXTURE_NO_ATLAS,
+        COGL_PIXEL_FORMAT_RGBA_8888_PRE);
+  if (!texture)
+    return NULL;
+
+  page = g_slice_new (AtlasPage);
+  page->texture = texture;
+  page->tile_size = tile_size;
+  page->slot_size = tile_size + 2 * ATLAS_PADDING;
+  page->n_columns = ATLAS_PAGE_SIZE / page->slot_size;
+  page->n_used = 0;
+
+  n_slots = page->n_columns * page->n_columns;
+  page->free_slots = g_array_sized_new (FALSE, FALSE, sizeof (guint), n_slots);
+  /* the first slots are taken first */
+  for (i = n_slots; i > 0; i--)
+    {
+      guint slot = i - 1;
+      g_array_append_val (page->free_slots, slot);
+    }
+
+  DEBUG ("New atlas page for %d pixel tiles with %u slots", tile_size, n_slots);
+
+  return page;
+}
+
+
+static void
+page_free (AtlasPage *page)
+{
+  DEBUG ("Freeing atlas page for %d pixel tiles", page->tile_size);
+
+  cogl_object_unref (page->texture);
+  g_array_unref (page->free_slots);
+  g_slice_free (AtlasPage, page);
+}
+
+
+static void
+page_release_slot (AtlasPage *page,
+    guint slot)
+{
+  g_array_append_val (page->free_slots, slot);
+  page->n_used--;
+
+  if (page->n_used == 0)
+    {
+      GPtrArray *size_pages = g_hash_table_lookup (pages, GINT_TO_POINTER (page->tile_size));
+
+      g_ptr_array_remove_fast (size_pages, page);
+      if (size_pages->len == 0)
+        g_hash_table_remove (pages, GINT_TO_POINTER (page->tile_size));
+      page_free (page);
+    }
+}
+
+
+static void
+champlain_atlas_content_finalize (GObject *object)
+{
+  ChamplainAtlasContent *content = CHAMPLAIN_ATLAS_CONTENT (object);
+
+  page_release_slot (content->page, content->slot);
+
+  G_OBJECT_CLASS (champlain_atlas_content_parent_class)->finalize (object);
+}
+
+
+static void
+champlain_atlas_content_class_init (ChamplainAtlasContentClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = champlain_atlas_content_finalize;
+}
+
+
+static void
+champlain_atlas_content_init (ChamplainAtlasContent *content)
+{
+  content->page = NULL;
+  content->slot = 0;
+}
+
+
+static gboolean
+get_preferred_size (ClutterContent *content,
+    gfloat *width,
+    gfloat *height)
+{
+  AtlasPage *page = CHAMPLAIN_ATLAS_CONTENT (content)->page;
+
+  if (width)
+    *width = page->tile_size;
+  if (height)
+    *height = page->tile_size;
+
+  return TRUE;
+}
+
+
+static void
+paint_content (ClutterContent *content,
+    ClutterActor *actor,
+    ClutterPaintNode *root)
+{
+  ChamplainAtlasContent *self = CHAMPLAIN_ATLAS_CONTENT (content);
+  AtlasPage *page = self->page;
+  ClutterScalingFilter min_filter, mag_filter;
+  ClutterPaintNode *node;
+  ClutterActorBox box;
+  ClutterColor color;
+  guint8 paint_opacity;
+  gfloat x, y;
+
+  clutter_actor_get_content_box (actor, &box);
+  clutter_actor_get_content_scaling_filters (actor, &min_filter, &mag_filter);
+  /* the pages have no mipmaps, they would mix the neighbouring slots */
+  if (min_filter == CLUTTER_SCALING_FILTER_TRILINEAR)
+    min_filter = CLUTTER_SCALING_FILTER_LINEAR;
+
+  paint_opacity = clutter_actor_get_paint_opacity (actor);
+  color.red = paint_opacity;
+  color.green = paint_opacity;
+  color.blue = paint_opacity;
+  color.alpha = paint_opacity;
+
+  x = (self->slot % page->n_columns) * page->slot_size + ATLAS_PADDING;
+  y = (self->slot / page->n_columns) * page->slot_size + ATLAS_PADDING;
+
+  node = clutter_texture_node_new (page->texture, &color, min_filter, mag_filter);
+  clutter_paint_node_set_name (node, "Atlas tile");
+  clutter_paint_node_add_texture_rectangle (node, &box,
+      x / ATLAS_PAGE_SIZE,
+      y / ATLAS_PAGE_SIZE,
+      (x + page->tile_size) / ATLAS_PAGE_SIZE,
+      (y + page->tile_size) / ATLAS_PAGE_SIZE);
+  clutter_paint_node_add_child (root, node);
+  clutter_paint_node_unref (node);
+}
+
+
+static void
+clutter_content_iface_init (ClutterContentIface *iface)
+{
+  iface->get_preferred_size = get_preferred_size;
+  iface->paint_content = paint_content;
+}
+
+
+static AtlasPage *
+find_page (gint tile_size)
+{
+  GPtrArray *size_pages;
+  AtlasPage *page;
+  guint i;
+
+  if (!pages)
+    pages = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+          (GDestroyNotify) g_ptr_array_unref);
+
+  size_pages = g_hash_table_lookup (pages, GINT_TO_POINTER (tile_size));
+  if (!size_pages)
+    {
+      size_pages = g_ptr_array_new ();
+      g_hash_table_insert (pages, GINT_TO_POINTER (tile_size), size_pages);
+    }
+
+  for (i = 0; i < size_pages->len; i++)
+    {
+      page = g_ptr_array_index (size_pages, i);
+      if (page->free_slots->len > 0)
+        return page;
+    }
+
+  page = page_new (tile_size);
+  if (page)
+    g_ptr_array_add (size_pages, page);
+  else if (size_pages->len == 0)
+    g_hash_table_remove (pages, GINT_TO_POINTER (tile_size));
+
+  return page;
+}
+
+
+/* Copies the pixels into a buffer of the slot's size with the edges
+ * repeated into the padding */
+static guint8 *
+create_padded_pixels (const guint8 *data,
+    gint bpp,
+    gint size,
+    gint rowstride,
+    gint slot_size)
+{
+  gint slot_rowstride = slot_size * bpp;
+  guint8 *pixels = g_malloc (slot_rowstride * slot_size);
+  gint x, y;
+
+  for (y = 0; y < slot_size; y++)
+    {
+      const guint8 *src = data + CLAMP (y - ATLAS_PADDING, 0, size - 1) * rowstride;
+      guint8 *dst = pixels + y * slot_rowstride;
+
+      memcpy (dst + ATLAS_PADDING * bpp, src, size * bpp);
+      for (x = 0; x < ATLAS_PADDING; x++)
+        {
+          memcpy (dst + x * bpp, src, bpp);
+          memcpy (dst + (ATLAS_PADDING + size + x) * bpp, src + (size - 1) * bpp, bpp);
+        }
+    }
+
+  return pixels;
+}
+
+
+/* Returns content painting the pixels from a slot of an atlas page or NULL
+ * when the pixels can't be placed in the atlas, e.g. because the tile isn't
+ * square or the format isn't RGB or RGBA. RGB pixels are converted by Cogl
+ * while they are uploaded. */
+ClutterContent *
+champlain_texture_atlas_create_content (const guint8 *data,
+    CoglPixelFormat format,
+    gint width,
+    gint height,
+    gint rowstride)
+{
+  ChamplainAtlasContent *content;
+  AtlasPage *page;
+  guint8 *pixels;
+  guint slot;
+  gint bpp;
+  gint x, y;
+
+  if (width != height || width <= 0 || width + 2 * ATLAS_PADDING > ATLAS_PAGE_SIZE / 2)
+    return NULL;
+
+  if (format == COGL_PIXEL_FORMAT_RGB_888)
+    bpp = 3;
+  else if (format == COGL_PIXEL_FORMAT_RGBA_8888 || format == COGL_PIXEL_FORMAT_RGBA_8888_PRE)
+    bpp = 4;
+  else
+    return NULL;
+
+  page = find_page (width);
+  if (!page)
+    return NULL;
+
+  slot = g_array_index (page->free_slots, guint, page->free_slots->len - 1);
+  x = (slot % page->n_columns) * page->slot_size;
+  y = (slot / page->n_columns) * page->slot_size;
+
+  pixels = create_padded_pixels (data, bpp, width, rowstride, page->slot_size);
+  if (!cogl_texture_set_region (page->texture, 0, 0, x, y,
+          page->slot_size, page->slot_size,
+          page->slot_size, page->slot_size,
+          format, page->slot_size * bpp, pixels))
+    {
+      g_free (pixels);
+      return NULL;
+    }
+  g_free (pixels);
+
+  g_array_set_size (page->free_slots, page->free_slots->len - 1);
+  page->n_used++;
+
+  content = g_object_new (CHAMPLAIN_TYPE_ATLAS_CONTENT, NULL);
+  content->page = page;
+  content->slot = slot;
+
+  return CLUTTER_CONTENT (content);
+}
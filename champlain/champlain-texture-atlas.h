@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CHAMPLAIN_TEXTURE_ATLAS_H__
+#define __CHAMPLAIN_TEXTURE_ATLAS_H__
+
+#include <glib-object.h>
+#include <clutter/clutter.h>
+
+G_BEGIN_DECLS
+
+#define CHAMPLAIN_TYPE_ATLAS_CONTENT champlain_atlas_content_get_type ()
+
+#define CHAMPLAIN_IS_ATLAS_CONTENT(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CHAMPLAIN_TYPE_ATLAS_CONTENT))
+
+GType champlain_atlas_content_get_type (void);
+
+ClutterContent *champlain_texture_atlas_create_content (const guint8 *data,
+    CoglPixelFormat format,
+    gint width,
+    gint height,
+    gint rowstride);
+
+G_END_DECLS
+
+#endif /* __CHAMPLAIN_TEXTURE_ATLAS_H__ */
@@ -23,15 +23,48 @@
  * This class defines properties and methods commons to all caches (that is, map
  * sources that permit storage and retrieval of tiles). Tiles are typically
  * stored by #ChamplainTileSource objects.
+ *
+ * When a cache finds that a tile it loaded is expired, it passes the tile to
+ * the next source in the chain which validates it. By default the tile isn't
+ * displayed until the validation finishes; with
+ * #ChamplainTileCache:revalidate-in-background set, the cached content is
+ * displayed immediately and replaced only when the next source delivers a
+ * new version of the tile.
+ *
+ * Caches also remember tiles the tile source reported as missing (see
+ * champlain_tile_cache_store_missing_tile()) until the expiration time of
+ * the tile so that they aren't requested again on every load.
  */
 
 #include "champlain-tile-cache.h"
+#include "champlain-private.h"
+
+/* Kept outside of ChamplainTileCacheClass so its layout doesn't change */
+typedef struct
+{
+  ChamplainTileCacheStoreMissingTileFunc store_missing_tile;
+} ChamplainTileCacheClassPrivate;
 
-G_DEFINE_ABSTRACT_TYPE (ChamplainTileCache, champlain_tile_cache, CHAMPLAIN_TYPE_MAP_SOURCE)
+G_DEFINE_ABSTRACT_TYPE_WITH_CODE (ChamplainTileCache, champlain_tile_cache, CHAMPLAIN_TYPE_MAP_SOURCE,
+    g_type_add_class_private (g_define_type_id, sizeof (ChamplainTileCacheClassPrivate)))
 
 #define GET_PRIVATE(obj) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((obj), CHAMPLAIN_TYPE_TILE_CACHE, ChamplainTileCachePrivate))
 
+#define GET_CLASS_PRIVATE(klass) \
+  (G_TYPE_CLASS_GET_PRIVATE ((klass), CHAMPLAIN_TYPE_TILE_CACHE, ChamplainTileCacheClassPrivate))
+
+enum
+{
+  PROP_0,
+  PROP_REVALIDATE_IN_BACKGROUND
+};
+
+struct _ChamplainTileCachePrivate
+{
+  gboolean revalidate_in_background;
+};
+
 
 static const gchar *get_id (ChamplainMapSource * map_source);
 static const gchar *get_name (ChamplainMapSource *map_source);
@@ -41,6 +74,48 @@ static guint get_min_zoom_level (ChamplainMapSource *map_source);
 static guint get_max_zoom_level (ChamplainMapSource *map_source);
 static guint get_tile_size (ChamplainMapSource *map_source);
 static ChamplainMapProjection get_projection (ChamplainMapSource *map_source);
+static void store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
+
+
+static void
+champlain_tile_cache_get_property (GObject *object,
+    guint property_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainTileCache *tile_cache = CHAMPLAIN_TILE_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_REVALIDATE_IN_BACKGROUND:
+      g_value_set_boolean (value, champlain_tile_cache_get_revalidate_in_background (tile_cache));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
+
+
+static void
+champlain_tile_cache_set_property (GObject *object,
+    guint property_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainTileCache *tile_cache = CHAMPLAIN_TILE_CACHE (object);
+
+  switch (property_id)
+    {
+    case PROP_REVALIDATE_IN_BACKGROUND:
+      champlain_tile_cache_set_revalidate_in_background (tile_cache, g_value_get_boolean (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+    }
+}
 
 
 static void
@@ -71,9 +146,13 @@ champlain_tile_cache_class_init (ChamplainTileCacheClass *klass)
   ChamplainMapSourceClass *map_source_class = CHAMPLAIN_MAP_SOURCE_CLASS (klass);
   ChamplainTileCacheClass *tile_cache_class = CHAMPLAIN_TILE_CACHE_CLASS (klass);
 
+  g_type_class_add_private (klass, sizeof (ChamplainTileCachePrivate));
+
   object_class->finalize = champlain_tile_cache_finalize;
   object_class->dispose = champlain_tile_cache_dispose;
   object_class->constructed = champlain_tile_cache_constructed;
+  object_class->get_property = champlain_tile_cache_get_property;
+  object_class->set_property = champlain_tile_cache_set_property;
 
   map_source_class->get_id = get_id;
   map_source_class->get_name = get_name;
@@ -89,12 +168,45 @@ champlain_tile_cache_class_init (ChamplainTileCacheClass *klass)
   tile_cache_class->refresh_tile_time = NULL;
   tile_cache_class->on_tile_filled = NULL;
   tile_cache_class->store_tile = NULL;
+  GET_CLASS_PRIVATE (klass)->store_missing_tile = store_missing_tile;
+
+  /**
+   * ChamplainTileCache:revalidate-in-background:
+   *
+   * Whether expired tiles are displayed immediately while they are being
+   * validated by the next source in the chain
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_REVALIDATE_IN_BACKGROUND,
+      g_param_spec_boolean ("revalidate-in-background",
+          "Revalidate in background",
+          "Display expired tiles while they are validated",
+          FALSE,
+          G_PARAM_READWRITE));
+}
+
+
+void
+champlain_tile_cache_class_set_store_missing_tile (ChamplainTileCacheClass *klass,
+    ChamplainTileCacheStoreMissingTileFunc func)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_CACHE_CLASS (klass));
+  g_return_if_fail (func != NULL);
+
+  GET_CLASS_PRIVATE (klass)->store_missing_tile = func;
 }
 
 
 static void
 champlain_tile_cache_init (ChamplainTileCache *tile_cache)
 {
+  ChamplainTileCachePrivate *priv = GET_PRIVATE (tile_cache);
+
+  tile_cache->priv = priv;
+
+  priv->revalidate_in_background = FALSE;
 }
 
 
@@ -165,6 +277,152 @@ champlain_tile_cache_on_tile_filled (ChamplainTileCache *tile_cache,
 }
 
 
+/**
+ * champlain_tile_cache_store_missing_tile:
+ * @tile_cache: a #ChamplainTileCache
+ * @tile: a #ChamplainTile the tile source doesn't provide
+ *
+ * Records that the tile source doesn't provide the tile until the expiration
+ * time of the tile. Tiles recorded as missing are filled by
+ * champlain_tile_cache_fill_missing_tile() without asking the tile source.
+ * Like champlain_tile_cache_store_tile(), the call is passed to the next
+ * source in the chain when it is a tile cache.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_cache_store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_CACHE (tile_cache));
+
+  GET_CLASS_PRIVATE (CHAMPLAIN_TILE_CACHE_GET_CLASS (tile_cache))->store_missing_tile (tile_cache, tile);
+}
+
+
+/**
+ * champlain_tile_cache_fill_missing_tile:
+ * @tile_cache: a #ChamplainTileCache
+ * @tile: a #ChamplainTile recorded as missing
+ *
+ * Fills a tile recorded as missing by the cache. The tile source following
+ * the caches in the chain, which reported the tile as missing, is skipped
+ * and the tile is passed to the source after it, e.g. a fallback tile source
+ * or the #ChamplainNullTileSource rendering the error tile. Without such a
+ * source the tile stays transparent.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_cache_fill_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_CACHE (tile_cache));
+  g_return_if_fail (CHAMPLAIN_IS_TILE (tile));
+
+  ChamplainMapSource *map_source = CHAMPLAIN_MAP_SOURCE (tile_cache);
+  ChamplainMapSource *next_source = NULL;
+
+  /* skip the caches and the tile source which reported the tile as missing */
+  do
+    map_source = champlain_map_source_get_next_source (map_source);
+  while (CHAMPLAIN_IS_TILE_CACHE (map_source));
+
+  if (map_source)
+    next_source = champlain_map_source_get_next_source (map_source);
+
+  if (CHAMPLAIN_IS_MAP_SOURCE (next_source))
+    champlain_map_source_fill_tile (next_source, tile);
+  else
+    {
+      /* handlers of the DONE state may drop the last reference to the tile */
+      g_object_ref (tile);
+      champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
+      champlain_tile_display_content (tile);
+      g_object_unref (tile);
+    }
+}
+
+
+static void
+store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  ChamplainMapSource *next_source = champlain_map_source_get_next_source (CHAMPLAIN_MAP_SOURCE (tile_cache));
+
+  if (CHAMPLAIN_IS_TILE_CACHE (next_source))
+    champlain_tile_cache_store_missing_tile (CHAMPLAIN_TILE_CACHE (next_source), tile);
+}
+
+
+/**
+ * champlain_tile_cache_get_revalidate_in_background:
+ * @tile_cache: a #ChamplainTileCache
+ *
+ * Gets whether expired tiles are displayed while they are being validated.
+ *
+ * Returns: %TRUE when expired tiles are displayed immediately
+ *
+ * Since: 0.12.6
+ */
+gboolean
+champlain_tile_cache_get_revalidate_in_background (ChamplainTileCache *tile_cache)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_TILE_CACHE (tile_cache), FALSE);
+
+  return tile_cache->priv->revalidate_in_background;
+}
+
+
+/**
+ * champlain_tile_cache_set_revalidate_in_background:
+ * @tile_cache: a #ChamplainTileCache
+ * @revalidate: whether expired tiles should be displayed immediately
+ *
+ * Sets whether expired tiles are displayed immediately while they are being
+ * validated by the next source in the chain. The displayed content is
+ * replaced only when a new version of the tile is received.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_cache_set_revalidate_in_background (ChamplainTileCache *tile_cache,
+    gboolean revalidate)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_CACHE (tile_cache));
+
+  tile_cache->priv->revalidate_in_background = revalidate;
+  g_object_notify (G_OBJECT (tile_cache), "revalidate-in-background");
+}
+
+
+/**
+ * champlain_tile_cache_display_stale_tile:
+ * @tile_cache: a #ChamplainTileCache
+ * @tile: a loaded #ChamplainTile which is about to be validated
+ *
+ * Displays the content of an expired tile when
+ * #ChamplainTileCache:revalidate-in-background is set. Tile caches should
+ * call this function before passing an expired tile to the next source.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_cache_display_stale_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_CACHE (tile_cache));
+  g_return_if_fail (CHAMPLAIN_IS_TILE (tile));
+
+  if (!tile_cache->priv->revalidate_in_background)
+    return;
+
+  /* the tile stays in the LOADED state so the next source validates it */
+  champlain_tile_set_fade_in (tile, FALSE);
+  champlain_tile_display_content (tile);
+}
+
+
 static const gchar *
 get_id (ChamplainMapSource *map_source)
 {
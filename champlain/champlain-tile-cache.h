@@ -89,6 +89,16 @@ void champlain_tile_cache_refresh_tile_time (ChamplainTileCache *tile_cache,
     ChamplainTile *tile);
 void champlain_tile_cache_on_tile_filled (ChamplainTileCache *tile_cache,
     ChamplainTile *tile);
+void champlain_tile_cache_store_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
+void champlain_tile_cache_fill_missing_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
+
+gboolean champlain_tile_cache_get_revalidate_in_background (ChamplainTileCache *tile_cache);
+void champlain_tile_cache_set_revalidate_in_background (ChamplainTileCache *tile_cache,
+    gboolean revalidate);
+void champlain_tile_cache_display_stale_tile (ChamplainTileCache *tile_cache,
+    ChamplainTile *tile);
 
 G_END_DECLS
 
@@ -0,0 +1,1035 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * SECTION:champlain-tile-downloader
+ * @short_description: Downloads the tiles of a region into the file cache
+ *
+ * #ChamplainTileDownloader downloads all tiles of a region and a range of
+ * zoom levels into the #ChamplainFileCache of a map source chain so that
+ * they are available offline later. It uses the #ChamplainNetworkTileSource
+ * and the #ChamplainFileCache found in the chain; the downloaded data is
+ * stored as it is, without being rendered, and no actors are created so
+ * the download doesn't interfere with a #ChamplainView.
+ *
+ * Tiles which are already stored in the file cache are skipped. A download
+ * interrupted by champlain_tile_downloader_stop() continues with
+ * champlain_tile_downloader_resume(); after a restart of the application,
+ * starting the same region again downloads only the tiles still missing.
+ */
+
+#include "config.h"
+
+#include "champlain-tile-downloader.h"
+
+#define DEBUG_FLAG CHAMPLAIN_DEBUG_LOADING
+#include "champlain-debug.h"
+
+#include "champlain.h"
+#include "champlain-marshal.h"
+#include "champlain-private.h"
+#include "champlain-session-pool.h"
+
+#include <glib.h>
+#include <math.h>
+
+G_DEFINE_TYPE (ChamplainTileDownloader, champlain_tile_downloader, G_TYPE_OBJECT);
+
+#define GET_PRIVATE(obj) \
+  (G_TYPE_INSTANCE_GET_PRIVATE ((obj), CHAMPLAIN_TYPE_TILE_DOWNLOADER, ChamplainTileDownloaderPrivate))
+
+/* number of tiles checked for presence in the cache at once */
+#define CHECK_BATCH_SIZE 64
+
+enum
+{
+  /* normal signals */
+  PROGRESS,
+  COMPLETED,
+  LAST_SIGNAL
+};
+
+enum
+{
+  PROP_0,
+  PROP_MAP_SOURCE,
+  PROP_MAX_DOWNLOADS,
+  PROP_RATE_LIMIT,
+  PROP_RUNNING
+};
+
+static guint signals[LAST_SIGNAL] = { 0, };
+
+typedef struct
+{
+  guint zoom_level;
+  gint x;
+  gint y;
+} TileCoords;
+
+struct _ChamplainTileDownloaderPrivate
+{
+  ChamplainMapSource *map_source;
+  guint max_downloads;
+  gdouble rate_limit;
+  gboolean running;
+
+  /* found in map_source when the download starts */
+  ChamplainNetworkTileSource *tile_source;
+  ChamplainFileCache *file_cache;
+  SoupSession *soup_session;
+
+  /* the region being downloaded */
+  ChamplainBoundingBox *bbox;
+  guint min_zoom_level;
+  guint max_zoom_level;
+  /* incremented by every start so that results of checks of the previous
+   * region are ignored */
+  guint generation;
+
+  /* the next tile to check and the tile range of its zoom level */
+  guint zoom_level;
+  gint x;
+  gint y;
+  gint x_min;
+  gint x_max;
+  gint y_min;
+  gint y_max;
+  gboolean enumerated;
+
+  guint total;
+  guint processed;
+
+  /* TileCoords of the tiles not found in the cache */
+  GArray *missing;
+  GThreadPool *check_thread;
+  gboolean checking;
+  /* Download in flight */
+  GPtrArray *downloads;
+  gint64 next_download_time;
+  guint rate_timeout;
+};
+
+/* Checks which tiles of a batch are missing in the cache, runs in the
+ * check thread */
+typedef struct
+{
+  ChamplainTileDownloader *downloader;
+  guint generation;
+  GArray *coords;
+  GPtrArray *filenames;
+  /* result */
+  GArray *missing;
+} CheckJob;
+
+typedef struct
+{
+  ChamplainTileDownloader *downloader;
+  guint generation;
+  SoupMessage *msg;
+  TileCoords coords;
+} Download;
+
+static void check_tiles (CheckJob *job,
+    gpointer user_data);
+static void schedule (ChamplainTileDownloader *downloader);
+
+
+static void
+champlain_tile_downloader_get_property (GObject *object,
+    guint prop_id,
+    GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainTileDownloader *downloader = CHAMPLAIN_TILE_DOWNLOADER (object);
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  switch (prop_id)
+    {
+    case PROP_MAP_SOURCE:
+      g_value_set_object (value, priv->map_source);
+      break;
+
+    case PROP_MAX_DOWNLOADS:
+      g_value_set_uint (value, priv->max_downloads);
+      break;
+
+    case PROP_RATE_LIMIT:
+      g_value_set_double (value, priv->rate_limit);
+      break;
+
+    case PROP_RUNNING:
+      g_value_set_boolean (value, priv->running);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+
+static void
+champlain_tile_downloader_set_property (GObject *object,
+    guint prop_id,
+    const GValue *value,
+    GParamSpec *pspec)
+{
+  ChamplainTileDownloader *downloader = CHAMPLAIN_TILE_DOWNLOADER (object);
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  switch (prop_id)
+    {
+    case PROP_MAP_SOURCE:
+      priv->map_source = g_value_dup_object (value);
+      break;
+
+    case PROP_MAX_DOWNLOADS:
+      champlain_tile_downloader_set_max_downloads (downloader,
+          g_value_get_uint (value));
+      break;
+
+    case PROP_RATE_LIMIT:
+      champlain_tile_downloader_set_rate_limit (downloader,
+          g_value_get_double (value));
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
+}
+
+
+static void
+release_sources (ChamplainTileDownloader *downloader)
+{
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  if (priv->soup_session)
+    {
+      champlain_session_pool_release (priv->soup_session);
+      priv->soup_session = NULL;
+    }
+
+  if (priv->tile_source)
+    {
+      g_object_unref (priv->tile_source);
+      priv->tile_source = NULL;
+    }
+
+  if (priv->file_cache)
+    {
+      g_object_unref (priv->file_cache);
+      priv->file_cache = NULL;
+    }
+}
+
+
+static void
+champlain_tile_downloader_dispose (GObject *object)
+{
+  ChamplainTileDownloader *downloader = CHAMPLAIN_TILE_DOWNLOADER (object);
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  /* downloads and checks hold a reference so none of them is in flight */
+  if (priv->rate_timeout != 0)
+    {
+      g_source_remove (priv->rate_timeout);
+      priv->rate_timeout = 0;
+    }
+
+  if (priv->check_thread)
+    {
+      g_thread_pool_free (priv->check_thread, FALSE, TRUE);
+      priv->check_thread = NULL;
+    }
+
+  release_sources (downloader);
+
+  if (priv->map_source)
+    {
+      g_object_unref (priv->map_source);
+      priv->map_source = NULL;
+    }
+
+  G_OBJECT_CLASS (champlain_tile_downloader_parent_class)->dispose (object);
+}
+
+
+static void
+champlain_tile_downloader_finalize (GObject *object)
+{
+  ChamplainTileDownloaderPrivate *priv = CHAMPLAIN_TILE_DOWNLOADER (object)->priv;
+
+  if (priv->bbox)
+    champlain_bounding_box_free (priv->bbox);
+  g_array_unref (priv->missing);
+  g_ptr_array_unref (priv->downloads);
+
+  G_OBJECT_CLASS (champlain_tile_downloader_parent_class)->finalize (object);
+}
+
+
+static void
+champlain_tile_downloader_class_init (ChamplainTileDownloaderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  g_type_class_add_private (klass, sizeof (ChamplainTileDownloaderPrivate));
+
+  object_class->finalize = champlain_tile_downloader_finalize;
+  object_class->dispose = champlain_tile_downloader_dispose;
+  object_class->get_property = champlain_tile_downloader_get_property;
+  object_class->set_property = champlain_tile_downloader_set_property;
+
+  /**
+   * ChamplainTileDownloader:map-source:
+   *
+   * The map source chain whose tiles are downloaded
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_MAP_SOURCE,
+      g_param_spec_object ("map-source",
+          "Map source",
+          "The map source chain whose tiles are downloaded",
+          CHAMPLAIN_TYPE_MAP_SOURCE,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+  /**
+   * ChamplainTileDownloader:max-downloads:
+   *
+   * The maximum number of tiles downloaded at the same time
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_MAX_DOWNLOADS,
+      g_param_spec_uint ("max-downloads",
+          "Max downloads",
+          "The maximum number of tiles downloaded at the same time",
+          1,
+          G_MAXUINT,
+          2,
+          CHAMPLAIN_PARAM_READWRITE));
+
+  /**
+   * ChamplainTileDownloader:rate-limit:
+   *
+   * The maximum number of tile downloads started per second, 0 for no limit
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_RATE_LIMIT,
+      g_param_spec_double ("rate-limit",
+          "Rate limit",
+          "The maximum number of tile downloads started per second",
+          0,
+          G_MAXDOUBLE,
+          5,
+          CHAMPLAIN_PARAM_READWRITE));
+
+  /**
+   * ChamplainTileDownloader:running:
+   *
+   * Whether the downloader is downloading a region
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_RUNNING,
+      g_param_spec_boolean ("running",
+          "Running",
+          "Whether the downloader is downloading a region",
+          FALSE,
+          CHAMPLAIN_PARAM_READABLE));
+
+  /**
+   * ChamplainTileDownloader::progress:
+   * @downloader: the #ChamplainTileDownloader that received the signal
+   * @processed: the number of tiles downloaded, skipped or failed so far
+   * @total: the number of tiles of the region
+   *
+   * The ::progress signal is emitted when tiles of the region have been
+   * processed.
+   *
+   * Since: 0.12.6
+   */
+  signals[PROGRESS] =
+    g_signal_new ("progress",
+        G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        0, NULL, NULL,
+        _champlain_marshal_VOID__UINT_UINT,
+        G_TYPE_NONE,
+        2, G_TYPE_UINT, G_TYPE_UINT);
+
+  /**
+   * ChamplainTileDownloader::completed:
+   * @downloader: the #ChamplainTileDownloader that received the signal
+   *
+   * The ::completed signal is emitted when all tiles of the region have been
+   * processed. It isn't emitted for downloads interrupted by
+   * champlain_tile_downloader_stop().
+   *
+   * Since: 0.12.6
+   */
+  signals[COMPLETED] =
+    g_signal_new ("completed",
+        G_OBJECT_CLASS_TYPE (object_class),
+        G_SIGNAL_RUN_LAST,
+        0, NULL, NULL,
+        g_cclosure_marshal_VOID__VOID,
+        G_TYPE_NONE,
+        0);
+}
+
+
+static void
+champlain_tile_downloader_init (ChamplainTileDownloader *downloader)
+{
+  ChamplainTileDownloaderPrivate *priv = GET_PRIVATE (downloader);
+
+  downloader->priv = priv;
+
+  priv->map_source = NULL;
+  priv->max_downloads = 2;
+  priv->rate_limit = 5;
+  priv->running = FALSE;
+  priv->tile_source = NULL;
+  priv->file_cache = NULL;
+  priv->soup_session = NULL;
+  priv->bbox = NULL;
+  priv->min_zoom_level = 0;
+  priv->max_zoom_level = 0;
+  priv->generation = 0;
+  priv->enumerated = TRUE;
+  priv->total = 0;
+  priv->processed = 0;
+  priv->missing = g_array_new (FALSE, FALSE, sizeof (TileCoords));
+  priv->check_thread = g_thread_pool_new ((GFunc) check_tiles, NULL, 1, FALSE, NULL);
+  priv->checking = FALSE;
+  priv->downloads = g_ptr_array_new ();
+  priv->next_download_time = 0;
+  priv->rate_timeout = 0;
+}
+
+
+/**
+ * champlain_tile_downloader_new:
+ * @map_source: the map source chain whose tiles are downloaded
+ *
+ * Creates a new instance of #ChamplainTileDownloader. The map source should
+ * contain a #ChamplainNetworkTileSource and a #ChamplainFileCache, e.g. a
+ * chain created by champlain_map_source_factory_create_cached_source().
+ *
+ * Returns: a new #ChamplainTileDownloader.
+ *
+ * Since: 0.12.6
+ */
+ChamplainTileDownloader *
+champlain_tile_downloader_new (ChamplainMapSource *map_source)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_MAP_SOURCE (map_source), NULL);
+
+  return g_object_new (CHAMPLAIN_TYPE_TILE_DOWNLOADER, "map-source", map_source, NULL);
+}
+
+
+/**
+ * champlain_tile_downloader_get_map_source:
+ * @downloader: a #ChamplainTileDownloader
+ *
+ * Gets the map source whose tiles are downloaded.
+ *
+ * Returns: (transfer none): the map source.
+ *
+ * Since: 0.12.6
+ */
+ChamplainMapSource *
+champlain_tile_downloader_get_map_source (ChamplainTileDownloader *downloader)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader), NULL);
+
+  return downloader->priv->map_source;
+}
+
+
+static void
+get_tile_range (ChamplainTileDownloader *downloader,
+    guint zoom_level,
+    gint *x_min,
+    gint *x_max,
+    gint *y_min,
+    gint *y_max)
+{
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+  ChamplainMapSource *map_source = priv->map_source;
+  ChamplainBoundingBox *bbox = priv->bbox;
+  guint size = champlain_map_source_get_tile_size (map_source);
+  gint columns = champlain_map_source_get_column_count (map_source, zoom_level);
+  gint rows = champlain_map_source_get_row_count (map_source, zoom_level);
+  gdouble left, right, top, bottom;
+
+  left = champlain_map_source_get_x (map_source, zoom_level, MIN (bbox->left, bbox->right));
+  right = champlain_map_source_get_x (map_source, zoom_level, MAX (bbox->left, bbox->right));
+  top = champlain_map_source_get_y (map_source, zoom_level, MAX (bbox->top, bbox->bottom));
+  bottom = champlain_map_source_get_y (map_source, zoom_level, MIN (bbox->top, bbox->bottom));
+
+  *x_min = CLAMP ((gint) floor (left / size), 0, columns - 1);
+  *x_max = CLAMP ((gint) floor (right / size), 0, columns - 1);
+  *y_min = CLAMP ((gint) floor (top / size), 0, rows - 1);
+  *y_max = CLAMP ((gint) floor (bottom / size), 0, rows - 1);
+}
+
+
+static void
+set_zoom_level (ChamplainTileDownloader *downloader,
+    guint zoom_level)
+{
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  priv->zoom_level = zoom_level;
+  get_tile_range (downloader, zoom_level,
+      &priv->x_min, &priv->x_max, &priv->y_min, &priv->y_max);
+  priv->x = priv->x_min;
+  priv->y = priv->y_min;
+}
+
+
+/* Returns the next tile of the region, FALSE when all have been returned */
+static gboolean
+next_tile (ChamplainTileDownloader *downloader,
+    TileCoords *coords)
+{
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  if (priv->enumerated)
+    return FALSE;
+
+  coords->zoom_level = priv->zoom_level;
+  coords->x = priv->x;
+  coords->y = priv->y;
+
+  if (++priv->x > priv->x_max)
+    {
+      priv->x = priv->x_min;
+      if (++priv->y > priv->y_max)
+        {
+          if (priv->zoom_level < priv->max_zoom_level)
+            set_zoom_level (downloader, priv->zoom_level + 1);
+          else
+            priv->enumerated = TRUE;
+        }
+    }
+
+  return TRUE;
+}
+
+
+static void
+free_check_job (CheckJob *job)
+{
+  g_object_unref (job->downloader);
+  g_array_unref (job->coords);
+  g_ptr_array_unref (job->filenames);
+  g_array_unref (job->missing);
+  g_slice_free (CheckJob, job);
+}
+
+
+/* Called in the main loop when the check thread has checked a batch */
+static gboolean
+check_finished_cb (CheckJob *job)
+{
+  ChamplainTileDownloader *downloader = job->downloader;
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  if (job->generation == priv->generation)
+    {
+      priv->checking = FALSE;
+
+      g_array_append_vals (priv->missing, job->missing->data, job->missing->len);
+
+      if (job->missing->len < job->coords->len)
+        {
+          priv->processed += job->coords->len - job->missing->len;
+          g_signal_emit (downloader, signals[PROGRESS], 0, priv->processed, priv->total);
+        }
+
+      schedule (downloader);
+    }
+
+  free_check_job (job);
+
+  return FALSE;
+}
+
+
+/* Runs in the check thread */
+static void
+check_tiles (CheckJob *job,
+    G_GNUC_UNUSED gpointer user_data)
+{
+  guint i;
+
+  for (i = 0; i < job->coords->len; i++)
+    {
+      const gchar *filename = g_ptr_array_index (job->filenames, i);
+
+      if (!g_file_test (filename, G_FILE_TEST_EXISTS))
+        g_array_append_val (job->missing, g_array_index (job->coords, TileCoords, i));
+    }
+
+  g_idle_add ((GSourceFunc) check_finished_cb, job);
+}
+
+
+static void
+check_next_batch (ChamplainTileDownloader *downloader)
+{
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+  CheckJob *job;
+  TileCoords coords;
+
+  job = g_slice_new (CheckJob);
+  job->downloader = g_object_ref (downloader);
+  job->generation = priv->generation;
+  job->coords = g_array_sized_new (FALSE, FALSE, sizeof (TileCoords), CHECK_BATCH_SIZE);
+  job->filenames = g_ptr_array_new_with_free_func (g_free);
+  job->missing = g_array_new (FALSE, FALSE, sizeof (TileCoords));
+
+  while (job->coords->len < CHECK_BATCH_SIZE && next_tile (downloader, &coords))
+    {
+      g_array_append_val (job->coords, coords);
+      g_ptr_array_add (job->filenames,
+          champlain_file_cache_get_tile_filename (priv->file_cache,
+              coords.zoom_level, coords.x, coords.y));
+    }
+
+  priv->checking = TRUE;
+  g_thread_pool_push (priv->check_thread, job, NULL);
+}
+
+
+static void
+free_download (Download *download)
+{
+  g_object_unref (download->downloader);
+  g_slice_free (Download, download);
+}
+
+
+static void
+download_finished_cb (G_GNUC_UNUSED SoupSession *session,
+    SoupMessage *msg,
+    Download *download)
+{
+  ChamplainTileDownloader *downloader = download->downloader;
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+  TileCoords *coords = &download->coords;
+
+  g_ptr_array_remove_fast (priv->downloads, download);
+
+  if (msg->status_code == SOUP_STATUS_CANCELLED)
+    {
+      /* stopped, the tile is downloaded again on resume */
+      if (download->generation == priv->generation)
+        g_array_append_val (priv->missing, *coords);
+      free_download (download);
+      return;
+    }
+
+  if (SOUP_STATUS_IS_SUCCESSFUL (msg->status_code) && msg->response_body->length > 0)
+    {
+      SoupBuffer *buffer = soup_message_body_flatten (msg->response_body);
+      GBytes *bytes = g_bytes_new (buffer->data, buffer->length);
+
+      champlain_file_cache_store_tile_data (priv->file_cache,
+          coords->zoom_level, coords->x, coords->y,
+          soup_message_headers_get_one (msg->response_headers, "ETag"),
+          bytes);
+
+      g_bytes_unref (bytes);
+      soup_buffer_free (buffer);
+    }
+  else
+    DEBUG ("Download of tile %u, %d, %d failed: %d %s", coords->zoom_level,
+        coords->x, coords->y, msg->status_code, msg->reason_phrase);
+
+  priv->processed++;
+  g_signal_emit (downloader, signals[PROGRESS], 0, priv->processed, priv->total);
+
+  schedule (downloader);
+  free_download (download);
+}
+
+
+static void
+start_download (ChamplainTileDownloader *downloader,
+    TileCoords *coords)
+{
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+  Download *download;
+  SoupMessage *msg;
+  gchar *uri;
+
+  uri = champlain_network_tile_source_get_tile_uri (priv->tile_source,
+        coords->zoom_level, coords->x, coords->y);
+  msg = uri ? soup_message_new (SOUP_METHOD_GET, uri) : NULL;
+
+  if (!msg)
+    {
+      DEBUG ("Invalid tile URI %s", uri);
+      g_free (uri);
+      priv->processed++;
+      g_signal_emit (downloader, signals[PROGRESS], 0, priv->processed, priv->total);
+      return;
+    }
+
+  DEBUG ("Downloading %s", uri);
+  g_free (uri);
+
+  download = g_slice_new (Download);
+  download->downloader = g_object_ref (downloader);
+  download->generation = priv->generation;
+  download->msg = msg;
+  download->coords = *coords;
+  g_ptr_array_add (priv->downloads, download);
+
+  soup_session_queue_message (priv->soup_session, msg,
+      (SoupSessionCallback) download_finished_cb, download);
+}
+
+
+static gboolean
+rate_timeout_cb (ChamplainTileDownloader *downloader)
+{
+  downloader->priv->rate_timeout = 0;
+  schedule (downloader);
+
+  return FALSE;
+}
+
+
+/* Starts as many downloads and checks as the limits allow */
+static void
+schedule (ChamplainTileDownloader *downloader)
+{
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  if (!priv->running)
+    return;
+
+  while (priv->downloads->len < priv->max_downloads && priv->missing->len > 0)
+    {
+      TileCoords coords;
+
+      if (priv->rate_limit > 0)
+        {
+          gint64 now = g_get_monotonic_time ();
+
+          if (now < priv->next_download_time)
+            {
+              if (priv->rate_timeout == 0)
+                priv->rate_timeout = g_timeout_add ((priv->next_download_time - now) / 1000 + 1,
+                      (GSourceFunc) rate_timeout_cb, downloader);
+              break;
+            }
+
+          priv->next_download_time = now + (gint64) (G_USEC_PER_SEC / priv->rate_limit);
+        }
+
+      coords = g_array_index (priv->missing, TileCoords, priv->missing->len - 1);
+      g_array_set_size (priv->missing, priv->missing->len - 1);
+      start_download (downloader, &coords);
+    }
+
+  /* keep the checks ahead of the downloads */
+  if (!priv->checking && !priv->enumerated && priv->missing->len < CHECK_BATCH_SIZE)
+    check_next_batch (downloader);
+
+  if (priv->enumerated && !priv->checking &&
+      priv->missing->len == 0 && priv->downloads->len == 0)
+    {
+      DEBUG ("Download of %u tiles completed", priv->total);
+
+      priv->running = FALSE;
+      g_object_notify (G_OBJECT (downloader), "running");
+      g_signal_emit (downloader, signals[COMPLETED], 0);
+    }
+}
+
+
+/**
+ * champlain_tile_downloader_start:
+ * @downloader: a #ChamplainTileDownloader
+ * @bbox: the region to download
+ * @min_zoom_level: the lowest zoom level to download
+ * @max_zoom_level: the highest zoom level to download
+ *
+ * Starts downloading the tiles of the region at the given zoom levels which
+ * are not in the file cache yet. A download in progress is stopped first.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_downloader_start (ChamplainTileDownloader *downloader,
+    ChamplainBoundingBox *bbox,
+    guint min_zoom_level,
+    guint max_zoom_level)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader));
+  g_return_if_fail (bbox != NULL);
+  g_return_if_fail (min_zoom_level <= max_zoom_level);
+
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+  ChamplainMapSource *source;
+  guint zoom_level;
+
+  champlain_tile_downloader_stop (downloader);
+  release_sources (downloader);
+
+  source = champlain_map_source_find_by_type (priv->map_source, CHAMPLAIN_TYPE_NETWORK_TILE_SOURCE);
+  if (!source)
+    {
+      g_warning ("The map source doesn't contain a network tile source");
+      return;
+    }
+  priv->tile_source = g_object_ref (source);
+
+  source = champlain_map_source_find_by_type (priv->map_source, CHAMPLAIN_TYPE_FILE_CACHE);
+  if (!source)
+    {
+      g_warning ("The map source doesn't contain a file cache");
+      release_sources (downloader);
+      return;
+    }
+  priv->file_cache = g_object_ref (source);
+
+  /* share the connections and limits with the tile source */
+  priv->soup_session = champlain_session_pool_acquire (
+        champlain_network_tile_source_get_proxy_uri (priv->tile_source),
+        champlain_network_tile_source_get_max_conns_per_host (priv->tile_source),
+        champlain_network_tile_source_get_max_conns (priv->tile_source));
+
+  if (priv->bbox)
+    champlain_bounding_box_free (priv->bbox);
+  priv->bbox = champlain_bounding_box_copy (bbox);
+  priv->min_zoom_level = MAX (min_zoom_level,
+        champlain_map_source_get_min_zoom_level (priv->map_source));
+  priv->max_zoom_level = MIN (max_zoom_level,
+        champlain_map_source_get_max_zoom_level (priv->map_source));
+  priv->generation++;
+
+  priv->total = 0;
+  for (zoom_level = priv->min_zoom_level; zoom_level <= priv->max_zoom_level; zoom_level++)
+    {
+      gint x_min, x_max, y_min, y_max;
+
+      get_tile_range (downloader, zoom_level, &x_min, &x_max, &y_min, &y_max);
+      priv->total += (x_max - x_min + 1) * (y_max - y_min + 1);
+    }
+
+  priv->processed = 0;
+  priv->checking = FALSE;
+  g_array_set_size (priv->missing, 0);
+  priv->enumerated = priv->min_zoom_level > priv->max_zoom_level;
+  if (!priv->enumerated)
+    set_zoom_level (downloader, priv->min_zoom_level);
+
+  DEBUG ("Downloading %u tiles", priv->total);
+
+  champlain_tile_downloader_resume (downloader);
+}
+
+
+/**
+ * champlain_tile_downloader_stop:
+ * @downloader: a #ChamplainTileDownloader
+ *
+ * Stops the download, cancelling the downloads in flight. The download can
+ * be continued with champlain_tile_downloader_resume().
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_downloader_stop (ChamplainTileDownloader *downloader)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader));
+
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+  GPtrArray *downloads;
+  guint i;
+
+  if (!priv->running)
+    return;
+
+  priv->running = FALSE;
+
+  if (priv->rate_timeout != 0)
+    {
+      g_source_remove (priv->rate_timeout);
+      priv->rate_timeout = 0;
+    }
+
+  /* the callbacks remove the cancelled downloads from priv->downloads */
+  downloads = g_ptr_array_sized_new (priv->downloads->len);
+  for (i = 0; i < priv->downloads->len; i++)
+    g_ptr_array_add (downloads, g_ptr_array_index (priv->downloads, i));
+  for (i = 0; i < downloads->len; i++)
+    {
+      Download *download = g_ptr_array_index (downloads, i);
+
+      soup_session_cancel_message (priv->soup_session, download->msg, SOUP_STATUS_CANCELLED);
+    }
+  g_ptr_array_unref (downloads);
+
+  g_object_notify (G_OBJECT (downloader), "running");
+}
+
+
+/**
+ * champlain_tile_downloader_resume:
+ * @downloader: a #ChamplainTileDownloader
+ *
+ * Continues a download stopped by champlain_tile_downloader_stop().
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_downloader_resume (ChamplainTileDownloader *downloader)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader));
+
+  ChamplainTileDownloaderPrivate *priv = downloader->priv;
+
+  if (priv->running || !priv->soup_session)
+    return;
+
+  priv->running = TRUE;
+  g_object_notify (G_OBJECT (downloader), "running");
+
+  schedule (downloader);
+}
+
+
+/**
+ * champlain_tile_downloader_is_running:
+ * @downloader: a #ChamplainTileDownloader
+ *
+ * Checks whether the downloader is downloading a region.
+ *
+ * Returns: TRUE when a download is in progress, FALSE otherwise.
+ *
+ * Since: 0.12.6
+ */
+gboolean
+champlain_tile_downloader_is_running (ChamplainTileDownloader *downloader)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader), FALSE);
+
+  return downloader->priv->running;
+}
+
+
+/**
+ * champlain_tile_downloader_get_max_downloads:
+ * @downloader: a #ChamplainTileDownloader
+ *
+ * Gets the maximum number of tiles downloaded at the same time.
+ *
+ * Returns: the maximum number of downloads.
+ *
+ * Since: 0.12.6
+ */
+guint
+champlain_tile_downloader_get_max_downloads (ChamplainTileDownloader *downloader)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader), 0);
+
+  return downloader->priv->max_downloads;
+}
+
+
+/**
+ * champlain_tile_downloader_set_max_downloads:
+ * @downloader: a #ChamplainTileDownloader
+ * @max_downloads: the maximum number of downloads
+ *
+ * Sets the maximum number of tiles downloaded at the same time. The
+ * connection limits of the network tile source apply as well.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_downloader_set_max_downloads (ChamplainTileDownloader *downloader,
+    guint max_downloads)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader));
+  g_return_if_fail (max_downloads > 0);
+
+  downloader->priv->max_downloads = max_downloads;
+  g_object_notify (G_OBJECT (downloader), "max-downloads");
+
+  schedule (downloader);
+}
+
+
+/**
+ * champlain_tile_downloader_get_rate_limit:
+ * @downloader: a #ChamplainTileDownloader
+ *
+ * Gets the maximum number of tile downloads started per second.
+ *
+ * Returns: the rate limit, 0 when there is no limit.
+ *
+ * Since: 0.12.6
+ */
+gdouble
+champlain_tile_downloader_get_rate_limit (ChamplainTileDownloader *downloader)
+{
+  g_return_val_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader), 0);
+
+  return downloader->priv->rate_limit;
+}
+
+
+/**
+ * champlain_tile_downloader_set_rate_limit:
+ * @downloader: a #ChamplainTileDownloader
+ * @rate_limit: the maximum number of downloads started per second, 0 for
+ * no limit
+ *
+ * Sets the maximum number of tile downloads started per second. Please
+ * respect the usage policy of the tile server when downloading large
+ * regions.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_downloader_set_rate_limit (ChamplainTileDownloader *downloader,
+    gdouble rate_limit)
+{
+  g_return_if_fail (CHAMPLAIN_IS_TILE_DOWNLOADER (downloader));
+  g_return_if_fail (rate_limit >= 0);
+
+  downloader->priv->rate_limit = rate_limit;
+  g_object_notify (G_OBJECT (downloader), "rate-limit");
+}
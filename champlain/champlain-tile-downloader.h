@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#if !defined (__CHAMPLAIN_CHAMPLAIN_H_INSIDE__) && !defined (CHAMPLAIN_COMPILATION)
+#error "Only <champlain/champlain.h> can be included directly."
+#endif
+
+#ifndef _CHAMPLAIN_TILE_DOWNLOADER_H_
+#define _CHAMPLAIN_TILE_DOWNLOADER_H_
+
+#include <glib-object.h>
+
+#include <champlain/champlain-bounding-box.h>
+#include <champlain/champlain-map-source.h>
+
+G_BEGIN_DECLS
+
+#define CHAMPLAIN_TYPE_TILE_DOWNLOADER champlain_tile_downloader_get_type ()
+
+#define CHAMPLAIN_TILE_DOWNLOADER(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CHAMPLAIN_TYPE_TILE_DOWNLOADER, ChamplainTileDownloader))
+
+#define CHAMPLAIN_TILE_DOWNLOADER_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), CHAMPLAIN_TYPE_TILE_DOWNLOADER, ChamplainTileDownloaderClass))
+
+#define CHAMPLAIN_IS_TILE_DOWNLOADER(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CHAMPLAIN_TYPE_TILE_DOWNLOADER))
+
+#define CHAMPLAIN_IS_TILE_DOWNLOADER_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), CHAMPLAIN_TYPE_TILE_DOWNLOADER))
+
+#define CHAMPLAIN_TILE_DOWNLOADER_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), CHAMPLAIN_TYPE_TILE_DOWNLOADER, ChamplainTileDownloaderClass))
+
+typedef struct _ChamplainTileDownloaderPrivate ChamplainTileDownloaderPrivate;
+
+typedef struct _ChamplainTileDownloader ChamplainTileDownloader;
+typedef struct _ChamplainTileDownloaderClass ChamplainTileDownloaderClass;
+
+/**
+ * ChamplainTileDownloader:
+ *
+ * The #ChamplainTileDownloader structure contains only private data
+ * and should be accessed using the provided API
+ *
+ * Since: 0.12.6
+ */
+struct _ChamplainTileDownloader
+{
+  GObject parent_instance;
+
+  ChamplainTileDownloaderPrivate *priv;
+};
+
+struct _ChamplainTileDownloaderClass
+{
+  GObjectClass parent_class;
+};
+
+GType champlain_tile_downloader_get_type (void);
+
+ChamplainTileDownloader *champlain_tile_downloader_new (ChamplainMapSource *map_source);
+
+ChamplainMapSource *champlain_tile_downloader_get_map_source (ChamplainTileDownloader *downloader);
+
+void champlain_tile_downloader_start (ChamplainTileDownloader *downloader,
+    ChamplainBoundingBox *bbox,
+    guint min_zoom_level,
+    guint max_zoom_level);
+void champlain_tile_downloader_stop (ChamplainTileDownloader *downloader);
+void champlain_tile_downloader_resume (ChamplainTileDownloader *downloader);
+gboolean champlain_tile_downloader_is_running (ChamplainTileDownloader *downloader);
+
+guint champlain_tile_downloader_get_max_downloads (ChamplainTileDownloader *downloader);
+void champlain_tile_downloader_set_max_downloads (ChamplainTileDownloader *downloader,
+    guint max_downloads);
+gdouble champlain_tile_downloader_get_rate_limit (ChamplainTileDownloader *downloader);
+void champlain_tile_downloader_set_rate_limit (ChamplainTileDownloader *downloader,
+    gdouble rate_limit);
+
+G_END_DECLS
+
+#endif /* _CHAMPLAIN_TILE_DOWNLOADER_H_ */
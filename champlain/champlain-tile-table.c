@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * A hash table specialized for packed 64-bit tile keys. It uses open
+ * addressing with linear probing so lookups, insertions of existing keys and
+ * removals don't allocate any memory. Values must not be NULL - an empty
+ * slot is marked by a NULL value.
+ */
+
+#include "champlain-tile-table.h"
+
+#define INITIAL_SIZE 64
+
+struct _ChamplainTileTable
+{
+  guint64 *keys;
+  gpointer *values;
+  guint size; /* always a power of 2 */
+  guint n_items;
+  GDestroyNotify value_destroy_func;
+};
+
+G_LOCK_DEFINE_STATIC (source_ids);
+static GHashTable *source_ids = NULL;
+
+
+/* Creates a table for champlain_tile_key_intern_source_in() */
+GHashTable *
+champlain_tile_key_source_ids_new (void)
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+
+/* Returns a small number identifying the map source id within source_ids.
+ * NULL ids get CHAMPLAIN_TILE_KEY_NO_SOURCE, for which no tile keys are
+ * generated, and so do new ids when the table is full - the owner of the
+ * table then has to drop its keys and empty the table. */
+guint16
+champlain_tile_key_intern_source_in (GHashTable *source_ids,
+    const gchar *source_id)
+{
+  gpointer value;
+  guint16 id;
+
+  if (!source_id)
+    return CHAMPLAIN_TILE_KEY_NO_SOURCE;
+
+  value = g_hash_table_lookup (source_ids, source_id);
+  if (value)
+    return GPOINTER_TO_UINT (value);
+
+  if (g_hash_table_size (source_ids) >= CHAMPLAIN_TILE_KEY_MAX_SOURCE)
+    return CHAMPLAIN_TILE_KEY_NO_SOURCE;
+
+  id = g_hash_table_size (source_ids) + 1;
+  g_hash_table_insert (source_ids, g_strdup (source_id), GUINT_TO_POINTER (id));
+
+  return id;
+}
+
+
+/* Like champlain_tile_key_intern_source_in() but with a table shared by the
+ * whole process, for tables which hold keys of all sources. Ids are never
+ * released. */
+guint16
+champlain_tile_key_intern_source (const gchar *source_id)
+{
+  static gboolean exhausted = FALSE;
+  guint16 id;
+
+  if (!source_id)
+    return CHAMPLAIN_TILE_KEY_NO_SOURCE;
+
+  G_LOCK (source_ids);
+
+  if (!source_ids)
+    source_ids = champlain_tile_key_source_ids_new ();
+
+  id = champlain_tile_key_intern_source_in (source_ids, source_id);
+  if (id == CHAMPLAIN_TILE_KEY_NO_SOURCE && !exhausted)
+    {
+      exhausted = TRUE;
+      g_warning ("More than %d map source ids in use, downloads of the same tiles "
+          "by map source '%s' and further sources won't be shared",
+          CHAMPLAIN_TILE_KEY_MAX_SOURCE, source_id);
+    }
+
+  G_UNLOCK (source_ids);
+
+  return id;
+}
+
+
+static inline guint
+hash_key (guint64 key)
+{
+  /* 64-bit finalizer of MurmurHash3 */
+  key ^= key >> 33;
+  key *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+  key ^= key >> 33;
+  key *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+  key ^= key >> 33;
+
+  return (guint) key;
+}
+
+
+static void
+allocate_slots (ChamplainTileTable *table,
+    guint size)
+{
+  table->size = size;
+  table->keys = g_new0 (guint64, size);
+  table->values = g_new0 (gpointer, size);
+}
+
+
+ChamplainTileTable *
+champlain_tile_table_new (GDestroyNotify value_destroy_func)
+{
+  ChamplainTileTable *table = g_slice_new (ChamplainTileTable);
+
+  allocate_slots (table, INITIAL_SIZE);
+  table->n_items = 0;
+  table->value_destroy_func = value_destroy_func;
+
+  return table;
+}
+
+
+void
+champlain_tile_table_free (ChamplainTileTable *table)
+{
+  if (!table)
+    return;
+
+  champlain_tile_table_remove_all (table);
+  g_free (table->keys);
+  g_free (table->values);
+  g_slice_free (ChamplainTileTable, table);
+}
+
+
+static guint
+find_slot (ChamplainTileTable *table,
+    guint64 key)
+{
+  guint mask = table->size - 1;
+  guint i = hash_key (key) & mask;
+
+  while (table->values[i] && table->keys[i] != key)
+    i = (i + 1) & mask;
+
+  return i;
+}
+
+
+gpointer
+champlain_tile_table_lookup (ChamplainTileTable *table,
+    guint64 key)
+{
+  g_return_val_if_fail (table != NULL, NULL);
+
+  if (key == CHAMPLAIN_TILE_KEY_INVALID)
+    return NULL;
+
+  return table->values[find_slot (table, key)];
+}
+
+
+static void
+resize (ChamplainTileTable *table)
+{
+  guint64 *old_keys = table->keys;
+  gpointer *old_values = table->values;
+  guint old_size = table->size;
+  guint i;
+
+  allocate_slots (table, old_size * 2);
+
+  for (i = 0; i < old_size; i++)
+    {
+      if (old_values[i])
+        {
+          guint slot = find_slot (table, old_keys[i]);
+
+          table->keys[slot] = old_keys[i];
+          table->values[slot] = old_values[i];
+        }
+    }
+
+  g_free (old_keys);
+  g_free (old_values);
+}
+
+
+void
+champlain_tile_table_insert (ChamplainTileTable *table,
+    guint64 key,
+    gpointer value)
+{
+  guint slot;
+
+  g_return_if_fail (table != NULL);
+  g_return_if_fail (value != NULL);
+  g_return_if_fail (key != CHAMPLAIN_TILE_KEY_INVALID);
+
+  slot = find_slot (table, key);
+  if (table->values[slot])
+    {
+      if (table->value_destroy_func && table->values[slot] != value)
+        table->value_destroy_func (table->values[slot]);
+      table->values[slot] = value;
+      return;
+    }
+
+  /* keep the load factor below 3/4 */
+  if ((table->n_items + 1) * 4 > table->size * 3)
+    {
+      resize (table);
+      slot = find_slot (table, key);
+    }
+
+  table->keys[slot] = key;
+  table->values[slot] = value;
+  table->n_items++;
+}
+
+
+gboolean
+champlain_tile_table_remove (ChamplainTileTable *table,
+    guint64 key)
+{
+  guint mask, i, j;
+
+  g_return_val_if_fail (table != NULL, FALSE);
+
+  if (key == CHAMPLAIN_TILE_KEY_INVALID)
+    return FALSE;
+
+  mask = table->size - 1;
+  i = find_slot (table, key);
+  if (!table->values[i])
+    return FALSE;
+
+  if (table->value_destroy_func)
+    table->value_destroy_func (table->values[i]);
+  table->n_items--;
+
+  /* shift back the entries following the removed one so that no
+   * probing sequence gets interrupted */
+  j = i;
+  while (TRUE)
+    {
+      guint k;
+
+      j = (j + 1) & mask;
+      if (!table->values[j])
+        break;
+
+      k = hash_key (table->keys[j]) & mask;
+      if ((j > i && (k <= i || k > j)) ||
+          (j < i && (k <= i && k > j)))
+        {
+          table->keys[i] = table->keys[j];
+          table->values[i] = table->values[j];
+          i = j;
+        }
+    }
+
+  table->values[i] = NULL;
+
+  return TRUE;
+}
+
+
+void
+champlain_tile_table_remove_all (ChamplainTileTable *table)
+{
+  guint i;
+
+  g_return_if_fail (table != NULL);
+
+  if (table->n_items == 0)
+    return;
+
+  for (i = 0; i < table->size; i++)
+    {
+      if (table->values[i] && table->value_destroy_func)
+        table->value_destroy_func (table->values[i]);
+      table->values[i] = NULL;
+    }
+
+  table->n_items = 0;
+}
+
+
+guint
+champlain_tile_table_size (ChamplainTileTable *table)
+{
+  g_return_val_if_fail (table != NULL, 0);
+
+  return table->n_items;
+}
+
+
+/* The table must not be modified from within func */
+void
+champlain_tile_table_foreach (ChamplainTileTable *table,
+    ChamplainTileTableFunc func,
+    gpointer user_data)
+{
+  guint i;
+
+  g_return_if_fail (table != NULL);
+
+  for (i = 0; i < table->size; i++)
+    {
+      if (table->values[i])
+        func (table->keys[i], table->values[i], user_data);
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CHAMPLAIN_TILE_TABLE_H__
+#define __CHAMPLAIN_TILE_TABLE_H__
+
+#include <glib.h>
+
+#include "champlain-tile.h"
+
+G_BEGIN_DECLS
+
+/* A tile key packs the interned map source id, zoom level and tile
+ * coordinates into 64 bits:
+ *
+ *   | source id (9) | zoom level (5) | x (25) | y (25) |
+ *
+ * so tiles up to zoom level 25 have a unique key. Tiles which don't fit get
+ * CHAMPLAIN_TILE_KEY_INVALID, which tile tables never store - the zoom
+ * field of a valid key is never 0x1f so it can't collide with a real tile.
+ *
+ * The source id CHAMPLAIN_TILE_KEY_NO_SOURCE is used by keys which don't
+ * belong to a map source (e.g. those of the view) and is returned by
+ * champlain_tile_key_intern_source() when the id can't be interned.
+ * Caches intern the ids of their sources in their own tables (see
+ * champlain_tile_key_intern_source_in()) so that they never run out of them.
+ */
+#define CHAMPLAIN_TILE_KEY_MAX_ZOOM_LEVEL 25
+#define CHAMPLAIN_TILE_KEY_MAX_COORD 0x1ffffff
+#define CHAMPLAIN_TILE_KEY_MAX_SOURCE 0x1ff
+#define CHAMPLAIN_TILE_KEY_INVALID G_MAXUINT64
+#define CHAMPLAIN_TILE_KEY_NO_SOURCE 0
+
+static inline guint64
+champlain_tile_key_new (guint16 source_id,
+    guint zoom_level,
+    guint x,
+    guint y)
+{
+  if (source_id > CHAMPLAIN_TILE_KEY_MAX_SOURCE ||
+      zoom_level > CHAMPLAIN_TILE_KEY_MAX_ZOOM_LEVEL ||
+      x > CHAMPLAIN_TILE_KEY_MAX_COORD ||
+      y > CHAMPLAIN_TILE_KEY_MAX_COORD)
+    return CHAMPLAIN_TILE_KEY_INVALID;
+
+  return ((guint64) source_id << 55) |
+         ((guint64) zoom_level << 50) |
+         ((guint64) x << 25) |
+         ((guint64) y);
+}
+
+
+/* Key of a tile of a map source; invalid when the source id couldn't be
+ * interned */
+static inline guint64
+champlain_tile_key_for_tile (guint16 source_id,
+    ChamplainTile *tile)
+{
+  if (source_id == CHAMPLAIN_TILE_KEY_NO_SOURCE)
+    return CHAMPLAIN_TILE_KEY_INVALID;
+
+  return champlain_tile_key_new (source_id,
+      champlain_tile_get_zoom_level (tile),
+      champlain_tile_get_x (tile),
+      champlain_tile_get_y (tile));
+}
+
+
+GHashTable *champlain_tile_key_source_ids_new (void);
+guint16 champlain_tile_key_intern_source_in (GHashTable *source_ids,
+    const gchar *source_id);
+guint16 champlain_tile_key_intern_source (const gchar *source_id);
+
+typedef struct _ChamplainTileTable ChamplainTileTable;
+
+typedef void (*ChamplainTileTableFunc)(guint64 key,
+    gpointer value,
+    gpointer user_data);
+
+ChamplainTileTable *champlain_tile_table_new (GDestroyNotify value_destroy_func);
+void champlain_tile_table_free (ChamplainTileTable *table);
+
+gpointer champlain_tile_table_lookup (ChamplainTileTable *table,
+    guint64 key);
+void champlain_tile_table_insert (ChamplainTileTable *table,
+    guint64 key,
+    gpointer value);
+gboolean champlain_tile_table_remove (ChamplainTileTable *table,
+    guint64 key);
+void champlain_tile_table_remove_all (ChamplainTileTable *table);
+guint champlain_tile_table_size (ChamplainTileTable *table);
+void champlain_tile_table_foreach (ChamplainTileTable *table,
+    ChamplainTileTableFunc func,
+    gpointer user_data);
+
+G_END_DECLS
+
+#endif /* __CHAMPLAIN_TILE_TABLE_H__ */
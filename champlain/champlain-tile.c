@@ -77,8 +77,11 @@ struct _ChamplainTilePrivate
   gboolean fade_in;
 
   GTimeVal *modified_time; /* The last modified time of the cache */
+  GTimeVal *expiration_time; /* The time the server declared the content stale */
   gchar *etag; /* The HTTP ETag sent by the server */
   gboolean content_displayed;
+  guint load_priority; /* lower values are rendered first */
+  gboolean animate_display; /* whether the content fades in */
 };
 
 static void
@@ -198,6 +201,7 @@ champlain_tile_finalize (GObject *object)
   ChamplainTilePrivate *priv = CHAMPLAIN_TILE (object)->priv;
 
   g_free (priv->modified_time);
+  g_free (priv->expiration_time);
   g_free (priv->etag);
 
   G_OBJECT_CLASS (champlain_tile_parent_class)->finalize (object);
@@ -387,9 +391,12 @@ champlain_tile_init (ChamplainTile *self)
   priv->zoom_level = 0;
   priv->size = 0;
   priv->modified_time = NULL;
+  priv->expiration_time = NULL;
   priv->etag = NULL;
   priv->fade_in = FALSE;
   priv->content_displayed = FALSE;
+  priv->load_priority = 0;
+  priv->animate_display = TRUE;
 
   priv->content_actor = NULL;
 }
@@ -685,6 +692,49 @@ champlain_tile_set_modified_time (ChamplainTile *self,
 }
 
 
+/**
+ * champlain_tile_get_expiration_time:
+ * @self: the #ChamplainTile
+ *
+ * Gets the time after which the tile's content has to be validated, as
+ * declared by the server through the Cache-Control or Expires headers.
+ *
+ * Returns: the tile's expiration time or %NULL when unknown
+ *
+ * Since: 0.12.6
+ */
+const GTimeVal *
+champlain_tile_get_expiration_time (ChamplainTile *self)
+{
+  g_return_val_if_fail (CHAMPLAIN_TILE (self), NULL);
+
+  return self->priv->expiration_time;
+}
+
+
+/**
+ * champlain_tile_set_expiration_time:
+ * @self: the #ChamplainTile
+ * @time: (allow-none): a #GTimeVal, the value will be copied, or %NULL to
+ * unset the expiration time
+ *
+ * Sets the time after which the tile's content has to be validated
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_tile_set_expiration_time (ChamplainTile *self,
+    const GTimeVal *time_)
+{
+  g_return_if_fail (CHAMPLAIN_TILE (self));
+
+  ChamplainTilePrivate *priv = self->priv;
+
+  g_free (priv->expiration_time);
+  priv->expiration_time = time_ ? g_memdup (time_, sizeof (GTimeVal)) : NULL;
+}
+
+
 /**
  * champlain_tile_get_etag:
  * @self: the #ChamplainTile
@@ -791,6 +841,14 @@ champlain_tile_display_content (ChamplainTile *self)
   g_object_unref (priv->content_actor);
   priv->content_displayed = TRUE;
 
+  /* the content replaces the previous one at once */
+  if (!priv->animate_display)
+    {
+      while (clutter_actor_get_first_child (CLUTTER_ACTOR (self)) != priv->content_actor)
+        clutter_actor_destroy (clutter_actor_get_first_child (CLUTTER_ACTOR (self)));
+      return;
+    }
+
   clutter_actor_set_opacity (priv->content_actor, 0);
   clutter_actor_save_easing_state (priv->content_actor);
   if (priv->fade_in)
@@ -868,3 +926,69 @@ champlain_tile_set_fade_in (ChamplainTile *self,
 
   g_object_notify (G_OBJECT (self), "fade-in");
 }
+
+
+void
+champlain_tile_reset (ChamplainTile *self)
+{
+  g_return_if_fail (CHAMPLAIN_TILE (self));
+
+  ChamplainTilePrivate *priv = self->priv;
+
+  if (!priv->content_displayed && priv->content_actor)
+    clutter_actor_destroy (priv->content_actor);
+  priv->content_actor = NULL;
+  priv->content_displayed = FALSE;
+  /* also removes the displayed content and placeholders */
+  clutter_actor_destroy_all_children (CLUTTER_ACTOR (self));
+
+  /* map sources and the previous user of the tile must not get callbacks
+   * for the new coordinates */
+  g_signal_handlers_disconnect_matched (self, G_SIGNAL_MATCH_ID,
+      champlain_tile_signals[RENDER_COMPLETE], 0, NULL, NULL, NULL);
+  g_signal_handlers_disconnect_matched (self, G_SIGNAL_MATCH_ID | G_SIGNAL_MATCH_DETAIL,
+      g_signal_lookup ("notify", G_TYPE_OBJECT), g_quark_from_static_string ("state"),
+      NULL, NULL, NULL);
+
+  /* the tile is unused so nobody is interested in notifications */
+  priv->state = CHAMPLAIN_STATE_NONE;
+  priv->fade_in = FALSE;
+  priv->load_priority = 0;
+  priv->animate_display = TRUE;
+
+  g_free (priv->modified_time);
+  priv->modified_time = NULL;
+  g_free (priv->expiration_time);
+  priv->expiration_time = NULL;
+  g_free (priv->etag);
+  priv->etag = NULL;
+}
+
+
+void
+champlain_tile_set_load_priority (ChamplainTile *self,
+    guint priority)
+{
+  g_return_if_fail (CHAMPLAIN_TILE (self));
+
+  self->priv->load_priority = priority;
+}
+
+
+guint
+champlain_tile_get_load_priority (ChamplainTile *self)
+{
+  g_return_val_if_fail (CHAMPLAIN_TILE (self), 0);
+
+  return self->priv->load_priority;
+}
+
+
+void
+champlain_tile_set_animate_display (ChamplainTile *self,
+    gboolean animate)
+{
+  g_return_if_fail (CHAMPLAIN_TILE (self));
+
+  self->priv->animate_display = animate;
+}
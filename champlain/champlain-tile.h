@@ -104,6 +104,7 @@ guint champlain_tile_get_size (ChamplainTile *self);
 ChamplainState champlain_tile_get_state (ChamplainTile *self);
 ClutterActor *champlain_tile_get_content (ChamplainTile *self);
 const GTimeVal *champlain_tile_get_modified_time (ChamplainTile *self);
+const GTimeVal *champlain_tile_get_expiration_time (ChamplainTile *self);
 const gchar *champlain_tile_get_etag (ChamplainTile *self);
 gboolean champlain_tile_get_fade_in (ChamplainTile *self);
 
@@ -123,6 +124,8 @@ void champlain_tile_set_etag (ChamplainTile *self,
     const gchar *etag);
 void champlain_tile_set_modified_time (ChamplainTile *self,
     const GTimeVal *time);
+void champlain_tile_set_expiration_time (ChamplainTile *self,
+    const GTimeVal *time);
 void champlain_tile_set_fade_in (ChamplainTile *self,
     gboolean fade_in);
 
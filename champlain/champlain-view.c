@@ -59,8 +59,10 @@
 #include "champlain-marshal.h"
 #include "champlain-map-source.h"
 #include "champlain-map-source-factory.h"
+#include "champlain-memory-cache.h"
 #include "champlain-private.h"
 #include "champlain-tile.h"
+#include "champlain-tile-table.h"
 #include "champlain-license.h"
 
 #include <clutter/clutter.h>
@@ -103,10 +105,31 @@ enum
   PROP_STATE,
   PROP_BACKGROUND_PATTERN,
   PROP_GOTO_ANIMATION_MODE,
-  PROP_GOTO_ANIMATION_DURATION
+  PROP_GOTO_ANIMATION_DURATION,
+  PROP_FADE_PER_LAYER
 };
 
 #define PADDING 10
+/* maximal number of tiles being loaded at the same time; the remaining
+ * requests wait in the view so they can still be reordered or dropped */
+#define MAX_TILES_LOADING 16
+/* time in microseconds the tile loads may take within a single frame, the
+ * rest is left for the next frames */
+#define FILL_TILES_BUDGET 4000
+/* maximal number of tiles prefetched at the same time, prefetching only
+ * uses the slots not needed by visible tiles */
+#define MAX_TILES_PREFETCHING 4
+/* movement in pixels per second below which nothing is prefetched */
+#define MIN_PREFETCH_SPEED 50
+/* initial guess of the time needed to fetch a tile in ms */
+#define INITIAL_FETCH_LATENCY 300
+/* time in ms the view has to be idle before the tiles of the neighbouring
+ * zoom levels are prefetched */
+#define ZOOM_PREFETCH_DELAY 500
+/* how many zoom levels up placeholders of loading tiles are looked for */
+#define MAX_PLACEHOLDER_DEPTH 4
+/* maximal number of unused tiles kept for reuse */
+#define MAX_POOLED_TILES 64
 static guint signals[LAST_SIGNAL] = { 0, };
 
 #define GET_PRIVATE(obj) \
@@ -132,13 +155,29 @@ typedef struct
 
 typedef struct
 {
-  ChamplainView *view;
-  ChamplainMapSource *map_source;
   gint x;
   gint y;
-  gint zoom_level;
-  gint size;
-} FillTileCallbackData;
+  guint zoom_level;
+  gdouble distance; /* from the viewport center, in tiles */
+} PendingTile;
+
+/* A tile of a source's maximum zoom level scaled up for the tiles of
+ * higher zoom levels it covers */
+typedef struct
+{
+  ChamplainView *view;
+  ChamplainMapSource *map_source;
+  ChamplainTile *tile;
+  GPtrArray *children;
+} OverzoomParent;
+
+/* A tile loaded ahead of the viewport only to fill the caches */
+typedef struct
+{
+  ChamplainView *view;
+  ChamplainTile *tile;
+  gint64 start_time;
+} PrefetchTile;
 
 
 struct _ChamplainViewPrivate
@@ -179,6 +218,9 @@ struct _ChamplainViewPrivate
   gboolean keep_center_on_resize;
   gboolean zoom_on_double_click;
   gboolean animate_zoom;
+  gboolean fade_per_layer;
+  /* map_layer is hidden until its tiles are loaded */
+  gboolean layer_fade_pending;
 
   gboolean kinetic_mode;
 
@@ -200,7 +242,32 @@ struct _ChamplainViewPrivate
   gdouble zoom_actor_viewport_y;
   guint zoom_actor_timeout;
   
-  GHashTable *tile_map;
+  ChamplainTileTable *tile_map;
+
+  /* tiles waiting to be loaded, the closest to the viewport center last */
+  GPtrArray *pending_tiles;
+  ChamplainTileTable *pending_map;
+  guint fill_tiles_repaint;
+
+  /* tiles along the predicted movement, ordered like pending_tiles */
+  GPtrArray *prefetch_queue;
+  /* PrefetchTile being loaded */
+  GPtrArray *prefetching;
+  guint zoom_prefetch_timeout;
+  gboolean zoom_prefetch_queued;
+
+  /* OverzoomParent being loaded */
+  GPtrArray *overzoom_parents;
+  /* unused tiles, still children of map_layer but hidden */
+  GPtrArray *tile_pool;
+  /* smoothed fetch time of prefetched tiles in ms */
+  gdouble fetch_latency;
+  /* smoothed viewport velocity in pixels per second */
+  gdouble velocity_x;
+  gdouble velocity_y;
+  gdouble motion_x;
+  gdouble motion_y;
+  gint64 motion_time;
 
   gint tile_x_first;
   gint tile_y_first;
@@ -251,6 +318,10 @@ static void champlain_view_go_to_with_duration (ChamplainView *view,
     guint duration);
 static gboolean redraw_timeout_cb(gpointer view);
 static void remove_all_tiles (ChamplainView *view);
+static void free_pending_tile (gpointer data);
+static void clear_pending_tiles (ChamplainView *view);
+static void schedule_fill_tiles (ChamplainView *view);
+static void cancel_prefetch (ChamplainView *view);
 
 
 static void
@@ -479,6 +550,10 @@ champlain_view_get_property (GObject *object,
       g_value_set_boolean (value, priv->animate_zoom);
       break;
 
+    case PROP_FADE_PER_LAYER:
+      g_value_set_boolean (value, priv->fade_per_layer);
+      break;
+
     case PROP_STATE:
       g_value_set_enum (value, priv->state);
       break;
@@ -559,6 +634,10 @@ champlain_view_set_property (GObject *object,
     case PROP_ANIMATE_ZOOM:
       champlain_view_set_animate_zoom (view, g_value_get_boolean (value));
       break;
+
+    case PROP_FADE_PER_LAYER:
+      champlain_view_set_fade_per_layer (view, g_value_get_boolean (value));
+      break;
       
     case PROP_BACKGROUND_PATTERN:
       champlain_view_set_background_pattern (view, g_value_get_object (value));
@@ -630,10 +709,53 @@ champlain_view_dispose (GObject *object)
 
   if (priv->tile_map != NULL)
     {
-      g_hash_table_destroy (priv->tile_map);
+      champlain_tile_table_free (priv->tile_map);
       priv->tile_map = NULL;
     }
 
+  if (priv->pending_tiles != NULL)
+    {
+      clear_pending_tiles (view);
+      g_ptr_array_unref (priv->pending_tiles);
+      priv->pending_tiles = NULL;
+      champlain_tile_table_free (priv->pending_map);
+      priv->pending_map = NULL;
+    }
+
+  if (priv->zoom_prefetch_timeout != 0)
+    {
+      g_source_remove (priv->zoom_prefetch_timeout);
+      priv->zoom_prefetch_timeout = 0;
+    }
+
+  if (priv->overzoom_parents != NULL)
+    {
+      /* setting the state to done frees the parent */
+      while (priv->overzoom_parents->len > 0)
+        {
+          OverzoomParent *parent = g_ptr_array_index (priv->overzoom_parents, 0);
+          champlain_tile_set_state (parent->tile, CHAMPLAIN_STATE_DONE);
+        }
+      g_ptr_array_unref (priv->overzoom_parents);
+      priv->overzoom_parents = NULL;
+    }
+
+  /* the tiles themselves are destroyed together with map_layer */
+  if (priv->tile_pool != NULL)
+    {
+      g_ptr_array_unref (priv->tile_pool);
+      priv->tile_pool = NULL;
+    }
+
+  if (priv->prefetching != NULL)
+    {
+      cancel_prefetch (view);
+      g_ptr_array_unref (priv->prefetch_queue);
+      priv->prefetch_queue = NULL;
+      g_ptr_array_unref (priv->prefetching);
+      priv->prefetching = NULL;
+    }
+
   priv->map_layer = NULL;
   priv->license_actor = NULL;
   priv->user_layers = NULL;
@@ -890,6 +1012,24 @@ champlain_view_class_init (ChamplainViewClass *champlainViewClass)
           TRUE, 
           CHAMPLAIN_PARAM_READWRITE));
 
+  /**
+   * ChamplainView:fade-per-layer:
+   *
+   * When TRUE, the tiles don't fade in one by one as they get loaded.
+   * Instead, the map and its overlays are hidden when all tiles are replaced,
+   * e.g. after a zoom level change, and fade in together once the new tiles
+   * are loaded.
+   *
+   * Since: 0.12.6
+   */
+  g_object_class_install_property (object_class,
+      PROP_FADE_PER_LAYER,
+      g_param_spec_boolean ("fade-per-layer",
+          "Fade per layer",
+          "Fade in all tiles together instead of one by one",
+          FALSE,
+          CHAMPLAIN_PARAM_READWRITE));
+
   /**
    * ChamplainView:state:
    *
@@ -1070,13 +1210,6 @@ view_size_changed_cb (ChamplainView *view,
 }
 
 
-static void 
-slice_free_gint64 (gpointer data)
-{
-  g_slice_free (gint64, data);
-}
-
-
 static void
 champlain_view_init (ChamplainView *view)
 {
@@ -1104,6 +1237,8 @@ champlain_view_init (ChamplainView *view)
   priv->keep_center_on_resize = TRUE;
   priv->zoom_on_double_click = TRUE;
   priv->animate_zoom = TRUE;
+  priv->fade_per_layer = FALSE;
+  priv->layer_fade_pending = FALSE;
   priv->license_actor = NULL;
   priv->kinetic_mode = TRUE;
   priv->viewport_x = 0;
@@ -1123,7 +1258,22 @@ champlain_view_init (ChamplainView *view)
   priv->location_updated = FALSE;
   priv->redraw_timeout = 0;
   priv->zoom_actor_timeout = 0;
-  priv->tile_map = g_hash_table_new_full (g_int64_hash, g_int64_equal, slice_free_gint64, NULL);
+  priv->tile_map = champlain_tile_table_new (NULL);
+  priv->pending_tiles = g_ptr_array_new_with_free_func (free_pending_tile);
+  priv->pending_map = champlain_tile_table_new (NULL);
+  priv->fill_tiles_repaint = 0;
+  priv->prefetch_queue = g_ptr_array_new_with_free_func (free_pending_tile);
+  priv->prefetching = g_ptr_array_new ();
+  priv->zoom_prefetch_timeout = 0;
+  priv->zoom_prefetch_queued = FALSE;
+  priv->overzoom_parents = g_ptr_array_new ();
+  priv->tile_pool = g_ptr_array_new ();
+  priv->fetch_latency = INITIAL_FETCH_LATENCY;
+  priv->velocity_x = 0;
+  priv->velocity_y = 0;
+  priv->motion_x = 0;
+  priv->motion_y = 0;
+  priv->motion_time = 0;
   priv->goto_duration = 0;
   priv->goto_mode = CLUTTER_EASE_IN_OUT_CIRC;
 
@@ -1222,12 +1372,34 @@ viewport_pos_changed_cb (G_GNUC_UNUSED GObject *gobject,
 
   ChamplainViewPrivate *priv = view->priv;
   gdouble x, y;
+  gint64 now;
+  gdouble dt;
 
   if (priv->redraw_timeout == 0)
     priv->redraw_timeout = g_timeout_add (350, redraw_timeout_cb, view);
 
   champlain_viewport_get_origin (CHAMPLAIN_VIEWPORT (priv->viewport), &x, &y);
 
+  /* estimate the velocity of dragging for prefetching */
+  now = g_get_monotonic_time ();
+  dt = (gdouble) (now - priv->motion_time) / G_USEC_PER_SEC;
+  if (dt > 0.01)
+    {
+      if (dt < 0.25)
+        {
+          priv->velocity_x = (priv->velocity_x + (x - priv->motion_x) / dt) / 2;
+          priv->velocity_y = (priv->velocity_y + (y - priv->motion_y) / dt) / 2;
+        }
+      else
+        {
+          priv->velocity_x = 0;
+          priv->velocity_y = 0;
+        }
+      priv->motion_x = x;
+      priv->motion_y = y;
+      priv->motion_time = now;
+    }
+
   if (ABS (x - priv->viewport_x) > 100 || ABS (y - priv->viewport_y) > 100)
     {
       update_coords (view, x, y, FALSE);
@@ -1889,13 +2061,12 @@ static void
 tile_map_set (ChamplainView *view, gint tile_x, gint tile_y, gboolean value)
 {
   ChamplainViewPrivate *priv = view->priv;
-  gint64 count = champlain_map_source_get_column_count (priv->map_source, priv->zoom_level);
-  gint64 *key = g_slice_alloc (sizeof(gint64));
-  *key = (gint64)tile_y * count + tile_x;
+  guint64 key = champlain_tile_key_new (0, priv->zoom_level, tile_x, tile_y);
+
   if (value)
-    g_hash_table_insert (priv->tile_map, key, GINT_TO_POINTER (TRUE));
+    champlain_tile_table_insert (priv->tile_map, key, GINT_TO_POINTER (TRUE));
   else
-    g_hash_table_remove (priv->tile_map, key);
+    champlain_tile_table_remove (priv->tile_map, key);
 }
 
 
@@ -1903,9 +2074,316 @@ static gboolean
 tile_in_tile_map (ChamplainView *view, gint tile_x, gint tile_y)
 {
   ChamplainViewPrivate *priv = view->priv;
-  gint64 count = champlain_map_source_get_column_count (priv->map_source, priv->zoom_level);
-  gint64 key = (gint64)tile_y * count + tile_x;
-  return GPOINTER_TO_INT (g_hash_table_lookup (priv->tile_map, &key));
+  guint64 key = champlain_tile_key_new (0, priv->zoom_level, tile_x, tile_y);
+
+  return GPOINTER_TO_INT (champlain_tile_table_lookup (priv->tile_map, key));
+}
+
+
+/* Creates an actor of the tile's size showing the part of the tile's ancestor
+ * depth levels up which covers the tile. The content always paints the whole
+ * ancestor tile into the content box - an atlas content paints just its slot
+ * of the atlas page - so it is scaled by the size of the actor and the
+ * placeholder clips it. */
+static ClutterActor *
+create_ancestor_placeholder (ClutterContent *content,
+    gint size,
+    gint x,
+    gint y,
+    guint depth)
+{
+  ClutterActor *placeholder = clutter_actor_new ();
+  ClutterActor *actor = clutter_actor_new ();
+  gint mask = (1 << depth) - 1;
+
+  clutter_actor_set_size (placeholder, size, size);
+  clutter_actor_set_clip_to_allocation (placeholder, TRUE);
+
+  clutter_actor_set_size (actor, size << depth, size << depth);
+  clutter_actor_set_position (actor, -(x & mask) * size, -(y & mask) * size);
+  clutter_actor_set_content_gravity (actor, CLUTTER_CONTENT_GRAVITY_RESIZE_FILL);
+  clutter_actor_set_content (actor, content);
+  clutter_actor_add_child (placeholder, actor);
+
+  return placeholder;
+}
+
+
+/* Creates an actor of the tile's size showing the tile's children available
+ * in the memory cache or NULL if there are none */
+static ClutterActor *
+create_children_placeholder (ChamplainMemoryCache *memory_cache,
+    gint size,
+    gint x,
+    gint y,
+    guint zoom_level)
+{
+  ClutterActor *placeholder = NULL;
+  gint i;
+
+  for (i = 0; i < 4; i++)
+    {
+      gint child_x = 2 * x + i % 2;
+      gint child_y = 2 * y + i / 2;
+      ClutterContent *content;
+      ClutterActor *actor;
+
+      content = champlain_memory_cache_get_content (memory_cache, zoom_level + 1, child_x, child_y);
+      if (!content)
+        continue;
+
+      if (!placeholder)
+        {
+          placeholder = clutter_actor_new ();
+          clutter_actor_set_size (placeholder, size, size);
+        }
+
+      actor = clutter_actor_new ();
+      clutter_actor_set_size (actor, size / 2.0, size / 2.0);
+      clutter_actor_set_position (actor, (i % 2) * size / 2.0, (i / 2) * size / 2.0);
+      clutter_actor_set_content (actor, content);
+      clutter_actor_add_child (placeholder, actor);
+    }
+
+  return placeholder;
+}
+
+
+/* Shows the scaled content of the closest tile of another zoom level kept in
+ * the memory cache under a tile which is still loading. The tile's content
+ * fades in over the placeholder and replaces it, see
+ * champlain_tile_display_content(). Nothing is loaded for the placeholders. */
+static void
+show_placeholder (ChamplainView *view,
+    ChamplainTile *tile)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  ChamplainMapSource *memory_cache;
+  ClutterActor *placeholder = NULL;
+  gint size = champlain_tile_get_size (tile);
+  gint x = champlain_tile_get_x (tile);
+  gint y = champlain_tile_get_y (tile);
+  guint zoom_level = champlain_tile_get_zoom_level (tile);
+  guint depth;
+
+  memory_cache = champlain_map_source_find_by_type (priv->map_source, CHAMPLAIN_TYPE_MEMORY_CACHE);
+  if (!memory_cache)
+    return;
+
+  /* the parent, then the children and then the more distant ancestors */
+  for (depth = 1; depth <= MAX_PLACEHOLDER_DEPTH && depth <= zoom_level; depth++)
+    {
+      ClutterContent *content;
+
+      content = champlain_memory_cache_get_content (CHAMPLAIN_MEMORY_CACHE (memory_cache),
+            zoom_level - depth, x >> depth, y >> depth);
+      if (content)
+        {
+          placeholder = create_ancestor_placeholder (content, size, x, y, depth);
+          break;
+        }
+
+      if (depth == 1)
+        {
+          placeholder = create_children_placeholder (CHAMPLAIN_MEMORY_CACHE (memory_cache),
+                size, x, y, zoom_level);
+          if (placeholder)
+            break;
+        }
+    }
+
+  if (!placeholder && zoom_level == 0)
+    placeholder = create_children_placeholder (CHAMPLAIN_MEMORY_CACHE (memory_cache),
+          size, x, y, zoom_level);
+
+  if (placeholder)
+    clutter_actor_insert_child_at_index (CLUTTER_ACTOR (tile), placeholder, 0);
+}
+
+
+static void
+overzoom_parent_state_notify (ChamplainTile *tile,
+    G_GNUC_UNUSED GParamSpec *pspec,
+    OverzoomParent *parent)
+{
+  ChamplainViewPrivate *priv = parent->view->priv;
+  ClutterContent *content = NULL;
+  ClutterActor *actor;
+  guint i;
+
+  if (champlain_tile_get_state (tile) != CHAMPLAIN_STATE_DONE)
+    return;
+
+  actor = champlain_tile_get_content (tile);
+  if (actor)
+    content = clutter_actor_get_content (actor);
+
+  for (i = 0; i < parent->children->len; i++)
+    {
+      ChamplainTile *child = g_ptr_array_index (parent->children, i);
+
+      /* already removed from the view */
+      if (champlain_tile_get_state (child) == CHAMPLAIN_STATE_DONE)
+        continue;
+
+      if (content)
+        {
+          actor = create_ancestor_placeholder (content,
+                champlain_tile_get_size (child),
+                champlain_tile_get_x (child),
+                champlain_tile_get_y (child),
+                champlain_tile_get_zoom_level (child) - champlain_tile_get_zoom_level (tile));
+          champlain_tile_set_content (child, actor);
+        }
+
+      champlain_tile_set_fade_in (child, TRUE);
+      champlain_tile_set_state (child, CHAMPLAIN_STATE_DONE);
+      champlain_tile_display_content (child);
+    }
+
+  g_signal_handlers_disconnect_by_func (tile, overzoom_parent_state_notify, parent);
+  g_ptr_array_remove_fast (priv->overzoom_parents, parent);
+  g_ptr_array_unref (parent->children);
+  clutter_actor_destroy (CLUTTER_ACTOR (tile));
+  g_object_unref (tile);
+  g_object_unref (parent->map_source);
+  g_slice_free (OverzoomParent, parent);
+}
+
+
+/* Fills a tile above the maximum zoom level of the source with the scaled
+ * up part of the tile of the maximum zoom level covering it. All tiles
+ * covered by the same tile share its single load and decode. */
+static void
+overzoom_fill_tile (ChamplainView *view,
+    ChamplainMapSource *source,
+    ChamplainTile *tile)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  guint max_zoom_level = champlain_map_source_get_max_zoom_level (source);
+  guint depth = champlain_tile_get_zoom_level (tile) - max_zoom_level;
+  gint x = champlain_tile_get_x (tile) >> depth;
+  gint y = champlain_tile_get_y (tile) >> depth;
+  ChamplainTile *parent_tile;
+  OverzoomParent *parent;
+  guint i;
+
+  for (i = 0; i < priv->overzoom_parents->len; i++)
+    {
+      parent = g_ptr_array_index (priv->overzoom_parents, i);
+
+      if (parent->map_source == source &&
+          champlain_tile_get_x (parent->tile) == x &&
+          champlain_tile_get_y (parent->tile) == y &&
+          champlain_tile_get_zoom_level (parent->tile) == max_zoom_level)
+        {
+          g_ptr_array_add (parent->children, g_object_ref (tile));
+          return;
+        }
+    }
+
+  DEBUG ("Overzooming tile %d, %d, %d", max_zoom_level, x, y);
+
+  parent = g_slice_new (OverzoomParent);
+  parent->view = view;
+  parent->map_source = g_object_ref (source);
+  parent->tile = g_object_ref_sink (champlain_tile_new ());
+  parent->children = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (parent->children, g_object_ref (tile));
+  g_ptr_array_add (priv->overzoom_parents, parent);
+
+  champlain_tile_set_x (parent->tile, x);
+  champlain_tile_set_y (parent->tile, y);
+  champlain_tile_set_zoom_level (parent->tile, max_zoom_level);
+  champlain_tile_set_size (parent->tile, champlain_tile_get_size (tile));
+  champlain_tile_set_load_priority (parent->tile, champlain_tile_get_load_priority (tile));
+
+  g_signal_connect (parent->tile, "notify::state", G_CALLBACK (overzoom_parent_state_notify), parent);
+  champlain_tile_set_state (parent->tile, CHAMPLAIN_STATE_LOADING);
+
+  /* overzoom_parent_state_notify() frees parent and releases its tile from
+   * within fill_tile() when the tile is filled synchronously */
+  parent_tile = g_object_ref (parent->tile);
+  champlain_map_source_fill_tile (source, parent_tile);
+  g_object_unref (parent_tile);
+}
+
+
+/* Returns an unused tile from the pool or a new one, the tile is a visible
+ * child of map_layer in both cases */
+static ChamplainTile *
+acquire_tile (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  ChamplainTile *tile;
+
+  if (priv->tile_pool->len > 0)
+    {
+      tile = g_ptr_array_index (priv->tile_pool, priv->tile_pool->len - 1);
+      g_ptr_array_remove_index (priv->tile_pool, priv->tile_pool->len - 1);
+      g_object_set_data (G_OBJECT (tile), "pooled", NULL);
+      clutter_actor_show (CLUTTER_ACTOR (tile));
+    }
+  else
+    {
+      tile = champlain_tile_new ();
+      clutter_actor_add_child (priv->map_layer, CLUTTER_ACTOR (tile));
+    }
+
+  /* champlain_tile_reset() disconnected it from pooled tiles */
+  g_signal_connect (tile, "notify::state", G_CALLBACK (tile_state_notify), view);
+
+  return tile;
+}
+
+
+static gboolean
+tile_is_pooled (ChamplainTile *tile)
+{
+  return GPOINTER_TO_INT (g_object_get_data (G_OBJECT (tile), "pooled"));
+}
+
+
+/* Puts a tile no longer needed into the pool, or destroys it when the pool
+ * is full. Tiles which are still loading may be finished by map sources or
+ * renderers later; they are destroyed as before and only freed once the
+ * last reference is dropped. */
+static void
+release_tile (ChamplainView *view,
+    ChamplainTile *tile)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  gboolean loaded = champlain_tile_get_state (tile) == CHAMPLAIN_STATE_DONE;
+
+  champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
+
+  if (priv->tile_pool->len >= MAX_POOLED_TILES || !loaded)
+    {
+      clutter_actor_destroy (CLUTTER_ACTOR (tile));
+      return;
+    }
+
+  clutter_actor_hide (CLUTTER_ACTOR (tile));
+  champlain_tile_reset (tile);
+  g_object_set_data (G_OBJECT (tile), "overlay", NULL);
+  g_object_set_data (G_OBJECT (tile), "pooled", GINT_TO_POINTER (TRUE));
+  g_ptr_array_add (priv->tile_pool, tile);
+}
+
+
+/* Tiles closer to the center of the view are rendered first */
+static guint
+get_load_priority (ChamplainView *view,
+    gint size,
+    gint x,
+    gint y)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  gdouble dx = x + 0.5 - (priv->viewport_x + priv->viewport_width / 2.0) / size;
+  gdouble dy = y + 0.5 - (priv->viewport_y + priv->viewport_height / 2.0) / size;
+
+  /* leaves G_MAXUINT for the prefetched tiles */
+  return (guint) MIN (4 * (dx * dx + dy * dy), G_MAXUINT - 1);
 }
 
 
@@ -1918,7 +2396,7 @@ load_tile_for_source (ChamplainView *view,
     gint y)
 {
   ChamplainViewPrivate *priv = view->priv;
-  ChamplainTile *tile = champlain_tile_new ();
+  ChamplainTile *tile = acquire_tile (view);
 
   DEBUG ("Loading tile %d, %d, %d", priv->zoom_level, x, y);
 
@@ -1926,57 +2404,574 @@ load_tile_for_source (ChamplainView *view,
   champlain_tile_set_y (tile, y);
   champlain_tile_set_zoom_level (tile, priv->zoom_level);
   champlain_tile_set_size (tile, size);
+  champlain_tile_set_load_priority (tile, get_load_priority (view, size, x, y));
+  champlain_tile_set_animate_display (tile, !priv->fade_per_layer);
   clutter_actor_set_opacity (CLUTTER_ACTOR (tile), opacity);
 
-  g_signal_connect (tile, "notify::state", G_CALLBACK (tile_state_notify), view);
-  clutter_actor_add_child (priv->map_layer, CLUTTER_ACTOR (tile));
   champlain_viewport_set_actor_position (CHAMPLAIN_VIEWPORT (priv->viewport), CLUTTER_ACTOR (tile), x * size, y * size);
 
   /* updates champlain_view state automatically as
      notify::state signal is connected  */
   champlain_tile_set_state (tile, CHAMPLAIN_STATE_LOADING);
 
-  champlain_map_source_fill_tile (source, tile);
+  if (priv->zoom_level > champlain_map_source_get_max_zoom_level (source))
+    overzoom_fill_tile (view, source, tile);
+  else
+    champlain_map_source_fill_tile (source, tile);
+
+  /* the tile wasn't in the memory cache */
+  if (source == priv->map_source && champlain_tile_get_state (tile) == CHAMPLAIN_STATE_LOADING)
+    show_placeholder (view, tile);
 
   if (source != priv->map_source)
     g_object_set_data (G_OBJECT (tile), "overlay", GINT_TO_POINTER (TRUE));
 }
 
 
+static void
+free_pending_tile (gpointer data)
+{
+  g_slice_free (PendingTile, data);
+}
+
+
+static void
+clear_pending_tiles (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+
+  if (priv->fill_tiles_repaint != 0)
+    {
+      clutter_threads_remove_repaint_func (priv->fill_tiles_repaint);
+      priv->fill_tiles_repaint = 0;
+    }
+
+  champlain_tile_table_remove_all (priv->pending_map);
+  g_ptr_array_set_size (priv->pending_tiles, 0);
+}
+
+
+static void
+queue_tile (ChamplainView *view,
+    gint x,
+    gint y)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  guint64 key = champlain_tile_key_new (0, priv->zoom_level, x, y);
+  PendingTile *pending;
+
+  if (champlain_tile_table_lookup (priv->pending_map, key))
+    return;
+
+  pending = g_slice_new (PendingTile);
+  pending->x = x;
+  pending->y = y;
+  pending->zoom_level = priv->zoom_level;
+  pending->distance = 0;
+
+  g_ptr_array_add (priv->pending_tiles, pending);
+  champlain_tile_table_insert (priv->pending_map, key, pending);
+}
+
+
+static gint
+compare_pending_tiles (gconstpointer a,
+    gconstpointer b)
+{
+  const PendingTile *tile_a = *(PendingTile **) a;
+  const PendingTile *tile_b = *(PendingTile **) b;
+
+  /* farthest first */
+  if (tile_a->distance > tile_b->distance)
+    return -1;
+  if (tile_a->distance < tile_b->distance)
+    return 1;
+  return 0;
+}
+
+
+/* Drops the requests which left the visible range and sorts the rest by
+ * their distance from the viewport center */
+static void
+prioritize_pending_tiles (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  gint size = champlain_map_source_get_tile_size (priv->map_source);
+  gdouble center_x = (priv->viewport_x + priv->viewport_width / 2.0) / size;
+  gdouble center_y = (priv->viewport_y + priv->viewport_height / 2.0) / size;
+  guint i = 0;
+
+  while (i < priv->pending_tiles->len)
+    {
+      PendingTile *pending = g_ptr_array_index (priv->pending_tiles, i);
+
+      if (pending->zoom_level != priv->zoom_level ||
+          pending->x < priv->tile_x_first || pending->x >= priv->tile_x_last ||
+          pending->y < priv->tile_y_first || pending->y >= priv->tile_y_last)
+        {
+          champlain_tile_table_remove (priv->pending_map,
+              champlain_tile_key_new (0, pending->zoom_level, pending->x, pending->y));
+          g_ptr_array_remove_index_fast (priv->pending_tiles, i);
+        }
+      else
+        {
+          gdouble dx = pending->x + 0.5 - center_x;
+          gdouble dy = pending->y + 0.5 - center_y;
+
+          pending->distance = dx * dx + dy * dy;
+          i++;
+        }
+    }
+
+  g_ptr_array_sort (priv->pending_tiles, compare_pending_tiles);
+}
+
+
+static void
+fill_tile (ChamplainView *view,
+    gint x,
+    gint y)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  gint size = champlain_map_source_get_tile_size (priv->map_source);
+  GList *iter;
+
+  load_tile_for_source (view, priv->map_source, 255, size, x, y);
+  for (iter = priv->overlay_sources; iter; iter = iter->next)
+    {
+      gint opacity = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (iter->data), "opacity"));
+      load_tile_for_source (view, iter->data, opacity, size, x, y);
+    }
+
+  tile_map_set (view, x, y, TRUE);
+}
+
+
+static void
+prefetch_tile_state_notify (ChamplainTile *tile,
+    G_GNUC_UNUSED GParamSpec *pspec,
+    PrefetchTile *prefetch)
+{
+  ChamplainView *view = prefetch->view;
+  ChamplainViewPrivate *priv = view->priv;
+  gdouble latency;
+
+  if (champlain_tile_get_state (tile) != CHAMPLAIN_STATE_DONE)
+    return;
+
+  latency = (g_get_monotonic_time () - prefetch->start_time) / 1000.0;
+  priv->fetch_latency = 0.8 * priv->fetch_latency + 0.2 * latency;
+
+  g_signal_handlers_disconnect_by_func (tile, prefetch_tile_state_notify, prefetch);
+  g_ptr_array_remove_fast (priv->prefetching, prefetch);
+  clutter_actor_destroy (CLUTTER_ACTOR (tile));
+  g_object_unref (tile);
+  g_slice_free (PrefetchTile, prefetch);
+
+  schedule_fill_tiles (view);
+}
+
+
+/* Loads a tile which isn't displayed so that it's in the caches when the
+ * view gets there */
+static void
+prefetch_tile (ChamplainView *view,
+    gint x,
+    gint y,
+    guint zoom_level)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  PrefetchTile *prefetch;
+  ChamplainTile *tile;
+  guint i;
+
+  for (i = 0; i < priv->prefetching->len; i++)
+    {
+      tile = ((PrefetchTile *) g_ptr_array_index (priv->prefetching, i))->tile;
+      if (champlain_tile_get_x (tile) == x && champlain_tile_get_y (tile) == y &&
+          champlain_tile_get_zoom_level (tile) == zoom_level)
+        return;
+    }
+
+  DEBUG ("Prefetching tile %d, %d, %d", zoom_level, x, y);
+
+  tile = champlain_tile_new ();
+  g_object_ref_sink (tile);
+  champlain_tile_set_x (tile, x);
+  champlain_tile_set_y (tile, y);
+  champlain_tile_set_zoom_level (tile, zoom_level);
+  champlain_tile_set_size (tile, champlain_map_source_get_tile_size (priv->map_source));
+  /* rendered after all visible tiles */
+  champlain_tile_set_load_priority (tile, G_MAXUINT);
+
+  prefetch = g_slice_new (PrefetchTile);
+  prefetch->view = view;
+  prefetch->tile = tile;
+  prefetch->start_time = g_get_monotonic_time ();
+  g_ptr_array_add (priv->prefetching, prefetch);
+
+  g_signal_connect (tile, "notify::state", G_CALLBACK (prefetch_tile_state_notify), prefetch);
+  champlain_tile_set_state (tile, CHAMPLAIN_STATE_LOADING);
+
+  /* the tile is released by prefetch_tile_state_notify() which runs inside
+   * fill_tile() when the tile is filled synchronously (e.g. from the memory
+   * cache) while the source still uses it */
+  g_object_ref (tile);
+  champlain_map_source_fill_tile (priv->map_source, tile);
+  g_object_unref (tile);
+}
+
+
+/* Whether the memory cache of the view's map source holds the decoded tile;
+ * loading it again wouldn't make it any faster to display */
 static gboolean
-fill_tile_cb (FillTileCallbackData *data)
+tile_is_decoded (ChamplainView *view,
+    gint x,
+    gint y,
+    guint zoom_level)
+{
+  ChamplainMapSource *memory_cache;
+
+  memory_cache = champlain_map_source_find_by_type (view->priv->map_source, CHAMPLAIN_TYPE_MEMORY_CACHE);
+
+  return memory_cache &&
+         champlain_memory_cache_get_content (CHAMPLAIN_MEMORY_CACHE (memory_cache), zoom_level, x, y);
+}
+
+
+static void
+queue_prefetch_tile (ChamplainView *view,
+    gint x,
+    gint y,
+    guint zoom_level,
+    gdouble distance)
+{
+  PendingTile *pending;
+
+  if (tile_is_decoded (view, x, y, zoom_level))
+    return;
+
+  pending = g_slice_new (PendingTile);
+
+  pending->x = x;
+  pending->y = y;
+  pending->zoom_level = zoom_level;
+  pending->distance = distance;
+  g_ptr_array_add (view->priv->prefetch_queue, pending);
+}
+
+
+/* Returns how many tiles can be prefetched without pushing the visible tiles
+ * out of the memory cache of the map source. When the cache keeps decoded
+ * tiles, its content size limit is divided by the decoded size of a tile.
+ * Without a memory cache, as many tiles as are visible. */
+static guint
+get_prefetch_budget (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  guint visible = (priv->tile_x_last - priv->tile_x_first) * (priv->tile_y_last - priv->tile_y_first);
+  ChamplainMapSource *cache;
+  guint content_size_limit;
+  guint capacity;
+  gint size;
+
+  cache = champlain_map_source_find_by_type (priv->map_source, CHAMPLAIN_TYPE_MEMORY_CACHE);
+  if (!cache)
+    return visible;
+
+  capacity = champlain_memory_cache_get_size_limit (CHAMPLAIN_MEMORY_CACHE (cache));
+
+  content_size_limit = champlain_memory_cache_get_content_size_limit (CHAMPLAIN_MEMORY_CACHE (cache));
+  size = champlain_map_source_get_tile_size (priv->map_source);
+  if (content_size_limit > 0 && size > 0)
+    capacity = MIN (capacity, content_size_limit / (4u * size * size));
+
+  return capacity > visible ? capacity - visible : 0;
+}
+
+
+/* Queues the parents of the visible tiles and the children of the tiles in
+ * the viewport center so that zooming in or out by one level is served from
+ * the caches. Runs only when the view has been idle for a while and queues
+ * at most as many tiles as fit into the memory cache next to the visible
+ * ones. */
+static gboolean
+zoom_prefetch_cb (ChamplainView *view)
 {
   DEBUG_LOG ()
-  
-  ChamplainView *view = data->view;
+
   ChamplainViewPrivate *priv = view->priv;
-  gint x = data->x;
-  gint y = data->y;
-  gint size = data->size;
-  gint zoom_level = data->zoom_level;
+  gint size = champlain_map_source_get_tile_size (priv->map_source);
+  guint budget = get_prefetch_budget (view);
+  guint zoom_level = priv->zoom_level;
+  gint x, y;
 
-  if (!tile_in_tile_map (view, x, y) && zoom_level == priv->zoom_level && data->map_source == priv->map_source &&
-      y >= priv->tile_y_first && y < priv->tile_y_last && x >= priv->tile_x_first && x < priv->tile_x_last)
+  priv->zoom_prefetch_timeout = 0;
+
+  /* foreground requests first */
+  if (priv->pending_tiles->len > 0 || priv->prefetch_queue->len > 0 ||
+      priv->tiles_loading > 0)
+    return FALSE;
+
+  priv->zoom_prefetch_queued = TRUE;
+
+  if (budget == 0)
+    return FALSE;
+
+  if (zoom_level < champlain_map_source_get_max_zoom_level (priv->map_source) &&
+      zoom_level < priv->max_zoom_level)
     {
-      GList *iter;
+      gint max_x_end = champlain_map_source_get_column_count (priv->map_source, zoom_level + 1);
+      gint max_y_end = champlain_map_source_get_row_count (priv->map_source, zoom_level + 1);
+      /* center in tiles of the next zoom level */
+      gdouble center_x = 2 * (priv->viewport_x + priv->viewport_width / 2.0) / size;
+      gdouble center_y = 2 * (priv->viewport_y + priv->viewport_height / 2.0) / size;
+      /* children of the 2x2 tiles around the center */
+      gint x_first = 2 * floor (center_x / 2 - 0.5);
+      gint y_first = 2 * floor (center_y / 2 - 0.5);
+
+      for (y = MAX (y_first, 0); y < MIN (y_first + 4, max_y_end); y++)
+        {
+          for (x = MAX (x_first, 0); x < MIN (x_first + 4, max_x_end); x++)
+            {
+              gdouble dx = x + 0.5 - center_x;
+              gdouble dy = y + 0.5 - center_y;
+
+              queue_prefetch_tile (view, x, y, zoom_level + 1, 1 + dx * dx + dy * dy);
+            }
+        }
+    }
+
+  if (zoom_level > champlain_map_source_get_min_zoom_level (priv->map_source) &&
+      zoom_level > priv->min_zoom_level)
+    {
+      /* the parents cover the whole view so they come first */
+      for (y = priv->tile_y_first / 2; y <= (priv->tile_y_last - 1) / 2; y++)
+        {
+          for (x = priv->tile_x_first / 2; x <= (priv->tile_x_last - 1) / 2; x++)
+            queue_prefetch_tile (view, x, y, zoom_level - 1, 0);
+        }
+    }
+
+  g_ptr_array_sort (priv->prefetch_queue, compare_pending_tiles);
+  if (priv->prefetch_queue->len > budget)
+    g_ptr_array_remove_range (priv->prefetch_queue, 0, priv->prefetch_queue->len - budget);
+
+  DEBUG ("Prefetching %u tiles of neighbouring zoom levels", priv->prefetch_queue->len);
+  schedule_fill_tiles (view);
+
+  return FALSE;
+}
+
+
+static void
+schedule_zoom_prefetch (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+
+  /* already disposed */
+  if (!priv->prefetch_queue)
+    return;
+
+  if (priv->zoom_prefetch_timeout == 0 && !priv->zoom_prefetch_queued)
+    priv->zoom_prefetch_timeout = g_timeout_add_full (G_PRIORITY_LOW,
+          ZOOM_PREFETCH_DELAY, (GSourceFunc) zoom_prefetch_cb, view, NULL);
+}
+
+
+/* Stops all prefetching, setting the state to done cancels the downloads */
+static void
+cancel_prefetch (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+
+  /* already disposed */
+  if (!priv->prefetching)
+    return;
+
+  g_ptr_array_set_size (priv->prefetch_queue, 0);
+
+  while (priv->prefetching->len > 0)
+    {
+      PrefetchTile *prefetch = g_ptr_array_index (priv->prefetching, 0);
+
+      champlain_tile_set_state (prefetch->tile, CHAMPLAIN_STATE_DONE);
+    }
+}
+
+
+/* Queues the tiles between the viewport and the place where it is predicted
+ * to be soon: where a fling stops or, when dragging, where the view gets
+ * during the time needed to fetch a tile. The number of queued tiles is
+ * limited by get_prefetch_budget() so that prefetching doesn't push the
+ * visible tiles out of the memory cache. */
+static void
+queue_prefetch_tiles (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+  gint size = champlain_map_source_get_tile_size (priv->map_source);
+  gint max_x_end = champlain_map_source_get_column_count (priv->map_source, priv->zoom_level);
+  gint max_y_end = champlain_map_source_get_row_count (priv->map_source, priv->zoom_level);
+  guint budget = get_prefetch_budget (view);
+  gdouble dx, dy, center_x, center_y;
+  gint x_first, y_first, x_last, y_last, x, y;
+
+  /* already disposed */
+  if (!priv->prefetch_queue)
+    return;
+
+  g_ptr_array_set_size (priv->prefetch_queue, 0);
+
+  if (!priv->kinetic_scroll ||
+      !champlain_kinetic_scroll_view_get_remaining_distance (
+          CHAMPLAIN_KINETIC_SCROLL_VIEW (priv->kinetic_scroll), &dx, &dy))
+    {
+      if (sqrt (priv->velocity_x * priv->velocity_x + priv->velocity_y * priv->velocity_y) < MIN_PREFETCH_SPEED)
+        return;
 
-      load_tile_for_source (view, priv->map_source, 255, size, x, y);
-      for (iter = priv->overlay_sources; iter; iter = iter->next)
+      /* look ahead twice the fetch time, at least one tile */
+      dx = priv->velocity_x * 2 * priv->fetch_latency / 1000.0;
+      dy = priv->velocity_y * 2 * priv->fetch_latency / 1000.0;
+      if (ABS (dx) < size && ABS (dy) < size)
         {
-          gint opacity = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (iter->data), "opacity"));
-          load_tile_for_source (view, iter->data, opacity, size, x, y);
+          gdouble scale = size / MAX (ABS (dx), ABS (dy));
+
+          dx *= scale;
+          dy *= scale;
         }
+    }
+
+  x_first = floor ((priv->viewport_x + MIN (dx, 0)) / size);
+  y_first = floor ((priv->viewport_y + MIN (dy, 0)) / size);
+  x_last = ceil ((priv->viewport_x + priv->viewport_width + MAX (dx, 0)) / size) + 1;
+  y_last = ceil ((priv->viewport_y + priv->viewport_height + MAX (dy, 0)) / size) + 1;
 
-      tile_map_set (view, x, y, TRUE);
+  x_first = CLAMP (x_first, 0, max_x_end);
+  y_first = CLAMP (y_first, 0, max_y_end);
+  x_last = CLAMP (x_last, x_first, max_x_end);
+  y_last = CLAMP (y_last, y_first, max_y_end);
+
+  center_x = (priv->viewport_x + dx + priv->viewport_width / 2.0) / size;
+  center_y = (priv->viewport_y + dy + priv->viewport_height / 2.0) / size;
+
+  for (y = y_first; y < y_last; y++)
+    {
+      for (x = x_first; x < x_last; x++)
+        {
+          PendingTile *pending;
+          gdouble tile_dx = x + 0.5 - center_x;
+          gdouble tile_dy = y + 0.5 - center_y;
+
+          if (x >= priv->tile_x_first && x < priv->tile_x_last &&
+              y >= priv->tile_y_first && y < priv->tile_y_last)
+            continue;
+
+          pending = g_slice_new (PendingTile);
+          pending->x = x;
+          pending->y = y;
+          pending->zoom_level = priv->zoom_level;
+          pending->distance = tile_dx * tile_dx + tile_dy * tile_dy;
+          g_ptr_array_add (priv->prefetch_queue, pending);
+        }
     }
 
-  g_object_unref (view);
-  g_slice_free (FillTileCallbackData, data);
+  /* keep the tiles closest to the predicted position */
+  g_ptr_array_sort (priv->prefetch_queue, compare_pending_tiles);
+  if (priv->prefetch_queue->len > budget)
+    g_ptr_array_remove_range (priv->prefetch_queue, 0, priv->prefetch_queue->len - budget);
+
+  DEBUG ("Prefetching %u tiles towards %f, %f", priv->prefetch_queue->len, dx, dy);
+}
+
 
+static gboolean
+can_fill_tiles (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+
+  if (priv->pending_tiles->len > 0)
+    return priv->tiles_loading < MAX_TILES_LOADING;
+
+  /* the visible tiles have priority over the prefetched ones */
+  return priv->prefetch_queue->len > 0 &&
+         priv->prefetching->len < MAX_TILES_PREFETCHING &&
+         priv->tiles_loading + (gint) priv->prefetching->len < MAX_TILES_LOADING;
+}
+
+
+/* Called before every frame, starts loading the most important pending
+ * tiles while there are less than MAX_TILES_LOADING tiles being loaded and
+ * FILL_TILES_BUDGET isn't exceeded. Tiles found in the memory cache get their
+ * content within the fill so the budget covers that too. */
+static gboolean
+fill_tiles_cb (ChamplainView *view)
+{
+  DEBUG_LOG ()
+
+  ChamplainViewPrivate *priv = view->priv;
+  gint64 deadline = g_get_monotonic_time () + FILL_TILES_BUDGET;
+
+  while (can_fill_tiles (view) && g_get_monotonic_time () < deadline)
+    {
+      if (priv->pending_tiles->len > 0)
+        {
+          guint last = priv->pending_tiles->len - 1;
+          PendingTile *pending = g_ptr_array_index (priv->pending_tiles, last);
+          gint x = pending->x;
+          gint y = pending->y;
+
+          champlain_tile_table_remove (priv->pending_map,
+              champlain_tile_key_new (0, pending->zoom_level, x, y));
+          g_ptr_array_remove_index (priv->pending_tiles, last);
+
+          if (!tile_in_tile_map (view, x, y))
+            fill_tile (view, x, y);
+        }
+      else
+        {
+          guint last = priv->prefetch_queue->len - 1;
+          PendingTile *pending = g_ptr_array_index (priv->prefetch_queue, last);
+          guint zoom_level = pending->zoom_level;
+          gint x = pending->x;
+          gint y = pending->y;
+
+          g_ptr_array_remove_index (priv->prefetch_queue, last);
+
+          if (zoom_level != priv->zoom_level || !tile_in_tile_map (view, x, y))
+            prefetch_tile (view, x, y, zoom_level);
+        }
+    }
+
+  if (can_fill_tiles (view))
+    {
+      /* continue in the next frame */
+      clutter_actor_queue_redraw (CLUTTER_ACTOR (view));
+      return TRUE;
+    }
+
+  priv->fill_tiles_repaint = 0;
   return FALSE;
 }
 
 
+static void
+schedule_fill_tiles (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+
+  /* already disposed */
+  if (!priv->pending_tiles)
+    return;
+
+  if (priv->fill_tiles_repaint == 0 && can_fill_tiles (view))
+    {
+      priv->fill_tiles_repaint = clutter_threads_add_repaint_func_full (CLUTTER_REPAINT_FLAGS_PRE_PAINT,
+            (GSourceFunc) fill_tiles_cb, view, NULL);
+      clutter_actor_queue_redraw (CLUTTER_ACTOR (view));
+    }
+}
+
+
 static void
 load_visible_tiles (ChamplainView *view,
     gboolean relocate)
@@ -1984,13 +2979,10 @@ load_visible_tiles (ChamplainView *view,
   DEBUG_LOG ()
 
   ChamplainViewPrivate *priv = view->priv;
-  ClutterActorIter iter;
   gint size;
   ClutterActor *child;
   gint x_count, y_count, max_x_end, max_y_end;
-  gint arm_size, arm_max, turn;
-  gint dirs[5] = { 0, 1, 0, -1, 0 };
-  gint i, x, y;
+  gint x, y;
 
   size = champlain_map_source_get_tile_size (priv->map_source);
 
@@ -2019,61 +3011,54 @@ load_visible_tiles (ChamplainView *view,
       fill_background_tiles (view);
 
   /* Get rid of old tiles first */
-  clutter_actor_iter_init (&iter, priv->map_layer);
-  while (clutter_actor_iter_next (&iter, &child))
+  child = clutter_actor_get_first_child (priv->map_layer);
+  while (child != NULL)
     {
       ChamplainTile *tile = CHAMPLAIN_TILE (child);
+      gint tile_x, tile_y;
+
+      /* the tile may get destroyed */
+      child = clutter_actor_get_next_sibling (child);
 
-      gint tile_x = champlain_tile_get_x (tile);
-      gint tile_y = champlain_tile_get_y (tile);
+      if (tile_is_pooled (tile))
+        continue;
+
+      tile_x = champlain_tile_get_x (tile);
+      tile_y = champlain_tile_get_y (tile);
 
       if (tile_x < priv->tile_x_first || tile_x >= priv->tile_x_last || 
           tile_y < priv->tile_y_first || tile_y >= priv->tile_y_last)
         {
-          champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
-          clutter_actor_iter_destroy (&iter);
+          release_tile (view, tile);
           tile_map_set (view, tile_x, tile_y, FALSE);
         }
       else if (relocate)
         champlain_viewport_set_actor_position (CHAMPLAIN_VIEWPORT (priv->viewport), CLUTTER_ACTOR (tile), tile_x * size, tile_y * size);
     }
 
-  /* Load new tiles if needed */
-  x = priv->tile_x_first + x_count / 2 - 1;
-  y = priv->tile_y_first + y_count / 2 - 1;
-  arm_max = MAX (x_count, y_count) + 2;
-  arm_size = 1;
-
-  for (turn = 0; arm_size < arm_max; turn++)
+  /* Queue new tiles if needed, they are loaded in the order of their
+   * distance from the viewport center */
+  for (y = priv->tile_y_first; y < priv->tile_y_last; y++)
     {
-      for (i = 0; i < arm_size; i++)
+      for (x = priv->tile_x_first; x < priv->tile_x_last; x++)
         {
-          if (!tile_in_tile_map (view, x, y) && y >= priv->tile_y_first && y < priv->tile_y_last && x >= priv->tile_x_first && x < priv->tile_x_last)
-            {
-              FillTileCallbackData *data;
-
-              DEBUG ("Loading tile %d, %d, %d", priv->zoom_level, x, y);
-
-              data = g_slice_new (FillTileCallbackData);
-              data->x = x;
-              data->y = y;
-              data->size = size;
-              data->zoom_level = priv->zoom_level;
-              /* used only to check that the map source didn't change before the
-               * idle function is called */
-              data->map_source = priv->map_source;
-              data->view = g_object_ref (view);
-
-              g_idle_add_full (CLUTTER_PRIORITY_REDRAW, (GSourceFunc) fill_tile_cb, data, NULL);
-            }
-
-          x += dirs[turn % 4 + 1];
-          y += dirs[turn % 4];
+          if (!tile_in_tile_map (view, x, y))
+            queue_tile (view, x, y);
         }
+    }
 
-      if (turn % 2 == 1)
-        arm_size++;
+  /* the neighbouring zoom levels are prefetched again for the new range
+   * once the view is idle */
+  if (priv->zoom_prefetch_timeout != 0)
+    {
+      g_source_remove (priv->zoom_prefetch_timeout);
+      priv->zoom_prefetch_timeout = 0;
     }
+  priv->zoom_prefetch_queued = FALSE;
+
+  prioritize_pending_tiles (view);
+  queue_prefetch_tiles (view);
+  schedule_fill_tiles (view);
 }
 
 
@@ -2083,18 +3068,49 @@ remove_all_tiles (ChamplainView *view)
   DEBUG_LOG ()
 
   ChamplainViewPrivate *priv = view->priv;
-  ClutterActorIter iter;
   ClutterActor *child;
 
   clutter_actor_destroy_all_children (priv->zoom_layer);
 
-  clutter_actor_iter_init (&iter, priv->map_layer);
-  while (clutter_actor_iter_next (&iter, &child))
-    champlain_tile_set_state (CHAMPLAIN_TILE (child), CHAMPLAIN_STATE_DONE);
+  clear_pending_tiles (view);
+  /* tiles being prefetched may be the ones needed after zooming */
+  if (priv->prefetch_queue)
+    g_ptr_array_set_size (priv->prefetch_queue, 0);
+
+  child = clutter_actor_get_first_child (priv->map_layer);
+  while (child != NULL)
+    {
+      ChamplainTile *tile = CHAMPLAIN_TILE (child);
 
-  g_hash_table_remove_all (priv->tile_map);
+      child = clutter_actor_get_next_sibling (child);
+      if (!tile_is_pooled (tile))
+        release_tile (view, tile);
+    }
+
+  champlain_tile_table_remove_all (priv->tile_map);
 
-  clutter_actor_destroy_all_children (priv->map_layer);
+  if (priv->fade_per_layer)
+    {
+      /* shown again by fade_in_layer () */
+      clutter_actor_remove_all_transitions (priv->map_layer);
+      clutter_actor_set_opacity (priv->map_layer, 0);
+      priv->layer_fade_pending = TRUE;
+    }
+}
+
+
+static void
+fade_in_layer (ChamplainView *view)
+{
+  ChamplainViewPrivate *priv = view->priv;
+
+  priv->layer_fade_pending = FALSE;
+
+  clutter_actor_save_easing_state (priv->map_layer);
+  clutter_actor_set_easing_mode (priv->map_layer, CLUTTER_EASE_IN_CUBIC);
+  clutter_actor_set_easing_duration (priv->map_layer, 350);
+  clutter_actor_set_opacity (priv->map_layer, 255);
+  clutter_actor_restore_easing_state (priv->map_layer);
 }
 
 
@@ -2112,6 +3128,7 @@ champlain_view_reload_tiles (ChamplainView *view)
   DEBUG_LOG ()
 
   remove_all_tiles (view);
+  cancel_prefetch (view);
 
   load_visible_tiles (view, FALSE);
 }
@@ -2157,7 +3174,14 @@ tile_state_notify (ChamplainTile *tile,
           g_object_notify (G_OBJECT (view), "state");
           if (clutter_actor_get_n_children (priv->zoom_layer) > 0)
             priv->zoom_actor_timeout = g_timeout_add_seconds_full (CLUTTER_PRIORITY_REDRAW, 1, (GSourceFunc) remove_zoom_actor_cb, view, NULL);
+          schedule_zoom_prefetch (view);
+
+          if (priv->layer_fade_pending && priv->pending_tiles->len == 0)
+            fade_in_layer (view);
         }
+
+      /* make room for the next pending tile */
+      schedule_fill_tiles (view);
     }
 }
 
@@ -2209,7 +3233,8 @@ champlain_view_set_map_source (ChamplainView *view,
       priv->zoom_level = priv->min_zoom_level;
       g_object_notify (G_OBJECT (view), "zoom-level");
     }
-    
+
+  champlain_map_source_warm_up (priv->map_source);
   champlain_view_reload_tiles (view);
 
   g_object_notify (G_OBJECT (view), "map-source");
@@ -2330,6 +3355,38 @@ champlain_view_set_animate_zoom (ChamplainView *view,
 }
 
 
+/**
+ * champlain_view_set_fade_per_layer:
+ * @view: a #ChamplainView
+ * @value: a #gboolean
+ *
+ * Should the view fade in all tiles together instead of one by one. See
+ * #ChamplainView:fade-per-layer.
+ *
+ * Since: 0.12.6
+ */
+void
+champlain_view_set_fade_per_layer (ChamplainView *view,
+    gboolean value)
+{
+  DEBUG_LOG ()
+
+  g_return_if_fail (CHAMPLAIN_IS_VIEW (view));
+
+  ChamplainViewPrivate *priv = view->priv;
+
+  priv->fade_per_layer = value;
+
+  if (!value && priv->layer_fade_pending)
+    {
+      priv->layer_fade_pending = FALSE;
+      clutter_actor_set_opacity (priv->map_layer, 255);
+    }
+
+  g_object_notify (G_OBJECT (view), "fade-per-layer");
+}
+
+
 /**
  * champlain_view_ensure_visible:
  * @view: a #ChamplainView
@@ -2576,6 +3633,10 @@ show_zoom_actor (ChamplainView *view,
           gint tile_y = champlain_tile_get_y (tile);
           gboolean overlay = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (tile), "overlay"));
 
+          /* the pool stays in map_layer */
+          if (tile_is_pooled (tile))
+            continue;
+
           champlain_tile_set_state (tile, CHAMPLAIN_STATE_DONE);
 
           g_object_ref (CLUTTER_ACTOR (tile));
@@ -2604,7 +3665,9 @@ show_zoom_actor (ChamplainView *view,
 
   if (priv->animate_zoom)
     {
-      clutter_actor_set_opacity (priv->map_layer, 0);
+      /* with fade_per_layer, the layer fades in once loaded */
+      if (!priv->fade_per_layer)
+        clutter_actor_set_opacity (priv->map_layer, 0);
 
       clutter_actor_destroy_all_children (priv->zoom_layer);
 
@@ -2614,11 +3677,14 @@ show_zoom_actor (ChamplainView *view,
       clutter_actor_set_scale (zoom_actor, deltazoom, deltazoom);
       clutter_actor_restore_easing_state (zoom_actor);
 
-      clutter_actor_save_easing_state (priv->map_layer);
-      clutter_actor_set_easing_mode (priv->map_layer, CLUTTER_EASE_IN_EXPO);
-      clutter_actor_set_easing_duration (priv->map_layer, 350);
-      clutter_actor_set_opacity (priv->map_layer, 255);
-      clutter_actor_restore_easing_state (priv->map_layer);
+      if (!priv->fade_per_layer)
+        {
+          clutter_actor_save_easing_state (priv->map_layer);
+          clutter_actor_set_easing_mode (priv->map_layer, CLUTTER_EASE_IN_EXPO);
+          clutter_actor_set_easing_duration (priv->map_layer, 350);
+          clutter_actor_set_opacity (priv->map_layer, 255);
+          clutter_actor_restore_easing_state (priv->map_layer);
+        }
         
       if (!priv->animating_zoom)
         {
@@ -2879,6 +3945,27 @@ champlain_view_get_animate_zoom (ChamplainView *view)
 }
 
 
+/**
+ * champlain_view_get_fade_per_layer:
+ * @view: a #ChamplainView
+ *
+ * Checks whether the view fades in all tiles together instead of one by one.
+ *
+ * Returns: TRUE if the tiles fade in together, FALSE otherwise.
+ *
+ * Since: 0.12.6
+ */
+gboolean
+champlain_view_get_fade_per_layer (ChamplainView *view)
+{
+  DEBUG_LOG ()
+
+  g_return_val_if_fail (CHAMPLAIN_IS_VIEW (view), FALSE);
+
+  return view->priv->fade_per_layer;
+}
+
+
 static ClutterActorAlign
 bin_alignment_to_actor_align (ClutterBinAlignment alignment)
 {
@@ -3086,6 +4173,7 @@ champlain_view_add_overlay_source (ChamplainView *view,
   g_object_set_data (G_OBJECT (source), "opacity", GINT_TO_POINTER (opacity));
   g_object_notify (G_OBJECT (view), "map-source");
 
+  champlain_map_source_warm_up (source);
   champlain_view_reload_tiles (view);
 }
 
@@ -124,6 +124,8 @@ void champlain_view_set_zoom_on_double_click (ChamplainView *view,
     gboolean value);
 void champlain_view_set_animate_zoom (ChamplainView *view,
     gboolean value);
+void champlain_view_set_fade_per_layer (ChamplainView *view,
+    gboolean value);
 void champlain_view_set_background_pattern (ChamplainView *view,
     ClutterContent *background);
 
@@ -141,6 +143,7 @@ gboolean champlain_view_get_kinetic_mode (ChamplainView *view);
 gboolean champlain_view_get_keep_center_on_resize (ChamplainView *view);
 gboolean champlain_view_get_zoom_on_double_click (ChamplainView *view);
 gboolean champlain_view_get_animate_zoom (ChamplainView *view);
+gboolean champlain_view_get_fade_per_layer (ChamplainView *view);
 ChamplainState champlain_view_get_state (ChamplainView *view);
 ClutterContent *champlain_view_get_background_pattern (ChamplainView *view);
 
@@ -58,6 +58,9 @@
 
 #include "champlain/champlain-memory-cache.h"
 #include "champlain/champlain-file-cache.h"
+#include "champlain/champlain-packed-cache.h"
+
+#include "champlain/champlain-tile-downloader.h"
 
 #include "champlain/champlain-image-renderer.h"
 #include "champlain/champlain-error-tile-renderer.h"
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2010-2013 Jiri Techet <techet@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Pans the view by a fixed distance every frame and reports the frame times,
+ * the number of tile actors the view created and the number of memory
+ * allocations done while panning. Without arguments the tiles are rendered
+ * locally by the error tile source so that the network doesn't influence the
+ * result; a map source id can be passed to use a cached source of the
+ * factory instead.
+ *
+ * Allocations are counted by a g_mem_set_vtable() wrapper, which GLib 2.46
+ * and newer ignore. With those versions the number of ChamplainTile
+ * instances alive at the end is reported instead when the benchmark runs
+ * with GOBJECT_DEBUG=instance-count.
+ */
+
+#include <champlain/champlain.h>
+#include <stdlib.h>
+
+#define DURATION 10
+#define PAN_STEP 16
+
+static ClutterActor *view;
+static gint64 start_time = 0;
+static gint64 last_frame_time = 0;
+static gint64 max_frame_interval = 0;
+static guint n_frames = 0;
+static guint n_tiles_added = 0;
+static volatile gint n_allocs = 0;
+static gint start_allocs = 0;
+
+
+#if !GLIB_CHECK_VERSION (2, 46, 0)
+static gpointer
+counting_malloc (gsize n_bytes)
+{
+  g_atomic_int_inc (&n_allocs);
+  return malloc (n_bytes);
+}
+
+
+static gpointer
+counting_realloc (gpointer mem,
+    gsize n_bytes)
+{
+  g_atomic_int_inc (&n_allocs);
+  return realloc (mem, n_bytes);
+}
+
+
+static gpointer
+counting_calloc (gsize n_blocks,
+    gsize n_block_bytes)
+{
+  g_atomic_int_inc (&n_allocs);
+  return calloc (n_blocks, n_block_bytes);
+}
+
+
+static GMemVTable counting_vtable = {
+  counting_malloc,
+  counting_realloc,
+  free,
+  counting_calloc,
+  counting_malloc,
+  counting_realloc
+};
+#endif
+
+
+/* Counts tiles getting a parent, which happens only for new tile actors
+ * while the view is panned */
+static gboolean
+parent_set_hook (GSignalInvocationHint *ihint,
+    guint n_param_values,
+    const GValue *param_values,
+    gpointer data)
+{
+  GObject *actor = g_value_get_object (&param_values[0]);
+
+  if (CHAMPLAIN_IS_TILE (actor) && clutter_actor_get_parent (CLUTTER_ACTOR (actor)))
+    n_tiles_added++;
+
+  return TRUE;
+}
+
+
+static void
+after_paint_cb (ClutterActor *stage)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  if (last_frame_time > 0)
+    max_frame_interval = MAX (max_frame_interval, now - last_frame_time);
+  last_frame_time = now;
+  n_frames++;
+}
+
+
+static gboolean
+pan_cb (gpointer data)
+{
+  ChamplainView *champlain_view = CHAMPLAIN_VIEW (view);
+  gdouble lon, lat;
+
+  if (g_get_monotonic_time () - start_time >= DURATION * G_USEC_PER_SEC)
+    {
+      g_print ("%u frames in %d s, mean frame interval %.2f ms, max %.2f ms\n",
+          n_frames, DURATION,
+          n_frames > 0 ? DURATION * 1000.0 / n_frames : 0.0,
+          max_frame_interval / 1000.0);
+      g_print ("%u tile actors created\n", n_tiles_added);
+#if GLIB_CHECK_VERSION (2, 46, 0)
+      g_print ("%d tiles alive\n", g_type_get_instance_count (CHAMPLAIN_TYPE_TILE));
+#else
+      g_print ("%d allocations\n", g_atomic_int_get (&n_allocs) - start_allocs);
+#endif
+      clutter_main_quit ();
+      return FALSE;
+    }
+
+  lon = champlain_view_x_to_longitude (champlain_view,
+        clutter_actor_get_width (view) / 2 + PAN_STEP);
+  lat = champlain_view_y_to_latitude (champlain_view,
+        clutter_actor_get_height (view) / 2 + PAN_STEP / 2);
+  champlain_view_center_on (champlain_view, lat, lon);
+
+  return TRUE;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  ClutterActor *stage;
+  ChamplainMapSourceFactory *factory;
+  ChamplainMapSource *source;
+
+#if !GLIB_CHECK_VERSION (2, 46, 0)
+  /* has to be done before anything is allocated */
+  g_mem_set_vtable (&counting_vtable);
+#endif
+
+  if (clutter_init (&argc, &argv) != CLUTTER_INIT_SUCCESS)
+    return 1;
+
+  stage = clutter_stage_new ();
+  clutter_actor_set_size (stage, 800, 600);
+  g_signal_connect (stage, "destroy", G_CALLBACK (clutter_main_quit), NULL);
+  g_signal_connect (stage, "after-paint", G_CALLBACK (after_paint_cb), NULL);
+
+  view = champlain_view_new ();
+  clutter_actor_set_size (view, 800, 600);
+  clutter_actor_add_child (stage, view);
+
+  factory = champlain_map_source_factory_dup_default ();
+  if (argc > 1)
+    source = champlain_map_source_factory_create_cached_source (factory, argv[1]);
+  else
+    source = champlain_map_source_factory_create_error_source (factory, 256);
+  champlain_view_set_map_source (CHAMPLAIN_VIEW (view), source);
+  g_object_unref (factory);
+
+  champlain_view_set_zoom_level (CHAMPLAIN_VIEW (view), 12);
+  champlain_view_center_on (CHAMPLAIN_VIEW (view), 45.466, -73.75);
+
+  g_signal_add_emission_hook (g_signal_lookup ("parent-set", CLUTTER_TYPE_ACTOR), 0,
+      parent_set_hook, NULL, NULL);
+
+  clutter_actor_show (stage);
+
+  start_time = g_get_monotonic_time ();
+  start_allocs = g_atomic_int_get (&n_allocs);
+  g_timeout_add (16, pan_cb, NULL);
+  clutter_main ();
+
+  return 0;
+}